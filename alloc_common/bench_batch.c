@@ -0,0 +1,92 @@
+/*
+ * Cost per object of mem_alloc_batch and mem_free_batch against as many
+ * mem_alloc and mem_free calls, for a few block and batch sizes.
+ *
+ * Usage: bench_batch [objects_per_case]
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_BATCH 256
+#define REPETITIONS 5
+
+static const size_t sizes[] = { 16, 64, 256, 2048 };
+static const size_t batches[] = { 8, 32, 256 };
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Allocate and free \a rounds batches of \a batch blocks
+ * @param batch_calls Use the batch calls instead of one call per block
+ * @return Nanoseconds per allocated and freed block, 0 when out of memory
+ */
+static double run(size_t size, size_t batch, size_t rounds, int batch_calls) {
+    void* blocks[MAX_BATCH];
+    const double start = now();
+    for (size_t round = 0; round < rounds; ++round) {
+        if (batch_calls) {
+            if (mem_alloc_batch(size, batch, blocks) != batch) return 0;
+            mem_free_batch(blocks, batch);
+        } else {
+            for (size_t i = 0; i < batch; ++i) {
+                if ((blocks[i] = mem_alloc(size)) == NULL) return 0;
+            }
+            for (size_t i = 0; i < batch; ++i) {
+                mem_free(blocks[i]);
+            }
+        }
+    }
+    return (now() - start) * 1e9 / (rounds * batch);
+}
+
+/**
+ * Fastest of REPETITIONS runs
+ */
+static double best_run(size_t size, size_t batch, size_t rounds, int batch_calls) {
+    double best = 0;
+    for (size_t i = 0; i < REPETITIONS; ++i) {
+        const double time = run(size, batch, rounds, batch_calls);
+        if (time == 0) return 0;
+        if (best == 0 || time < best) {
+            best = time;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const size_t objects = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    if (!mem_init_growable(4 << 20)) {
+        fprintf(stderr, "mem_init_growable failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %8s %14s %14s %8s\n", "size", "batch", "single ns/obj", "batch ns/obj",
+            "saving");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); ++b) {
+            const size_t rounds = objects / batches[b] + 1;
+            // warm the heap and the thread cache up
+            run(sizes[s], batches[b], rounds / 10 + 1, 0);
+            const double single = best_run(sizes[s], batches[b], rounds, 0);
+            const double batched = best_run(sizes[s], batches[b], rounds, 1);
+            if (single == 0 || batched == 0) {
+                printf("%8zu %8zu out of memory\n", sizes[s], batches[b]);
+                continue;
+            }
+            printf("%8zu %8zu %14.1f %14.1f %7.0f%%\n", sizes[s], batches[b],
+                    single, batched, 100 * (1 - batched / single));
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,565 @@
+/*
+ * Microbenchmarks of mem_alloc, mem_free and mem_realloc against the system
+ * malloc, free and realloc on common allocation patterns.
+ *
+ * Every run of a case is a child process of its own, so it starts from a
+ * fresh heap and its peak RSS is its own. Runs are repeated and medians are
+ * printed. Cycles and cache misses come from perf_event_open and are left
+ * out when the kernel does not allow it.
+ *
+ * Usage: bench_micro [-r repetitions] [-s scale] [-f filter]
+ *                    [-o results.csv] [-b baseline.csv] [-t tolerance]
+ *   -r  runs of every case, 5 by default
+ *   -s  multiplies the work of every case, 1 by default
+ *   -f  only cases whose name contains filter
+ *   -o  write the medians as CSV, usable later as a baseline
+ *   -b  exit with status 2 when a case got slower than in the baseline.
+ *       Cases are compared by their time relative to the system allocator
+ *       in the same run, which hides most of the machine's noise
+ *   -t  allowed slowdown in percent, 10 by default
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CASES 64
+#define MAX_REPETITIONS 101
+#define BATCH 1024
+#define SWEEP_BATCH 64
+#define RANDOM_SLOTS 4096
+#define QUEUE_SIZE 1024
+#define CHAINS 4
+
+typedef struct Allocator {
+    const char* name;
+    void* (*alloc)(size_t size);
+    void (*free)(void* addr);
+    void* (*realloc)(void* addr, size_t size);
+} Allocator;
+
+static const Allocator allocators[] = {
+    { "mem", mem_alloc, mem_free, mem_realloc },
+    { "system", malloc, free, realloc },
+};
+
+enum { allocator_count = sizeof(allocators) / sizeof(allocators[0]) };
+
+/**
+ * Allocation pattern
+ * @param allocator Allocator under test
+ * @param size Pattern parameter, usually the block size
+ * @param count Number of rounds
+ * @return Number of allocator calls made
+ */
+typedef size_t (*Pattern)(const Allocator* allocator, size_t size, size_t count);
+
+typedef struct Case {
+    char name[32];
+    Pattern pattern;
+    size_t size;
+    size_t count;
+} Case;
+
+/**
+ * Medians of the runs of a case with one allocator
+ */
+typedef struct Result {
+    double ns_per_op;
+    /**
+     * (slowest - fastest) / median run time
+     */
+    double spread;
+    /**
+     * Negative when not counted
+     */
+    double cycles_per_op;
+    double misses_per_op;
+    long peak_rss_kb;
+} Result;
+
+/**
+ * Measurement of one run, sent by the child process
+ */
+typedef struct Run {
+    bool ok;
+    double ns_per_op;
+    double cycles_per_op;
+    double misses_per_op;
+    long peak_rss_kb;
+} Run;
+
+static Case cases[MAX_CASES];
+static size_t case_count = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Write to a new block the way a program would, so its memory gets mapped
+ */
+static void touch(void* addr) {
+    if (addr != NULL) {
+        *(volatile char*)addr = 1;
+    }
+}
+
+/**
+ * Allocate a batch, then free it newest first
+ */
+static size_t lifo(const Allocator* allocator, size_t size, size_t count) {
+    void* blocks[BATCH];
+    for (size_t round = 0; round < count; ++round) {
+        for (size_t i = 0; i < BATCH; ++i) {
+            touch(blocks[i] = allocator->alloc(size));
+        }
+        for (size_t i = BATCH; i-- > 0;) {
+            allocator->free(blocks[i]);
+        }
+    }
+    return 2 * BATCH * count;
+}
+
+/**
+ * Allocate a batch, then free it oldest first
+ */
+static size_t fifo(const Allocator* allocator, size_t size, size_t count) {
+    void* blocks[BATCH];
+    for (size_t round = 0; round < count; ++round) {
+        for (size_t i = 0; i < BATCH; ++i) {
+            touch(blocks[i] = allocator->alloc(size));
+        }
+        for (size_t i = 0; i < BATCH; ++i) {
+            allocator->free(blocks[i]);
+        }
+    }
+    return 2 * BATCH * count;
+}
+
+/**
+ * Allocate a small batch of blocks of one size, then free it newest first
+ */
+static size_t size_sweep(const Allocator* allocator, size_t size, size_t count) {
+    void* blocks[SWEEP_BATCH];
+    for (size_t round = 0; round < count; ++round) {
+        for (size_t i = 0; i < SWEEP_BATCH; ++i) {
+            touch(blocks[i] = allocator->alloc(size));
+        }
+        for (size_t i = SWEEP_BATCH; i-- > 0;) {
+            allocator->free(blocks[i]);
+        }
+    }
+    return 2 * SWEEP_BATCH * count;
+}
+
+/**
+ * Replace random blocks of a working set with blocks of 8 to size bytes
+ */
+static size_t random_lifetime(const Allocator* allocator, size_t size, size_t count) {
+    static void* slots[RANDOM_SLOTS];
+    uint64_t random = 0x9E3779B97F4A7C15ull;
+    size_t calls = 0;
+    for (size_t i = 0; i < count * BATCH; ++i) {
+        const size_t slot = next_random(&random) % RANDOM_SLOTS;
+        if (slots[slot] != NULL) {
+            allocator->free(slots[slot]);
+            ++calls;
+        }
+        touch(slots[slot] = allocator->alloc(8 + next_random(&random) % (size - 7)));
+        ++calls;
+    }
+    for (size_t slot = 0; slot < RANDOM_SLOTS; ++slot) {
+        if (slots[slot] != NULL) {
+            allocator->free(slots[slot]);
+            slots[slot] = NULL;
+            ++calls;
+        }
+    }
+    return calls;
+}
+
+/**
+ * Single-producer single-consumer ring of blocks
+ */
+typedef struct Queue {
+    const Allocator* allocator;
+    size_t blocks;
+    void* slots[QUEUE_SIZE];
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+} Queue;
+
+static void* consume(void* arg) {
+    Queue* const queue = arg;
+    for (size_t i = 0; i < queue->blocks; ++i) {
+        while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail) {
+            sched_yield();
+        }
+        queue->allocator->free(queue->slots[queue->tail % QUEUE_SIZE]);
+        __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * One thread allocates, another one frees
+ */
+static size_t producer_consumer(const Allocator* allocator, size_t size, size_t count) {
+    static Queue queue;
+    queue.allocator = allocator;
+    queue.blocks = count * BATCH;
+    queue.head = queue.tail = 0;
+
+    pthread_t consumer;
+    if (pthread_create(&consumer, NULL, consume, &queue) != 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < queue.blocks; ++i) {
+        while (queue.head - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+            sched_yield();
+        }
+        void* const block = allocator->alloc(size);
+        touch(block);
+        queue.slots[queue.head % QUEUE_SIZE] = block;
+        __atomic_store_n(&queue.head, queue.head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(consumer, NULL);
+    return 2 * queue.blocks;
+}
+
+/**
+ * Grow CHAINS interleaved blocks from 16 bytes to size, by 16 bytes when
+ * linear is set and by half of their size otherwise
+ */
+static size_t realloc_chains(const Allocator* allocator, size_t size, size_t count,
+        bool linear) {
+    size_t calls = 0;
+    for (size_t round = 0; round < count; ++round) {
+        void* chains[CHAINS] = { NULL };
+        for (size_t length = 16; length <= size;
+                length = linear ? length + 16 : length + length / 2) {
+            for (size_t i = 0; i < CHAINS; ++i) {
+                void* const grown = allocator->realloc(chains[i], length);
+                if (grown != NULL) {
+                    chains[i] = grown;
+                    ((volatile char*)grown)[length - 1] = 1;
+                }
+                ++calls;
+            }
+        }
+        for (size_t i = 0; i < CHAINS; ++i) {
+            allocator->free(chains[i]);
+            ++calls;
+        }
+    }
+    return calls;
+}
+
+static size_t realloc_linear(const Allocator* allocator, size_t size, size_t count) {
+    return realloc_chains(allocator, size, count, true);
+}
+
+static size_t realloc_geometric(const Allocator* allocator, size_t size, size_t count) {
+    return realloc_chains(allocator, size, count, false);
+}
+
+static void add_case(const char* name, Pattern pattern, size_t size, size_t count) {
+    if (case_count == MAX_CASES) {
+        return;
+    }
+    Case* const c = &cases[case_count++];
+    snprintf(c->name, sizeof(c->name), "%s/%zu", name, size);
+    c->pattern = pattern;
+    c->size = size;
+    c->count = count > 0 ? count : 1;
+}
+
+static void add_cases(double scale) {
+    add_case("lifo", lifo, 64, 400 * scale);
+    add_case("fifo", fifo, 64, 400 * scale);
+    add_case("random", random_lifetime, 512, 400 * scale);
+    add_case("producer_consumer", producer_consumer, 64, 200 * scale);
+    // the same amount of memory goes through every size, within limits
+    for (size_t size = 8; size <= (1 << 20); size *= 2) {
+        size_t count = ((size_t)256 << 20) / (size * SWEEP_BATCH);
+        count = count < 16 ? 16 : count > 4096 ? 4096 : count;
+        add_case("size", size_sweep, size, count * scale);
+    }
+    add_case("realloc_linear", realloc_linear, 4096, 400 * scale);
+    add_case("realloc_geometric", realloc_geometric, 1 << 20, 400 * scale);
+}
+
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double read_counter(int fd, size_t calls) {
+    uint64_t value;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return -1;
+    }
+    return (double)value / calls;
+}
+
+static long peak_rss_kb(void) {
+    FILE* const status = fopen("/proc/self/status", "r");
+    if (status == NULL) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+/**
+ * Body of the child process: warm the heap up, then measure
+ */
+static Run measure(const Case* c, const Allocator* allocator) {
+    Run run = { .ok = false };
+    if (allocator->alloc == mem_alloc && !mem_init_growable(4 << 20)) {
+        return run;
+    }
+    c->pattern(allocator, c->size, c->count / 8 + 1);
+
+    const int cycles = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+    const int misses = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    if (cycles >= 0) ioctl(cycles, PERF_EVENT_IOC_ENABLE, 0);
+    if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+    const double start = now_ns();
+    const size_t calls = c->pattern(allocator, c->size, c->count);
+    const double elapsed = now_ns() - start;
+    if (cycles >= 0) ioctl(cycles, PERF_EVENT_IOC_DISABLE, 0);
+    if (misses >= 0) ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+    if (calls == 0) {
+        return run;
+    }
+
+    run.ok = true;
+    run.ns_per_op = elapsed / calls;
+    run.cycles_per_op = read_counter(cycles, calls);
+    run.misses_per_op = read_counter(misses, calls);
+    run.peak_rss_kb = peak_rss_kb();
+    return run;
+}
+
+static Run run_child(const Case* c, const Allocator* allocator) {
+    Run run = { .ok = false };
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        return run;
+    }
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        run = measure(c, allocator);
+        _exit(write(pipe_fds[1], &run, sizeof(run)) == sizeof(run) ? 0 : 1);
+    }
+    close(pipe_fds[1]);
+    if (pid > 0) {
+        if (read(pipe_fds[0], &run, sizeof(run)) != sizeof(run)) {
+            run.ok = false;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    close(pipe_fds[0]);
+    return run;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double* values, size_t count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    return values[count / 2];
+}
+
+static bool run_case(const Case* c, const Allocator* allocator, size_t repetitions,
+        Result* result) {
+    double ns[MAX_REPETITIONS], cycles[MAX_REPETITIONS], misses[MAX_REPETITIONS];
+    result->peak_rss_kb = 0;
+    for (size_t i = 0; i < repetitions; ++i) {
+        const Run run = run_child(c, allocator);
+        if (!run.ok) {
+            return false;
+        }
+        ns[i] = run.ns_per_op;
+        cycles[i] = run.cycles_per_op;
+        misses[i] = run.misses_per_op;
+        if (run.peak_rss_kb > result->peak_rss_kb) {
+            result->peak_rss_kb = run.peak_rss_kb;
+        }
+    }
+    result->ns_per_op = median(ns, repetitions);
+    result->spread = (ns[repetitions - 1] - ns[0]) / result->ns_per_op;
+    result->cycles_per_op = median(cycles, repetitions);
+    result->misses_per_op = median(misses, repetitions);
+    return true;
+}
+
+static void print_counter(double value) {
+    if (value < 0) {
+        printf(" %10s", "-");
+    } else {
+        printf(" %10.1f", value);
+    }
+}
+
+/**
+ * Time of mem relative to system for \a name in a CSV written with -o
+ * @return Ratio or a negative value if the case is not in the file
+ */
+static double baseline_ratio(FILE* baseline, const char* name) {
+    double times[allocator_count] = { 0 };
+    char line[256];
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline) != NULL) {
+        char case_name[64], allocator[16];
+        double ns;
+        if (sscanf(line, "%63[^,],%15[^,],%lf", case_name, allocator, &ns) != 3
+                || strcmp(case_name, name) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < allocator_count; ++i) {
+            if (strcmp(allocator, allocators[i].name) == 0) {
+                times[i] = ns;
+            }
+        }
+    }
+    return times[0] > 0 && times[1] > 0 ? times[0] / times[1] : -1;
+}
+
+int main(int argc, char** argv) {
+    size_t repetitions = 5;
+    double scale = 1;
+    double tolerance = 10;
+    const char* filter = "";
+    const char* output_path = NULL;
+    const char* baseline_path = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "r:s:f:o:b:t:")) != -1) {
+        switch (option) {
+            case 'r': repetitions = strtoul(optarg, NULL, 10); break;
+            case 's': scale = strtod(optarg, NULL); break;
+            case 'f': filter = optarg; break;
+            case 'o': output_path = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 't': tolerance = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "usage: %s [-r repetitions] [-s scale] [-f filter]"
+                        " [-o results.csv] [-b baseline.csv] [-t tolerance]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (repetitions == 0 || repetitions > MAX_REPETITIONS || scale <= 0) {
+        fprintf(stderr, "bad repetitions or scale\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* const output = output_path != NULL ? fopen(output_path, "w") : NULL;
+    FILE* const baseline = baseline_path != NULL ? fopen(baseline_path, "r") : NULL;
+    if ((output_path != NULL && output == NULL) || (baseline_path != NULL && baseline == NULL)) {
+        perror(output == NULL && output_path != NULL ? output_path : baseline_path);
+        return EXIT_FAILURE;
+    }
+    if (output != NULL) {
+        fprintf(output, "case,allocator,ns_per_op,cycles_per_op,cache_misses_per_op,peak_rss_kb\n");
+    }
+
+    add_cases(scale);
+    printf("%-24s %-7s %9s %7s %10s %10s %11s %9s\n", "case", "alloc", "ns/op", "spread",
+            "cycles/op", "misses/op", "peak RSS kB", "vs system");
+    size_t regressions = 0;
+    for (size_t i = 0; i < case_count; ++i) {
+        const Case* const c = &cases[i];
+        if (strstr(c->name, filter) == NULL) {
+            continue;
+        }
+        Result results[allocator_count];
+        bool ok = true;
+        for (size_t a = 0; a < allocator_count && ok; ++a) {
+            ok = run_case(c, &allocators[a], repetitions, &results[a]);
+        }
+        if (!ok) {
+            printf("%-24s failed\n", c->name);
+            ++regressions;
+            continue;
+        }
+
+        const double ratio = results[0].ns_per_op / results[1].ns_per_op;
+        for (size_t a = 0; a < allocator_count; ++a) {
+            printf("%-24s %-7s %9.1f %6.1f%%", c->name, allocators[a].name,
+                    results[a].ns_per_op, 100 * results[a].spread);
+            print_counter(results[a].cycles_per_op);
+            print_counter(results[a].misses_per_op);
+            printf(" %11ld", results[a].peak_rss_kb);
+            if (a == 0) {
+                printf(" %8.2fx", 1 / ratio);
+            }
+            printf("\n");
+            if (output != NULL) {
+                fprintf(output, "%s,%s,%.3f,%.3f,%.3f,%ld\n", c->name, allocators[a].name,
+                        results[a].ns_per_op, results[a].cycles_per_op,
+                        results[a].misses_per_op, results[a].peak_rss_kb);
+            }
+        }
+
+        if (baseline != NULL) {
+            const double base = baseline_ratio(baseline, c->name);
+            if (base > 0 && ratio > base * (1 + tolerance / 100)) {
+                printf("%-24s REGRESSION: %.2fx of system, baseline %.2fx\n",
+                        c->name, ratio, base);
+                ++regressions;
+            }
+        }
+    }
+
+    if (output != NULL) {
+        fclose(output);
+    }
+    if (baseline != NULL) {
+        fclose(baseline);
+    }
+    return regressions == 0 ? EXIT_SUCCESS : 2;
+}
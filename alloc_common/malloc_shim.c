@@ -0,0 +1,230 @@
+/*
+ * malloc interposition library: exports the C library allocation functions
+ * on top of the thread-safe build of mem_*, so unmodified programs run on
+ * this allocator with
+ *   LD_PRELOAD=build/shim/libmemalloc.so program
+ *
+ * The heap is growable and is set up on the first call. Only the functions
+ * below, the statistics and the heap profile calls are exported, the
+ * allocator itself is hidden (-fvisibility=hidden), so it does not clash
+ * with symbols of the program.
+ *
+ * Built with -DSHIM_PROFILE over the slab allocator, the shim starts the
+ * sampling heap profiler when the environment asks for it:
+ *   MEM_PROFILE_SAMPLE=<bytes>    mean bytes between samples, 0 for 512 KiB
+ *   MEM_PROFILE_SIGNAL=<number>   write a profile on that signal, to
+ *   MEM_PROFILE_PATH=<prefix>     <prefix>.<pid>.<n>.heap, memprofile by
+ *                                 default, or to .folded with
+ *   MEM_PROFILE_FORMAT=folded     live bytes per stack for flamegraph.pl
+ */
+#define _GNU_SOURCE
+
+#include "allocator.h"
+#include "mem_hardening.h"
+#ifdef SHIM_PROFILE
+#include "mem_profile.h"
+#endif
+#include "thread_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+/**
+ * The hardened build names the program's call in its reports, not the shim's
+ */
+#ifdef MEM_HARDENED
+#define SHIM_FREE(addr) mem_free_at(addr, __builtin_return_address(0))
+#define SHIM_REALLOC(addr, size) mem_realloc_at(addr, size, __builtin_return_address(0))
+#else
+#define SHIM_FREE(addr) mem_free(addr)
+#define SHIM_REALLOC(addr, size) mem_realloc(addr, size)
+#endif
+
+/**
+ * Minimal size of the chunks the heap maps from the OS.
+ * Override with -DSHIM_CHUNK_SIZE=<bytes>
+ */
+#ifndef SHIM_CHUNK_SIZE
+#define SHIM_CHUNK_SIZE (4 << 20)
+#endif
+
+typedef enum ShimState {
+    SHIM_UNINITIALIZED,
+    SHIM_INITIALIZING,
+    SHIM_READY
+} ShimState;
+
+static ShimState state = SHIM_UNINITIALIZED;
+
+/**
+ * Set up the heap on the first call, other threads wait for it
+ */
+static void ensure_initialized(void);
+
+/**
+ * Hold the allocator locks over fork, so the child gets consistent heaps
+ */
+static void prepare_fork(void);
+
+static void finish_fork(void);
+
+#ifdef SHIM_PROFILE
+/**
+ * Start the heap profiler if MEM_PROFILE_SAMPLE or MEM_PROFILE_SIGNAL is set
+ */
+static void start_profile(void);
+#endif
+
+/**
+ * Allocate \a size bytes aligned to \a alignment, a power of two
+ * @return Pointer to memory or NULL
+ */
+static void* alloc_aligned(size_t alignment, size_t size);
+
+SHIM_EXPORT void* malloc(size_t size) {
+    ensure_initialized();
+    void* const addr = mem_alloc(size);
+    if (addr == NULL) errno = ENOMEM;
+    return addr;
+}
+
+SHIM_EXPORT void free(void* addr) {
+    SHIM_FREE(addr);
+}
+
+SHIM_EXPORT void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* const addr = malloc(count * size);
+    if (addr != NULL) {
+        memset(addr, 0, count * size);
+    }
+    return addr;
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void* addr) {
+    return mem_usable_size(addr);
+}
+
+SHIM_EXPORT void* realloc(void* addr, size_t size) {
+    if (addr == NULL) return malloc(size);
+    if (size == 0) {
+        SHIM_FREE(addr);
+        return NULL;
+    }
+    void* const new_addr = SHIM_REALLOC(addr, size);
+    if (new_addr == NULL) errno = ENOMEM;
+    return new_addr;
+}
+
+SHIM_EXPORT int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* const addr = alloc_aligned(alignment, size);
+    if (addr == NULL) return ENOMEM;
+    *result = addr;
+    return 0;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alloc_aligned(alignment, size);
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+SHIM_EXPORT void* valloc(size_t size) {
+    return alloc_aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return alloc_aligned(page_size, (size + page_size - 1) / page_size * page_size);
+}
+
+SHIM_EXPORT int malloc_trim(size_t pad) {
+    // free memory is given back whole, there is no top of the heap to pad
+    (void)pad;
+    ensure_initialized();
+    return mem_trim() != 0;
+}
+
+static void ensure_initialized(void) {
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == SHIM_READY) return;
+
+    ShimState expected = SHIM_UNINITIALIZED;
+    if (__atomic_compare_exchange_n(&state, &expected, SHIM_INITIALIZING, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        mem_init_growable(SHIM_CHUNK_SIZE);
+        __atomic_store_n(&state, SHIM_READY, __ATOMIC_RELEASE);
+        // may allocate, so only once the heap is ready
+        pthread_atfork(prepare_fork, finish_fork, finish_fork);
+#ifdef SHIM_PROFILE
+        start_profile();
+#endif
+        return;
+    }
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != SHIM_READY) {
+        sched_yield();
+    }
+}
+
+static void prepare_fork(void) {
+#ifdef MEM_HARDENED
+    hardened_lock();
+#endif
+    stats_lock();
+    central_lock();
+}
+
+static void finish_fork(void) {
+    central_unlock();
+    stats_unlock();
+#ifdef MEM_HARDENED
+    hardened_unlock();
+#endif
+}
+
+#ifdef SHIM_PROFILE
+static void start_profile(void) {
+    const char* const sample = getenv("MEM_PROFILE_SAMPLE");
+    const char* const dump_signal = getenv("MEM_PROFILE_SIGNAL");
+    if (sample == NULL && dump_signal == NULL) return;
+    if (!mem_profile_start(sample != NULL ? strtoul(sample, NULL, 10) : 0)
+            || dump_signal == NULL) {
+        return;
+    }
+    const char* const path = getenv("MEM_PROFILE_PATH");
+    const char* const format = getenv("MEM_PROFILE_FORMAT");
+    mem_profile_dump_on_signal(atoi(dump_signal), path != NULL ? path : "memprofile",
+            format != NULL && strcmp(format, "folded") == 0
+                    ? MEM_PROFILE_FOLDED_LIVE : MEM_PROFILE_PPROF);
+}
+#endif
+
+static void* alloc_aligned(size_t alignment, size_t size) {
+    ensure_initialized();
+    void* const addr = mem_alloc_aligned(size, alignment);
+    if (addr == NULL) errno = ENOMEM;
+    return addr;
+}
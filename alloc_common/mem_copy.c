@@ -0,0 +1,190 @@
+#include "allocator.h"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MEM_COPY_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Copies of at least this many bytes bypass the cache with non-temporal
+ * stores, so a big realloc does not evict the working set.
+ * Override with -DMEM_COPY_NT_THRESHOLD=<bytes>
+ */
+#ifndef MEM_COPY_NT_THRESHOLD
+#define MEM_COPY_NT_THRESHOLD (1 << 20)
+#endif
+
+/**
+ * Machine word which may be unaligned and may alias any object
+ */
+typedef uintptr_t __attribute__((may_alias, aligned(1))) UnalignedWord;
+
+typedef void (*CopyKernel)(char* to, const char* from, size_t bytes);
+
+/**
+ * Copy kernel picked for this CPU on the first call
+ */
+static CopyKernel copy_kernel = NULL;
+
+/**
+ * Pick the widest kernel the CPU supports
+ * @return Copy kernel
+ */
+static CopyKernel select_kernel(void);
+
+/**
+ * Copy byte by byte, for heads and tails shorter than a word
+ */
+static void copy_bytes(char* to, const char* from, size_t bytes);
+
+/**
+ * Copy a word at a time with word-aligned stores
+ */
+static void copy_words(char* to, const char* from, size_t bytes);
+
+#ifdef MEM_COPY_X86
+/**
+ * Copy 16 bytes at a time with aligned SSE2 stores
+ */
+static void copy_sse2(char* to, const char* from, size_t bytes);
+
+/**
+ * Copy 32 bytes at a time with aligned AVX2 stores
+ */
+static void copy_avx2(char* to, const char* from, size_t bytes);
+#endif
+
+void mem_copy(void* to, const void* from, const size_t bytes) {
+    CopyKernel kernel = __atomic_load_n(&copy_kernel, __ATOMIC_RELAXED);
+    if (kernel == NULL) {
+        // every thread picks the same kernel, so racing stores are harmless
+        kernel = select_kernel();
+        __atomic_store_n(&copy_kernel, kernel, __ATOMIC_RELAXED);
+    }
+    kernel(to, from, bytes);
+}
+
+static CopyKernel select_kernel(void) {
+#ifdef MEM_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return copy_avx2;
+    if (__builtin_cpu_supports("sse2")) return copy_sse2;
+#endif
+    return copy_words;
+}
+
+static void copy_bytes(char* to, const char* from, size_t bytes) {
+    while (bytes-- > 0) {
+        *to++ = *from++;
+    }
+}
+
+static void copy_words(char* to, const char* from, size_t bytes) {
+    const size_t word_size = sizeof(uintptr_t);
+    if (bytes >= 2 * word_size) {
+        const size_t head = -(uintptr_t)to & (word_size - 1);
+        copy_bytes(to, from, head);
+        to += head;
+        from += head;
+        bytes -= head;
+        for (; bytes >= 4 * word_size; bytes -= 4 * word_size) {
+            const UnalignedWord* const source = (const UnalignedWord*)from;
+            uintptr_t* const target = (uintptr_t*)to;
+            const uintptr_t a = source[0], b = source[1], c = source[2], d = source[3];
+            target[0] = a;
+            target[1] = b;
+            target[2] = c;
+            target[3] = d;
+            to += 4 * word_size;
+            from += 4 * word_size;
+        }
+        for (; bytes >= word_size; bytes -= word_size) {
+            *(uintptr_t*)to = *(const UnalignedWord*)from;
+            to += word_size;
+            from += word_size;
+        }
+    }
+    copy_bytes(to, from, bytes);
+}
+
+#ifdef MEM_COPY_X86
+__attribute__((target("sse2")))
+static void copy_sse2(char* to, const char* from, size_t bytes) {
+    if (bytes < 64) {
+        copy_words(to, from, bytes);
+        return;
+    }
+    const size_t head = -(uintptr_t)to & 15;
+    copy_words(to, from, head);
+    to += head;
+    from += head;
+    bytes -= head;
+
+    const int streaming = bytes >= MEM_COPY_NT_THRESHOLD;
+    for (; bytes >= 64; bytes -= 64) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)from);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(from + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*)(from + 32));
+        const __m128i d = _mm_loadu_si128((const __m128i*)(from + 48));
+        if (streaming) {
+            _mm_stream_si128((__m128i*)to, a);
+            _mm_stream_si128((__m128i*)(to + 16), b);
+            _mm_stream_si128((__m128i*)(to + 32), c);
+            _mm_stream_si128((__m128i*)(to + 48), d);
+        } else {
+            _mm_store_si128((__m128i*)to, a);
+            _mm_store_si128((__m128i*)(to + 16), b);
+            _mm_store_si128((__m128i*)(to + 32), c);
+            _mm_store_si128((__m128i*)(to + 48), d);
+        }
+        to += 64;
+        from += 64;
+    }
+    if (streaming) {
+        // non-temporal stores are weakly ordered
+        _mm_sfence();
+    }
+    copy_words(to, from, bytes);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char* to, const char* from, size_t bytes) {
+    if (bytes < 128) {
+        copy_sse2(to, from, bytes);
+        return;
+    }
+    const size_t head = -(uintptr_t)to & 31;
+    copy_words(to, from, head);
+    to += head;
+    from += head;
+    bytes -= head;
+
+    const int streaming = bytes >= MEM_COPY_NT_THRESHOLD;
+    for (; bytes >= 128; bytes -= 128) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)from);
+        const __m256i b = _mm256_loadu_si256((const __m256i*)(from + 32));
+        const __m256i c = _mm256_loadu_si256((const __m256i*)(from + 64));
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(from + 96));
+        if (streaming) {
+            _mm256_stream_si256((__m256i*)to, a);
+            _mm256_stream_si256((__m256i*)(to + 32), b);
+            _mm256_stream_si256((__m256i*)(to + 64), c);
+            _mm256_stream_si256((__m256i*)(to + 96), d);
+        } else {
+            _mm256_store_si256((__m256i*)to, a);
+            _mm256_store_si256((__m256i*)(to + 32), b);
+            _mm256_store_si256((__m256i*)(to + 64), c);
+            _mm256_store_si256((__m256i*)(to + 96), d);
+        }
+        to += 128;
+        from += 128;
+    }
+    if (streaming) {
+        _mm_sfence();
+    }
+    _mm256_zeroupper();
+    copy_sse2(to, from, bytes);
+}
+#endif	/* MEM_COPY_X86 */
@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+
+#include "allocator.h"
+#include "mem_hardening.h"
+
+#ifdef MEM_HARDENED
+
+#include <dlfcn.h>
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Bytes in front of the user data, so it stays aligned like any block
+ */
+#define HEADER_SIZE MEM_ALIGNMENT
+#define TAIL_SIZE sizeof(uintptr_t)
+/**
+ * The top byte of a header's info word holds the log2 of the distance from
+ * the start of the block to the user data, 0 for blocks with guard pages
+ */
+#define SHIFT_POSITION (sizeof(size_t) * 8 - 8)
+#define SIZE_MASK (SIZE_MAX >> 8)
+#define POISON 0xdb
+/**
+ * Mixed into the canaries of blocks in quarantine and of tails
+ */
+#define QUARANTINED ((uintptr_t)0x7175617261ULL)
+#define TAIL_MIX ((uintptr_t)0x5a17c0de5a17c0deULL)
+
+/**
+ * Right in front of the user data of every block
+ */
+typedef struct Header {
+    /**
+     * Secret, user data address and info mixed while the block is allocated,
+     * secret, address and QUARANTINED while it is in quarantine
+     */
+    uintptr_t canary;
+    /**
+     * Size asked for, shift in the top byte
+     */
+    size_t info;
+} Header;
+
+typedef struct QuarantineSlot {
+    void* addr;
+    size_t size;
+} QuarantineSlot;
+
+/**
+ * Freed blocks waiting to be reused, oldest first
+ */
+static struct {
+    QuarantineSlot slots[MEM_QUARANTINE_SLOTS];
+    size_t first;
+    size_t count;
+    size_t bytes;
+} quarantine;
+
+#ifdef MEM_THREAD_SAFE
+static pthread_mutex_t quarantine_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Message built on the stack, the heap being suspect when it is needed
+ */
+typedef struct Message {
+    char text[1024];
+    size_t length;
+} Message;
+
+static void append(Message* message, const char* text) {
+    while (*text != '\0' && message->length < sizeof(message->text) - 1) {
+        message->text[message->length++] = *text++;
+    }
+}
+
+static void append_hex(Message* message, uintptr_t value) {
+    char digits[2 + sizeof(value) * 2 + 1];
+    char* digit = digits + sizeof(digits) - 1;
+    *digit = '\0';
+
+    do {
+        *--digit = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+
+    *--digit = 'x';
+    *--digit = '0';
+    append(message, digit);
+}
+
+static void append_decimal(Message* message, size_t value) {
+    char digits[24];
+    char* digit = digits + sizeof(digits) - 1;
+    *digit = '\0';
+
+    do {
+        *--digit = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    append(message, digit);
+}
+
+/**
+ * Print what went wrong in \a call with the block at \a addr, naming the
+ * code at \a caller, and abort
+ */
+static void report(const char* call, const char* problem, const void* addr, size_t size,
+                   const void* caller) {
+    Message message = { .length = 0 };
+    append(&message, call);
+    append(&message, ": ");
+    append(&message, problem);
+    append(&message, " ");
+    append_hex(&message, (uintptr_t)addr);
+
+    if (size != SIZE_MAX) {
+        append(&message, " (");
+        append_decimal(&message, size);
+        append(&message, " bytes)");
+    }
+
+    append(&message, ", called from ");
+    append_hex(&message, (uintptr_t)caller);
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 34)
+    // dladdr is in libc itself from 2.34 on, so needs no -ldl
+    Dl_info info;
+
+    if (dladdr(caller, &info) != 0 && info.dli_fname != NULL) {
+        append(&message, " (");
+
+        if (info.dli_sname != NULL) {
+            append(&message, info.dli_sname);
+            append(&message, "+");
+            append_hex(&message, (uintptr_t)caller - (uintptr_t)info.dli_saddr);
+            append(&message, " in ");
+            append(&message, info.dli_fname);
+        } else {
+            // the offset addr2line takes
+            append(&message, info.dli_fname);
+            append(&message, "+");
+            append_hex(&message, (uintptr_t)caller - (uintptr_t)info.dli_fbase);
+        }
+
+        append(&message, ")");
+    }
+#endif
+#endif
+    append(&message, "\n");
+
+    if (write(STDERR_FILENO, message.text, message.length) < 0) {
+        // nothing left to tell
+    }
+
+    abort();
+}
+
+static uintptr_t secret(void) {
+    static uintptr_t value;
+    const uintptr_t current = __atomic_load_n(&value, __ATOMIC_RELAXED);
+    if (current != 0) return current;
+
+    uintptr_t fresh;
+
+    if (getrandom(&fresh, sizeof(fresh), GRND_NONBLOCK) != sizeof(fresh)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fresh = ((uintptr_t)&fresh ^ (uintptr_t)now.tv_nsec) * (uintptr_t)0x9e3779b97f4a7c15ULL;
+    }
+
+    // zero means not chosen yet
+    fresh |= 1;
+    // every thread has to use the first value chosen
+    uintptr_t expected = 0;
+    if (__atomic_compare_exchange_n(&value, &expected, fresh, false,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return fresh;
+    }
+
+    return expected;
+}
+
+static Header* header_of(void* addr) {
+    return (Header*)addr - 1;
+}
+
+static uintptr_t live_canary(void* addr, size_t info) {
+    return secret() ^ (uintptr_t)addr ^ info;
+}
+
+static uintptr_t dead_canary(void* addr) {
+    return secret() ^ (uintptr_t)addr ^ QUARANTINED;
+}
+
+static size_t page_size(void) {
+    static size_t size;
+    // every thread finds the same value
+    if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/**
+ * A block with guard pages has no tail when its end is too close to the
+ * trailing guard page, which takes its place
+ */
+static bool has_tail(void* addr, size_t info) {
+    if (info >> SHIFT_POSITION != 0) return true;
+
+    const uintptr_t end = (uintptr_t)addr + (info & SIZE_MASK);
+    return (-end & (page_size() - 1)) >= TAIL_SIZE;
+}
+
+/**
+ * Bytes of the freed block at \a addr which are poisoned: on a block with
+ * guard pages, the pages after the first one are made inaccessible instead
+ */
+static size_t poisoned_length(void* addr, size_t info) {
+    size_t length = info & SIZE_MASK;
+    if (length > MEM_POISON_LIMIT) length = MEM_POISON_LIMIT;
+
+    if (info >> SHIFT_POSITION == 0) {
+        const size_t to_page_end = -(uintptr_t)addr & (page_size() - 1);
+        if (length > to_page_end) length = to_page_end;
+    }
+
+    return length;
+}
+
+/**
+ * Write the header and the tail of the block whose user data starts at
+ * \a addr, \a shift being the log2 of the header room or 0
+ */
+static void* arm(void* addr, size_t size, unsigned shift) {
+    Header* header = header_of(addr);
+    header->info = size | (size_t)shift << SHIFT_POSITION;
+    header->canary = live_canary(addr, header->info);
+
+    if (has_tail(addr, header->info)) {
+        const uintptr_t tail = header->canary ^ TAIL_MIX;
+        memcpy(addr + size, &tail, TAIL_SIZE);
+    }
+
+    return addr;
+}
+
+/**
+ * Check the block at \a addr passed to \a call
+ * @return Its header's info word
+ */
+static size_t check(void* addr, const char* call, const void* caller) {
+    if (((uintptr_t)addr & (MEM_ALIGNMENT - 1)) != 0) {
+        report(call, "pointer which was never allocated", addr, SIZE_MAX, caller);
+    }
+
+    const Header* header = header_of(addr);
+
+    if (header->canary == dead_canary(addr)) {
+        report(call, "double free of block", addr, SIZE_MAX, caller);
+    }
+
+    if (header->canary != live_canary(addr, header->info)) {
+        report(call, "pointer which was never allocated, or block whose header was overwritten",
+                addr, SIZE_MAX, caller);
+    }
+
+    const size_t size = header->info & SIZE_MASK;
+    uintptr_t tail;
+
+    if (has_tail(addr, header->info)) {
+        memcpy(&tail, addr + size, TAIL_SIZE);
+
+        if (tail != (header->canary ^ TAIL_MIX)) {
+            report(call, "write past the end of block", addr, size, caller);
+        }
+    }
+
+    return header->info;
+}
+
+#ifdef MEM_GUARD_PAGES
+/**
+ * Blocks with guard pages which are mapped, in quarantine or not; each costs
+ * the process up to four of the mappings vm.max_map_count allows
+ */
+static size_t guarded_count;
+
+/**
+ * Map \a size bytes on their own, between two inaccessible pages, ending
+ * right where the second one starts
+ * @return The block or NULL when MEM_GUARD_MAPPINGS blocks are mapped already
+ * or the kernel refuses, so the caller falls back to a block of the heap
+ */
+static void* guarded_alloc(size_t size, size_t alignment) {
+    if (__atomic_add_fetch(&guarded_count, 1, __ATOMIC_RELAXED) > MEM_GUARD_MAPPINGS) {
+        __atomic_sub_fetch(&guarded_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    const size_t page = page_size();
+    const size_t data_pages = (size + HEADER_SIZE + alignment + page - 1) / page;
+    void* start = mmap(NULL, (data_pages + 2) * page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (start == MAP_FAILED) {
+        __atomic_sub_fetch(&guarded_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void* end = start + (data_pages + 1) * page;
+
+    if (mprotect(start, page, PROT_NONE) != 0 || mprotect(end, page, PROT_NONE) != 0) {
+        munmap(start, (data_pages + 2) * page);
+        __atomic_sub_fetch(&guarded_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return arm((void*)((uintptr_t)(end - size) & ~(alignment - 1)), size, 0);
+}
+
+/**
+ * The mapping of a block with guard pages follows from its address and size
+ */
+static void guarded_unmap(void* addr, size_t size) {
+    const uintptr_t page_mask = page_size() - 1;
+    void* start = (void*)((uintptr_t)header_of(addr) & ~page_mask) - page_size();
+    void* end = (void*)(((uintptr_t)addr + size + page_mask) & ~page_mask) + page_size();
+    munmap(start, end - start);
+    __atomic_sub_fetch(&guarded_count, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+static void* hardened_alloc(size_t size, size_t alignment) {
+    if (size > SIZE_MASK) return NULL;
+    if (alignment < MEM_ALIGNMENT) alignment = MEM_ALIGNMENT;
+#ifdef MEM_GUARD_PAGES
+    if (size >= MEM_GUARD_MIN_SIZE && size >= 2 * page_size() && alignment <= page_size()) {
+        void* addr = guarded_alloc(size, alignment);
+        if (addr != NULL) return addr;
+    }
+#endif
+    const size_t offset = alignment > HEADER_SIZE ? alignment : HEADER_SIZE;
+    void* block = offset > HEADER_SIZE
+            ? raw_mem_alloc_aligned(offset + size + TAIL_SIZE, alignment)
+            : raw_mem_alloc(offset + size + TAIL_SIZE);
+    if (block == NULL) return NULL;
+
+    return arm(block + offset, size, (unsigned)__builtin_ctzl(offset));
+}
+
+/**
+ * Give the block at \a addr, out of quarantine, back to the allocator
+ */
+static void release(void* addr, size_t info) {
+    const unsigned shift = info >> SHIFT_POSITION;
+
+    if (shift == 0) {
+#ifdef MEM_GUARD_PAGES
+        guarded_unmap(addr, info & SIZE_MASK);
+#endif
+        return;
+    }
+
+    raw_mem_free(addr - ((size_t)1 << shift));
+}
+
+/**
+ * Check that the block at \a addr, which was \a size bytes, was left alone in
+ * quarantine and release it
+ */
+static void evict(void* addr, size_t size, const void* caller) {
+    const Header* header = header_of(addr);
+
+    if (header->canary != dead_canary(addr) || (header->info & SIZE_MASK) != size) {
+        report("mem_free", "write after free (header overwritten) to block, found on a free,",
+                addr, size, caller);
+    }
+
+    const unsigned char* byte = addr;
+    const unsigned char* end = byte + poisoned_length(addr, header->info);
+
+    for (; byte < end; ++byte) {
+        if (*byte != POISON) {
+            report("mem_free", "write after free to block, found on a free,", addr, size, caller);
+        }
+    }
+
+    release(addr, header->info);
+}
+
+void hardened_lock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&quarantine_mutex);
+#endif
+}
+
+void hardened_unlock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&quarantine_mutex);
+#endif
+}
+
+static QuarantineSlot take_oldest(void) {
+    const QuarantineSlot oldest = quarantine.slots[quarantine.first];
+    quarantine.first = (quarantine.first + 1) % MEM_QUARANTINE_SLOTS;
+    --quarantine.count;
+    quarantine.bytes -= oldest.size;
+    return oldest;
+}
+
+/**
+ * Poison the checked block at \a addr and put it in quarantine, then
+ * release the blocks which have to leave it to make room
+ */
+static void quarantine_block(void* addr, size_t info, const void* caller) {
+    const size_t size = info & SIZE_MASK;
+    memset(addr, POISON, poisoned_length(addr, info));
+    header_of(addr)->canary = dead_canary(addr);
+#ifdef MEM_GUARD_PAGES
+    if (info >> SHIFT_POSITION == 0) {
+        // the rest faults on any access until the block is unmapped
+        const uintptr_t page_mask = page_size() - 1;
+        void* rest = (void*)(((uintptr_t)addr + page_mask) & ~page_mask);
+        void* end = (void*)(((uintptr_t)addr + size + page_mask) & ~page_mask);
+        if (end > rest) mprotect(rest, end - rest, PROT_NONE);
+    }
+#endif
+    QuarantineSlot oldest = { .addr = NULL };
+    hardened_lock();
+
+    if (quarantine.count == MEM_QUARANTINE_SLOTS) {
+        oldest = take_oldest();
+    }
+
+    quarantine.slots[(quarantine.first + quarantine.count) % MEM_QUARANTINE_SLOTS] =
+            (QuarantineSlot) { .addr = addr, .size = size };
+    ++quarantine.count;
+    quarantine.bytes += size;
+    hardened_unlock();
+
+    while (true) {
+        if (oldest.addr != NULL) evict(oldest.addr, oldest.size, caller);
+
+        hardened_lock();
+        // a block bigger than the whole quarantine leaves it at once
+        const bool too_big = quarantine.count > 0 && quarantine.bytes > MEM_QUARANTINE_BYTES;
+        if (too_big) oldest = take_oldest();
+        hardened_unlock();
+
+        if (!too_big) break;
+    }
+}
+
+void* mem_alloc(size_t size) {
+    return hardened_alloc(size, MEM_ALIGNMENT);
+}
+
+void* mem_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    return hardened_alloc(size, alignment);
+}
+
+void* mem_realloc(void* addr, size_t size) {
+    return mem_realloc_at(addr, size, __builtin_return_address(0));
+}
+
+void* mem_realloc_at(void* addr, size_t size, const void* caller) {
+    if (addr == NULL) return hardened_alloc(size, MEM_ALIGNMENT);
+
+    const size_t info = check(addr, "mem_realloc", caller);
+    // always moves, so stale pointers to the old block are caught as well
+    void* new_addr = hardened_alloc(size, MEM_ALIGNMENT);
+    if (new_addr == NULL) return NULL;
+
+    const size_t old_size = info & SIZE_MASK;
+    mem_copy(new_addr, addr, old_size < size ? old_size : size);
+    quarantine_block(addr, info, caller);
+    return new_addr;
+}
+
+void mem_free(void* addr) {
+    mem_free_at(addr, __builtin_return_address(0));
+}
+
+void mem_free_at(void* addr, const void* caller) {
+    if (addr == NULL) return;
+    quarantine_block(addr, check(addr, "mem_free", caller), caller);
+}
+
+void mem_free_sized(void* addr, size_t size) {
+    if (addr == NULL) return;
+
+    const void* caller = __builtin_return_address(0);
+    const size_t info = check(addr, "mem_free_sized", caller);
+
+    if ((info & SIZE_MASK) != size) {
+        report("mem_free_sized", "size which does not match block", addr, info & SIZE_MASK,
+                caller);
+    }
+
+    quarantine_block(addr, info, caller);
+}
+
+void* mem_realloc_sized(void* addr, size_t old_size, size_t new_size) {
+    const void* caller = __builtin_return_address(0);
+
+    if (addr != NULL && (check(addr, "mem_realloc_sized", caller) & SIZE_MASK) != old_size) {
+        report("mem_realloc_sized", "size which does not match block", addr,
+                header_of(addr)->info & SIZE_MASK, caller);
+    }
+
+    return mem_realloc_at(addr, new_size, caller);
+}
+
+size_t mem_alloc_batch(size_t size, size_t count, void** out) {
+    for (size_t i = 0; i < count; ++i) {
+        if ((out[i] = hardened_alloc(size, MEM_ALIGNMENT)) == NULL) return i;
+    }
+
+    return count;
+}
+
+void mem_free_batch(void** addrs, size_t count) {
+    const void* caller = __builtin_return_address(0);
+
+    for (size_t i = 0; i < count; ++i) {
+        mem_free_at(addrs[i], caller);
+    }
+}
+
+size_t mem_usable_size(void* addr) {
+    if (addr == NULL) return 0;
+    // the tail canary follows right after the size asked for
+    return check(addr, "mem_usable_size", __builtin_return_address(0)) & SIZE_MASK;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef MEM_HARDENING_H
+#define	MEM_HARDENING_H
+
+#include <stddef.h>
+
+/*
+ * Hardened mode (compile with -DMEM_HARDENED).
+ *
+ * The mem_* calls of allocator.h check their arguments instead of trusting
+ * them. Every block gets a header in front of the user data, holding its
+ * size and a canary derived from a per-process secret and the block address,
+ * and a tail canary right after the user data. Freeing checks both, so
+ * stray pointers, double frees and overflows past either end abort the
+ * process with a message naming the call and the code which made it.
+ *
+ * Freed blocks are poisoned and put in a quarantine of
+ * MEM_QUARANTINE_BYTES bytes (MEM_QUARANTINE_SLOTS blocks at most), so they
+ * are not reused at once; a block leaving the quarantine has its poison
+ * checked, which catches writes after free. With -DMEM_GUARD_PAGES blocks
+ * of MEM_GUARD_MIN_SIZE bytes or more are mapped on their own between two
+ * inaccessible pages, their end against the second one, so overflows fault
+ * at the faulty write. At most MEM_GUARD_MAPPINGS of them are mapped at
+ * once, as the kernel limits the mappings of a process (vm.max_map_count);
+ * past that, or when mmap fails, blocks come from the heap as without
+ * guard pages.
+ *
+ * The price is 16 bytes of header and 8 bytes of tail per block, a pass
+ * over at most MEM_POISON_LIMIT bytes of every block freed and a lock per
+ * free in thread-safe mode.
+ *
+ * The allocator proper is compiled with its entry points renamed to the
+ * raw_mem_* functions below, which this layer calls.
+ */
+
+/**
+ * Bytes of quarantine kept at most before the oldest block is reused
+ */
+#ifndef MEM_QUARANTINE_BYTES
+#define MEM_QUARANTINE_BYTES ((size_t)4 << 20)
+#endif
+
+/**
+ * Blocks kept in quarantine at most
+ */
+#ifndef MEM_QUARANTINE_SLOTS
+#define MEM_QUARANTINE_SLOTS 4096
+#endif
+
+/**
+ * Bytes at the start of a freed block which are poisoned and checked
+ */
+#ifndef MEM_POISON_LIMIT
+#define MEM_POISON_LIMIT 4096
+#endif
+
+/**
+ * Bytes a block needs at least to get guard pages with -DMEM_GUARD_PAGES;
+ * blocks of less than two pages never get them
+ */
+#ifndef MEM_GUARD_MIN_SIZE
+#define MEM_GUARD_MIN_SIZE ((size_t)64 << 10)
+#endif
+
+/**
+ * Blocks with guard pages mapped at most, those in quarantine included
+ */
+#ifndef MEM_GUARD_MAPPINGS
+#define MEM_GUARD_MAPPINGS 4096
+#endif
+
+#ifdef MEM_HARDENED_RAW_NAMES
+#define mem_alloc raw_mem_alloc
+#define mem_alloc_aligned raw_mem_alloc_aligned
+#define mem_realloc raw_mem_realloc
+#define mem_free raw_mem_free
+#define mem_free_sized raw_mem_free_sized
+#define mem_realloc_sized raw_mem_realloc_sized
+#define mem_alloc_batch raw_mem_alloc_batch
+#define mem_free_batch raw_mem_free_batch
+#define mem_usable_size raw_mem_usable_size
+#endif
+
+void* raw_mem_alloc(size_t size);
+void* raw_mem_alloc_aligned(size_t size, size_t alignment);
+void* raw_mem_realloc(void* addr, size_t size);
+void raw_mem_free(void* addr);
+void raw_mem_free_sized(void* addr, size_t size);
+void* raw_mem_realloc_sized(void* addr, size_t old_size, size_t new_size);
+size_t raw_mem_alloc_batch(size_t size, size_t count, void** out);
+void raw_mem_free_batch(void** addrs, size_t count);
+size_t raw_mem_usable_size(void* addr);
+
+/**
+ * mem_free reporting \a caller as the code which called it, for wrappers
+ * such as the malloc shim
+ * @param addr Pointer returned by one of the mem_alloc* calls or NULL
+ * @param caller Return address to name when the call is faulty
+ */
+void mem_free_at(void* addr, const void* caller);
+
+/**
+ * mem_realloc reporting \a caller as the code which called it
+ * @param addr Pointer returned by one of the mem_alloc* calls or NULL
+ * @param size Number of bytes needed
+ * @param caller Return address to name when the call is faulty
+ * @return Pointer to the block or NULL, in which case \a addr stays valid
+ */
+void* mem_realloc_at(void* addr, size_t size, const void* caller);
+
+/**
+ * Lock and unlock the quarantine, so a fork does not happen while another
+ * thread holds its lock
+ */
+void hardened_lock(void);
+void hardened_unlock(void);
+
+#endif	/* MEM_HARDENING_H */
@@ -0,0 +1,441 @@
+#define _DEFAULT_SOURCE
+
+#include "mem_stats.h"
+#include "thread_cache.h"
+
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Statistics are exported from the malloc interposition library too
+ */
+#define STATS_EXPORT __attribute__((visibility("default")))
+
+/**
+ * Call counters of one thread. Only the owning thread writes them, other
+ * threads read them while summing, so every access is atomic but none
+ * needs a read-modify-write instruction
+ */
+typedef struct StatsShard {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t reallocs;
+    /**
+     * Wraps around in threads which free more than they allocate,
+     * the sum over all shards is right
+     */
+    uint64_t bytes_in_use;
+    uint64_t class_allocs[MEM_STATS_CLASS_COUNT];
+    uint64_t class_frees[MEM_STATS_CLASS_COUNT];
+    MemLatencyStats alloc_latency;
+    MemLatencyStats free_latency;
+    /**
+     * Operations left until the next sampled one
+     */
+    unsigned sample_countdown;
+    /**
+     * Next shard in the list of all shards
+     */
+    struct StatsShard* next;
+    /**
+     * Next shard in the list of shards left by exited threads
+     */
+    struct StatsShard* next_unused;
+} StatsShard;
+
+/**
+ * Sampling period of mem_alloc and mem_free latency, 0 when off
+ */
+static unsigned sampling_period = 0;
+
+#ifdef MEM_THREAD_SAFE
+/**
+ * Every shard ever created. Shards are never freed: the counts of exited
+ * threads stay in the sums, and their shards are reused by new threads
+ */
+static StatsShard* shards = NULL;
+static StatsShard* unused_shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread StatsShard* thread_shard = NULL;
+#else
+static StatsShard single_shard;
+#endif
+
+/**
+ * Counters of the calling thread
+ * @return Shard or NULL if it could not be created
+ */
+static StatsShard* get_shard(void);
+
+#ifdef MEM_THREAD_SAFE
+/**
+ * Put the shard of an exiting thread up for reuse
+ * @param shard Shard of the exiting thread
+ */
+static void release_shard(void* shard);
+
+static void create_shard_key(void);
+#endif
+
+/**
+ * Add \a value to a counter owned by the calling thread
+ */
+static void add(uint64_t* counter, uint64_t value);
+
+/**
+ * Read a counter of any thread
+ */
+static uint64_t load(const uint64_t* counter);
+
+static uint64_t now_ns(void);
+
+static void record_latency(MemLatencyStats* latency, uint64_t start);
+
+/**
+ * Add the latency samples of \a latency to \a sum
+ */
+static void sum_latency(MemLatencyStats* sum, const MemLatencyStats* latency);
+
+/**
+ * Add the counters of \a shard to \a stats
+ */
+static void sum_shard(MemStats* stats, const StatsShard* shard);
+
+/**
+ * snprintf at \a *length into \a buffer, advancing \a *length by the
+ * length of the text even when it does not fit
+ */
+static void append(char* buffer, size_t size, size_t* length, const char* format, ...)
+        __attribute__((format(printf, 4, 5)));
+
+static void append_latency_json(char* buffer, size_t size, size_t* length,
+        const char* name, const MemLatencyStats* latency);
+
+static void append_latency_prometheus(char* buffer, size_t size, size_t* length,
+        const char* name, const MemLatencyStats* latency);
+
+void stats_count_alloc(size_t usable_size) {
+    StatsShard* const shard = get_shard();
+    if (shard == NULL) return;
+    add(&shard->allocs, 1);
+    add(&shard->class_allocs[mem_stats_class(usable_size)], 1);
+    add(&shard->bytes_in_use, usable_size);
+}
+
+void stats_count_free(size_t usable_size) {
+    StatsShard* const shard = get_shard();
+    if (shard == NULL) return;
+    add(&shard->frees, 1);
+    add(&shard->class_frees[mem_stats_class(usable_size)], 1);
+    add(&shard->bytes_in_use, -(uint64_t)usable_size);
+}
+
+void stats_count_realloc(void) {
+    StatsShard* const shard = get_shard();
+    if (shard == NULL) return;
+    add(&shard->reallocs, 1);
+}
+
+void stats_count_resize(size_t old_size, size_t new_size) {
+    StatsShard* const shard = get_shard();
+    if (shard == NULL) return;
+    const size_t old_class = mem_stats_class(old_size);
+    const size_t new_class = mem_stats_class(new_size);
+    if (old_class != new_class) {
+        add(&shard->class_frees[old_class], 1);
+        add(&shard->class_allocs[new_class], 1);
+    }
+    add(&shard->bytes_in_use, (uint64_t)new_size - old_size);
+}
+
+uint64_t stats_sample_start(void) {
+    const unsigned period = __atomic_load_n(&sampling_period, __ATOMIC_RELAXED);
+    if (period == 0) return 0;
+    StatsShard* const shard = get_shard();
+    if (shard == NULL) return 0;
+    // the countdown may be left over from a longer period
+    if (shard->sample_countdown > 1 && shard->sample_countdown <= period) {
+        --shard->sample_countdown;
+        return 0;
+    }
+    shard->sample_countdown = period;
+    return now_ns();
+}
+
+void stats_sample_alloc(uint64_t start) {
+    StatsShard* const shard = get_shard();
+    if (shard != NULL) {
+        record_latency(&shard->alloc_latency, start);
+    }
+}
+
+void stats_sample_free(uint64_t start) {
+    StatsShard* const shard = get_shard();
+    if (shard != NULL) {
+        record_latency(&shard->free_latency, start);
+    }
+}
+
+void stats_lock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&shards_lock);
+#endif
+}
+
+void stats_unlock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&shards_lock);
+#endif
+}
+
+STATS_EXPORT void mem_stats(MemStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+        stats->classes[i].block_size = (size_t)8 << i;
+    }
+
+#ifdef MEM_THREAD_SAFE
+    stats_lock();
+    for (const StatsShard* shard = shards; shard != NULL; shard = shard->next) {
+        sum_shard(stats, shard);
+    }
+    stats_unlock();
+#else
+    sum_shard(stats, &single_shard);
+#endif
+
+    central_lock();
+    central_stats(stats);
+    central_unlock();
+
+    stats->fragmentation = stats->bytes_mapped == 0 ? 0
+            : 1.0 - (double)stats->bytes_in_use / stats->bytes_mapped;
+}
+
+STATS_EXPORT void mem_stats_set_sampling(unsigned period) {
+    __atomic_store_n(&sampling_period, period, __ATOMIC_RELAXED);
+}
+
+STATS_EXPORT size_t mem_stats_json(const MemStats* stats, char* buffer, size_t size) {
+    size_t length = 0;
+    if (size != 0) buffer[0] = '\0';
+    append(buffer, size, &length,
+            "{\"allocs\":%llu,\"frees\":%llu,\"reallocs\":%llu,"
+            "\"bytes_in_use\":%zu,\"bytes_mapped\":%zu,\"bytes_free\":%zu,"
+            "\"page_size\":%zu,\"pages_mapped\":%zu,\"pages_in_use\":%zu,"
+            "\"fragmentation\":%.4f,\"classes\":[",
+            (unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+            (unsigned long long)stats->reallocs, stats->bytes_in_use,
+            stats->bytes_mapped, stats->bytes_free, stats->page_size,
+            stats->pages_mapped, stats->pages_in_use, stats->fragmentation);
+    bool first = true;
+    for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+        const MemClassStats* const class_stats = &stats->classes[i];
+        if (class_stats->allocs == 0 && class_stats->free_blocks == 0
+                && class_stats->pages == 0) {
+            continue;
+        }
+        append(buffer, size, &length,
+                "%s{\"block_size\":%zu,\"allocs\":%llu,\"frees\":%llu,"
+                "\"free_blocks\":%zu,\"pages\":%zu,\"page_blocks\":%zu}",
+                first ? "" : ",", class_stats->block_size,
+                (unsigned long long)class_stats->allocs,
+                (unsigned long long)class_stats->frees, class_stats->free_blocks,
+                class_stats->pages, class_stats->page_blocks);
+        first = false;
+    }
+    append(buffer, size, &length, "],");
+    append_latency_json(buffer, size, &length, "alloc_latency", &stats->alloc_latency);
+    append(buffer, size, &length, ",");
+    append_latency_json(buffer, size, &length, "free_latency", &stats->free_latency);
+    append(buffer, size, &length, "}");
+    return length;
+}
+
+STATS_EXPORT size_t mem_stats_prometheus(const MemStats* stats, char* buffer, size_t size) {
+    size_t length = 0;
+    if (size != 0) buffer[0] = '\0';
+    append(buffer, size, &length,
+            "# TYPE mem_allocs_total counter\nmem_allocs_total %llu\n"
+            "# TYPE mem_frees_total counter\nmem_frees_total %llu\n"
+            "# TYPE mem_reallocs_total counter\nmem_reallocs_total %llu\n"
+            "# TYPE mem_bytes_in_use gauge\nmem_bytes_in_use %zu\n"
+            "# TYPE mem_bytes_mapped gauge\nmem_bytes_mapped %zu\n"
+            "# TYPE mem_bytes_free gauge\nmem_bytes_free %zu\n"
+            "# TYPE mem_pages_mapped gauge\nmem_pages_mapped %zu\n"
+            "# TYPE mem_pages_in_use gauge\nmem_pages_in_use %zu\n"
+            "# TYPE mem_fragmentation_ratio gauge\nmem_fragmentation_ratio %.4f\n",
+            (unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+            (unsigned long long)stats->reallocs, stats->bytes_in_use,
+            stats->bytes_mapped, stats->bytes_free, stats->pages_mapped,
+            stats->pages_in_use, stats->fragmentation);
+
+    static const char* const class_metrics[] = {
+        "mem_class_allocs_total counter", "mem_class_frees_total counter",
+        "mem_class_free_blocks gauge", "mem_class_pages gauge",
+    };
+    for (size_t metric = 0; metric < sizeof(class_metrics) / sizeof(class_metrics[0]); ++metric) {
+        const char* const name = class_metrics[metric];
+        const int name_length = strchr(name, ' ') - name;
+        append(buffer, size, &length, "# TYPE %s\n", name);
+        for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+            const MemClassStats* const class_stats = &stats->classes[i];
+            if (class_stats->allocs == 0 && class_stats->free_blocks == 0
+                    && class_stats->pages == 0) {
+                continue;
+            }
+            const uint64_t values[] = {
+                class_stats->allocs, class_stats->frees,
+                class_stats->free_blocks, class_stats->pages,
+            };
+            append(buffer, size, &length, "%.*s{block_size=\"%zu\"} %llu\n",
+                    name_length, name, class_stats->block_size,
+                    (unsigned long long)values[metric]);
+        }
+    }
+    append_latency_prometheus(buffer, size, &length, "mem_alloc_latency_seconds",
+            &stats->alloc_latency);
+    append_latency_prometheus(buffer, size, &length, "mem_free_latency_seconds",
+            &stats->free_latency);
+    return length;
+}
+
+static StatsShard* get_shard(void) {
+#ifdef MEM_THREAD_SAFE
+    if (thread_shard != NULL) return thread_shard;
+
+    pthread_once(&shard_key_once, create_shard_key);
+    pthread_mutex_lock(&shards_lock);
+    StatsShard* shard = unused_shards;
+    if (shard != NULL) {
+        unused_shards = shard->next_unused;
+    } else {
+        // shards live outside of the heap they count
+        shard = mmap(NULL, sizeof(StatsShard), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (shard == MAP_FAILED) {
+            shard = NULL;
+        } else {
+            shard->next = shards;
+            shards = shard;
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    if (shard != NULL) {
+        thread_shard = shard;
+        pthread_setspecific(shard_key, shard);
+    }
+    return shard;
+#else
+    return &single_shard;
+#endif
+}
+
+#ifdef MEM_THREAD_SAFE
+static void release_shard(void* shard_void) {
+    StatsShard* const shard = shard_void;
+    pthread_mutex_lock(&shards_lock);
+    shard->next_unused = unused_shards;
+    unused_shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+    thread_shard = NULL;
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+#endif
+
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+            __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void record_latency(MemLatencyStats* latency, uint64_t start) {
+    const uint64_t elapsed = now_ns() - start;
+    size_t bucket = elapsed < 2 ? 0 : 63 - __builtin_clzll(elapsed);
+    if (bucket >= MEM_STATS_LATENCY_BUCKETS) {
+        bucket = MEM_STATS_LATENCY_BUCKETS - 1;
+    }
+    add(&latency->samples, 1);
+    add(&latency->total_ns, elapsed);
+    add(&latency->buckets[bucket], 1);
+}
+
+static void sum_latency(MemLatencyStats* sum, const MemLatencyStats* latency) {
+    sum->samples += load(&latency->samples);
+    sum->total_ns += load(&latency->total_ns);
+    for (size_t i = 0; i < MEM_STATS_LATENCY_BUCKETS; ++i) {
+        sum->buckets[i] += load(&latency->buckets[i]);
+    }
+}
+
+static void sum_shard(MemStats* stats, const StatsShard* shard) {
+    stats->allocs += load(&shard->allocs);
+    stats->frees += load(&shard->frees);
+    stats->reallocs += load(&shard->reallocs);
+    stats->bytes_in_use += load(&shard->bytes_in_use);
+    for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+        stats->classes[i].allocs += load(&shard->class_allocs[i]);
+        stats->classes[i].frees += load(&shard->class_frees[i]);
+    }
+    sum_latency(&stats->alloc_latency, &shard->alloc_latency);
+    sum_latency(&stats->free_latency, &shard->free_latency);
+}
+
+static void append(char* buffer, size_t size, size_t* length, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    const int written = vsnprintf(*length < size ? buffer + *length : NULL,
+            *length < size ? size - *length : 0, format, arguments);
+    va_end(arguments);
+    if (written > 0) {
+        *length += written;
+    }
+}
+
+static void append_latency_json(char* buffer, size_t size, size_t* length,
+        const char* name, const MemLatencyStats* latency) {
+    append(buffer, size, length, "\"%s\":{\"samples\":%llu,\"total_ns\":%llu,\"buckets\":[",
+            name, (unsigned long long)latency->samples,
+            (unsigned long long)latency->total_ns);
+    for (size_t i = 0; i < MEM_STATS_LATENCY_BUCKETS; ++i) {
+        append(buffer, size, length, "%s%llu", i == 0 ? "" : ",",
+                (unsigned long long)latency->buckets[i]);
+    }
+    append(buffer, size, length, "]}");
+}
+
+static void append_latency_prometheus(char* buffer, size_t size, size_t* length,
+        const char* name, const MemLatencyStats* latency) {
+    append(buffer, size, length, "# TYPE %s histogram\n", name);
+    uint64_t count = 0;
+    for (size_t i = 0; i < MEM_STATS_LATENCY_BUCKETS; ++i) {
+        count += latency->buckets[i];
+        append(buffer, size, length, "%s_bucket{le=\"%.9f\"} %llu\n", name,
+                (double)((uint64_t)2 << i) * 1e-9, (unsigned long long)count);
+    }
+    append(buffer, size, length, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+            name, (unsigned long long)latency->samples, name,
+            latency->total_ns * 1e-9, name, (unsigned long long)latency->samples);
+}
@@ -0,0 +1,203 @@
+#ifndef MEM_STATS_H
+#define	MEM_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Heap statistics.
+ *
+ * Call counters (allocations, frees, bytes in use, latency samples) are
+ * kept per thread without locking and summed when read. Heap layout
+ * counters (mapped memory, free lists, pages) are kept up to date by the
+ * central heap under its lock. Reading the statistics costs time
+ * proportional to the number of threads and classes, the heap is never
+ * walked.
+ */
+
+/**
+ * Blocks are counted in power-of-two classes of their usable size:
+ * class i holds blocks of at most 8 << i bytes which do not fit class i - 1
+ */
+#define MEM_STATS_CLASS_COUNT 40
+
+/**
+ * Latency bucket i counts operations which took less than 2 << i ns and,
+ * for i > 0, at least 1 << i ns
+ */
+#define MEM_STATS_LATENCY_BUCKETS 32
+
+typedef struct MemClassStats {
+    /**
+     * Biggest usable size of the class
+     */
+    size_t block_size;
+    /**
+     * Blocks of the class handed out. Blocks which change class when
+     * resized in place count as freed in one class and allocated in the other
+     */
+    uint64_t allocs;
+    /**
+     * Blocks of the class given back
+     */
+    uint64_t frees;
+    /**
+     * Free blocks of the class held by the central heap (free list length)
+     */
+    size_t free_blocks;
+    /**
+     * Pages divided into blocks of the class, 0 for heaps without block pages
+     */
+    size_t pages;
+    /**
+     * Blocks those pages can hold, used or not
+     */
+    size_t page_blocks;
+} MemClassStats;
+
+typedef struct MemLatencyStats {
+    uint64_t samples;
+    uint64_t total_ns;
+    uint64_t buckets[MEM_STATS_LATENCY_BUCKETS];
+} MemLatencyStats;
+
+typedef struct MemStats {
+    /**
+     * Blocks handed out by mem_alloc and by moving mem_realloc
+     */
+    uint64_t allocs;
+    /**
+     * Blocks given back by mem_free and by moving mem_realloc
+     */
+    uint64_t frees;
+    /**
+     * mem_realloc calls
+     */
+    uint64_t reallocs;
+    /**
+     * Usable bytes of the blocks the program holds
+     */
+    size_t bytes_in_use;
+    /**
+     * Bytes got from the OS, metadata included
+     */
+    size_t bytes_mapped;
+    /**
+     * Bytes the central heap can hand out without asking the OS
+     */
+    size_t bytes_free;
+    size_t page_size;
+    size_t pages_mapped;
+    /**
+     * Pages holding some allocated memory
+     */
+    size_t pages_in_use;
+    /**
+     * Share of the mapped memory which does not hold user data:
+     * 1 - bytes_in_use / bytes_mapped
+     */
+    double fragmentation;
+    MemClassStats classes[MEM_STATS_CLASS_COUNT];
+    /**
+     * Sampled mem_alloc and mem_free latencies, empty unless sampling is
+     * enabled with mem_stats_set_sampling
+     */
+    MemLatencyStats alloc_latency;
+    MemLatencyStats free_latency;
+} MemStats;
+
+/**
+ * Read the current statistics
+ * @param stats Filled with the statistics
+ */
+void mem_stats(MemStats* stats);
+
+/**
+ * Time one of every \a period mem_alloc and mem_free calls of each thread
+ * @param period Sampling period, 0 (the default) turns sampling off
+ */
+void mem_stats_set_sampling(unsigned period);
+
+/**
+ * Write \a stats as a JSON object
+ * @param stats Statistics got from mem_stats
+ * @param buffer Output, always terminated if \a size is not 0
+ * @param size Size of \a buffer
+ * @return Length of the whole text, as snprintf
+ */
+size_t mem_stats_json(const MemStats* stats, char* buffer, size_t size);
+
+/**
+ * Write \a stats in the Prometheus text exposition format
+ * @param stats Statistics got from mem_stats
+ * @param buffer Output, always terminated if \a size is not 0
+ * @param size Size of \a buffer
+ * @return Length of the whole text, as snprintf
+ */
+size_t mem_stats_prometheus(const MemStats* stats, char* buffer, size_t size);
+
+/*
+ * Allocator side: the allocator counts the calls and fills in its layout.
+ */
+
+/**
+ * Class of blocks with \a usable_size usable bytes
+ */
+static inline size_t mem_stats_class(size_t usable_size) {
+    if (usable_size <= 8) return 0;
+    const size_t index = 64 - __builtin_clzll(usable_size - 1) - 3;
+    return index < MEM_STATS_CLASS_COUNT ? index : MEM_STATS_CLASS_COUNT - 1;
+}
+
+/**
+ * Count a block of \a usable_size bytes handed out to the program
+ */
+void stats_count_alloc(size_t usable_size);
+
+/**
+ * Count a block of \a usable_size bytes given back by the program
+ */
+void stats_count_free(size_t usable_size);
+
+/**
+ * Count a mem_realloc call
+ */
+void stats_count_realloc(void);
+
+/**
+ * Count a block resized in place from \a old_size to \a new_size usable bytes
+ */
+void stats_count_resize(size_t old_size, size_t new_size);
+
+/**
+ * Start timing an operation if it is sampled
+ * @return Start time, 0 if the operation is not sampled
+ */
+uint64_t stats_sample_start(void);
+
+/**
+ * Record the latency of a sampled mem_alloc started at \a start
+ */
+void stats_sample_alloc(uint64_t start);
+
+/**
+ * Record the latency of a sampled mem_free started at \a start
+ */
+void stats_sample_free(uint64_t start);
+
+/**
+ * Take the lock of the per-thread counter list, held over fork
+ */
+void stats_lock(void);
+
+void stats_unlock(void);
+
+/**
+ * Fill in the layout of the heap: bytes_mapped, bytes_free, the page
+ * counters and the free_blocks, pages and page_blocks of the classes.
+ * Implemented by the allocator, called with the heap lock held
+ * @param stats Statistics with the layout fields zeroed
+ */
+void central_stats(MemStats* stats);
+
+#endif	/* MEM_STATS_H */
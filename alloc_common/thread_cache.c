@@ -0,0 +1,540 @@
+#ifdef MEM_THREAD_SAFE
+
+#define _DEFAULT_SOURCE
+
+#include "thread_cache.h"
+#include "allocator.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/**
+ * Number of size classes served by thread caches
+ */
+#define CLASS_COUNT 18
+
+/**
+ * Most blocks moved between a thread cache and the central heap under one
+ * lock
+ */
+#define MAX_BATCH 64
+
+/**
+ * Thread caches are aligned to this value, so the low bits of a cache
+ * address are free to store the size class in a block tag
+ */
+#define CACHE_ALIGNMENT 64
+
+/**
+ * Size of the tag word which prefixes every block
+ */
+static const size_t tag_size = TC_TAG_SIZE;
+
+/**
+ * Biggest block (tag included) which is served by thread caches.
+ * -DMEM_NO_THREAD_CACHE sends every call to the locked central heap
+ */
+#ifdef MEM_NO_THREAD_CACHE
+static const size_t max_cached_size = 0;
+#else
+static const size_t max_cached_size = 1024;
+#endif
+
+/**
+ * Free block while it sits in a thread cache or in a remote-free queue.
+ * The tag is kept intact, the link lives in the first word of user data
+ */
+typedef struct CachedBlock {
+    /**
+     * Owning cache address ORed with the size class
+     */
+    uintptr_t tag;
+    /**
+     * Next free block of the same list
+     */
+    struct CachedBlock* next;
+} CachedBlock;
+
+/**
+ * Free blocks of one size class owned by a thread
+ */
+typedef struct ClassCache {
+    CachedBlock* first;
+    size_t count;
+} ClassCache;
+
+typedef struct ThreadCache {
+    ClassCache classes[CLASS_COUNT];
+    /**
+     * Lock-free LIFO of blocks freed by other threads. Other threads only
+     * push, the owner takes the whole list at once, so there is no ABA
+     */
+    CachedBlock* remote_frees;
+    /**
+     * False once the owning thread has exited
+     */
+    bool alive;
+    /**
+     * Next cache in the list of caches left by exited threads
+     */
+    struct ThreadCache* next_dead;
+} __attribute__((aligned(CACHE_ALIGNMENT))) ThreadCache;
+
+/**
+ * Caches of exited threads, reused by new threads.
+ * Protected by the central heap lock
+ */
+static ThreadCache* dead_caches = NULL;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread ThreadCache* thread_cache = NULL;
+
+/**
+ * Cache of the calling thread, created on first use
+ * @return Thread cache or NULL if it could not be created
+ */
+static ThreadCache* get_cache(void);
+
+/**
+ * Flush the cache of an exiting thread back to the central heap
+ * @param cache Cache of the exiting thread
+ */
+static void release_cache(void* cache);
+
+static void create_cache_key(void);
+
+/**
+ * Size class of blocks of \a size bytes (tag included)
+ * @param size Block size, at most max_cached_size
+ * @return Size class index
+ */
+static size_t class_index(size_t size);
+
+/**
+ * Size of blocks of size class \a index (tag included)
+ * @param index Size class index
+ * @return Block size in bytes
+ */
+static size_t class_size(size_t index);
+
+/**
+ * Number of blocks moved between a thread cache and the central heap at once
+ * @param index Size class index
+ * @return Batch size
+ */
+static size_t batch_size(size_t index);
+
+/**
+ * Get a batch of blocks of size class \a index from the central heap
+ * @param cache Cache to be refilled
+ * @param index Size class index
+ * @param count Number of blocks wanted, at most MAX_BATCH
+ */
+static void refill(ThreadCache* cache, size_t index, size_t count);
+
+/**
+ * Return \a count blocks of size class \a index to the central heap
+ * @param cache Cache to be flushed
+ * @param index Size class index
+ * @param count Number of blocks to return
+ */
+static void flush(ThreadCache* cache, size_t index, size_t count);
+
+/**
+ * Move blocks freed by other threads into the class lists of \a cache
+ * @param cache Cache of the calling thread
+ */
+static void drain_remote_frees(ThreadCache* cache);
+
+/**
+ * Put \a block into its class list of \a cache, flushing a batch to the
+ * central heap when the list grows too long
+ * @param cache Owner of the block
+ * @param block Block being freed
+ */
+static void push_block(ThreadCache* cache, CachedBlock* block);
+
+/**
+ * Allocate a block tagged as not cached directly from the central heap
+ * @param size Number of bytes needed by the user
+ * @param alignment Alignment of the user data, a power of two
+ * @return Pointer to user data or NULL
+ */
+static void* alloc_uncached(size_t size, size_t alignment);
+
+/**
+ * Return a block of the central heap under the lock
+ * @param block Block start (tag included)
+ * @return Usable size the block had (tag included)
+ */
+static size_t free_uncached(CachedBlock* block);
+
+/**
+ * Allocate blocks tagged as not cached from the central heap, MAX_BATCH
+ * blocks per lock
+ * @param size Number of bytes needed by the user in every block
+ * @param count Number of blocks
+ * @param out Receives pointers to user data
+ * @return Number of blocks allocated
+ */
+static size_t alloc_uncached_batch(size_t size, size_t count, void** out);
+
+/**
+ * Return not cached blocks to the central heap, MAX_BATCH blocks per lock
+ * @param addrs Pointers to user data
+ * @param count Number of pointers
+ */
+static void free_uncached_batch(void* const* addrs, size_t count);
+
+void* tc_alloc(size_t size) {
+    if (max_cached_size < tag_size || size > max_cached_size - tag_size) {
+        return alloc_uncached(size, MEM_ALIGNMENT);
+    }
+    ThreadCache* const cache = get_cache();
+    if (cache == NULL) {
+        return alloc_uncached(size, MEM_ALIGNMENT);
+    }
+    const size_t index = class_index(size + tag_size);
+    ClassCache* const class_cache = &cache->classes[index];
+    if (class_cache->first == NULL) {
+        drain_remote_frees(cache);
+        if (class_cache->first == NULL) {
+            refill(cache, index, batch_size(index));
+            if (class_cache->first == NULL) return NULL;
+        }
+    }
+    CachedBlock* const block = class_cache->first;
+    class_cache->first = block->next;
+    --class_cache->count;
+    stats_count_alloc(class_size(index) - tag_size);
+    return (void*)block + tag_size;
+}
+
+void tc_free(void* addr) {
+    if (addr == NULL) return;
+    CachedBlock* const block = addr - tag_size;
+    ThreadCache* const owner =
+            (ThreadCache*)(block->tag & ~(uintptr_t)(CACHE_ALIGNMENT - 1));
+    if (owner == NULL) {
+        stats_count_free(free_uncached(block) - tag_size);
+        return;
+    }
+    stats_count_free(class_size(block->tag & (CACHE_ALIGNMENT - 1)) - tag_size);
+    if (owner == thread_cache) {
+        push_block(owner, block);
+    } else if (__atomic_load_n(&owner->alive, __ATOMIC_ACQUIRE)) {
+        CachedBlock* first = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+        do {
+            block->next = first;
+        } while (!__atomic_compare_exchange_n(&owner->remote_frees, &first, block,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    } else {
+        // owner has exited, nobody would pick the block up
+        free_uncached(block);
+    }
+}
+
+void* tc_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment <= MEM_ALIGNMENT) return tc_alloc(size);
+    // cached blocks are only MEM_ALIGNMENT aligned, over-aligned ones are
+    // rare enough to take the lock
+    return alloc_uncached(size, alignment);
+}
+
+size_t tc_alloc_batch(size_t size, size_t count, void** out) {
+    if (max_cached_size < tag_size || size > max_cached_size - tag_size) {
+        return alloc_uncached_batch(size, count, out);
+    }
+    ThreadCache* const cache = get_cache();
+    if (cache == NULL) {
+        return alloc_uncached_batch(size, count, out);
+    }
+    const size_t index = class_index(size + tag_size);
+    ClassCache* const class_cache = &cache->classes[index];
+    size_t done = 0;
+    while (done < count) {
+        if (class_cache->first == NULL) {
+            drain_remote_frees(cache);
+            if (class_cache->first == NULL) {
+                // big batches are refilled by what they still need
+                const size_t needed = count - done;
+                refill(cache, index, needed < batch_size(index) ? batch_size(index)
+                        : needed > MAX_BATCH ? MAX_BATCH : needed);
+                if (class_cache->first == NULL) break;
+            }
+        }
+        // unlink the whole run of blocks taken at once
+        CachedBlock* block = class_cache->first;
+        size_t taken = 0;
+        for (; block != NULL && done < count; block = block->next, ++taken) {
+            out[done++] = (void*)block + tag_size;
+        }
+        class_cache->first = block;
+        class_cache->count -= taken;
+    }
+    for (size_t i = 0; i < done; ++i) {
+        stats_count_alloc(class_size(index) - tag_size);
+    }
+    return done;
+}
+
+void tc_free_batch(void** addrs, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        // blocks of the central heap which follow each other share the lock
+        size_t uncached = 0;
+        while (i + uncached < count && addrs[i + uncached] != NULL
+                && ((CachedBlock*)(addrs[i + uncached] - tag_size))->tag == 0) {
+            ++uncached;
+        }
+        if (uncached > 0) {
+            free_uncached_batch(addrs + i, uncached);
+            i += uncached;
+        } else {
+            tc_free(addrs[i++]);
+        }
+    }
+}
+
+void* tc_realloc(void* addr, size_t new_size) {
+    if (addr == NULL) return tc_alloc(new_size);
+    const size_t old_size = tc_usable_size(addr);
+    CachedBlock* const block = addr - tag_size;
+    // cached blocks keep their class
+    if (block->tag != 0 && new_size <= old_size) return addr;
+
+    if (block->tag == 0 && new_size <= SIZE_MAX - tag_size) {
+        // central heap blocks may grow in place, and give the tail back when
+        // they shrink
+        central_lock();
+        const bool resized = central_resize(block, new_size + tag_size);
+        const size_t size = central_usable_size(block);
+        central_unlock();
+        if (resized) {
+            stats_count_resize(old_size, size - tag_size);
+            return addr;
+        }
+    }
+
+    // a block which could not shrink in place stays if it can not move
+    void* const new_addr = tc_alloc(new_size);
+    if (new_addr == NULL) return new_size <= old_size ? addr : NULL;
+    mem_copy(new_addr, addr, old_size < new_size ? old_size : new_size);
+    tc_free(addr);
+    return new_addr;
+}
+
+size_t tc_usable_size(void* addr) {
+    CachedBlock* const block = addr - tag_size;
+    if (block->tag == 0) {
+        central_lock();
+        const size_t size = central_usable_size(block);
+        central_unlock();
+        return size - tag_size;
+    }
+    return class_size(block->tag & (CACHE_ALIGNMENT - 1)) - tag_size;
+}
+
+void tc_flush(void) {
+    ThreadCache* const cache = thread_cache;
+    if (cache == NULL) return;
+    drain_remote_frees(cache);
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        flush(cache, i, cache->classes[i].count);
+    }
+}
+
+static ThreadCache* get_cache(void) {
+    if (thread_cache != NULL) return thread_cache;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    central_lock();
+    ThreadCache* cache = dead_caches;
+    if (cache != NULL) {
+        dead_caches = cache->next_dead;
+    }
+    central_unlock();
+
+    if (cache == NULL) {
+        // caches live outside of the heap they cache
+        cache = mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cache == MAP_FAILED) return NULL;
+    }
+    cache->next_dead = NULL;
+    __atomic_store_n(&cache->alive, true, __ATOMIC_RELEASE);
+    thread_cache = cache;
+    pthread_setspecific(cache_key, cache);
+    return cache;
+}
+
+static void release_cache(void* cache_void) {
+    ThreadCache* const cache = cache_void;
+    drain_remote_frees(cache);
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        flush(cache, i, cache->classes[i].count);
+    }
+    // frees racing with the exit stay in the queue until the cache is reused
+    __atomic_store_n(&cache->alive, false, __ATOMIC_RELEASE);
+    central_lock();
+    cache->next_dead = dead_caches;
+    dead_caches = cache;
+    central_unlock();
+    thread_cache = NULL;
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, release_cache);
+}
+
+static size_t class_index(size_t size) {
+    if (size <= 256) {
+        return size == 0 ? 0 : (size + 15) / 16 - 1;
+    }
+    return size <= 512 ? 16 : 17;
+}
+
+static size_t class_size(size_t index) {
+    return index < 16 ? (index + 1) * 16 : (size_t)512 << (index - 16);
+}
+
+static size_t batch_size(size_t index) {
+    const size_t count = 8192 / class_size(index);
+    return count < 4 ? 4 : count > MAX_BATCH ? MAX_BATCH : count;
+}
+
+static void refill(ThreadCache* cache, size_t index, size_t count) {
+    ClassCache* const class_cache = &cache->classes[index];
+    const uintptr_t tag = (uintptr_t)cache | index;
+    void* blocks[MAX_BATCH];
+
+    central_lock();
+    const size_t got = central_alloc_batch(class_size(index), count, blocks);
+    central_unlock();
+
+    // pushed backwards, so blocks are handed out in the order they came
+    for (size_t i = got; i-- > 0;) {
+        CachedBlock* const block = blocks[i];
+        block->tag = tag;
+        block->next = class_cache->first;
+        class_cache->first = block;
+    }
+    class_cache->count += got;
+}
+
+static void flush(ThreadCache* cache, size_t index, size_t count) {
+    ClassCache* const class_cache = &cache->classes[index];
+    void* blocks[MAX_BATCH];
+
+    while (count > 0 && class_cache->first != NULL) {
+        size_t taken = 0;
+        while (taken < count && taken < MAX_BATCH && class_cache->first != NULL) {
+            CachedBlock* const block = class_cache->first;
+            class_cache->first = block->next;
+            blocks[taken++] = block;
+        }
+        class_cache->count -= taken;
+        count -= taken;
+
+        central_lock();
+        central_free_batch(blocks, taken);
+        central_unlock();
+    }
+}
+
+static void drain_remote_frees(ThreadCache* cache) {
+    if (__atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+    CachedBlock* block = __atomic_exchange_n(&cache->remote_frees, NULL,
+            __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        CachedBlock* const next = block->next;
+        push_block(cache, block);
+        block = next;
+    }
+}
+
+static void push_block(ThreadCache* cache, CachedBlock* block) {
+    const size_t index = block->tag & (CACHE_ALIGNMENT - 1);
+    ClassCache* const class_cache = &cache->classes[index];
+    block->next = class_cache->first;
+    class_cache->first = block;
+    ++class_cache->count;
+    if (class_cache->count > 2 * batch_size(index)) {
+        flush(cache, index, batch_size(index));
+    }
+}
+
+static void* alloc_uncached(size_t size, size_t alignment) {
+    if (size > SIZE_MAX - tag_size) return NULL;
+    central_lock();
+    CachedBlock* const block = alignment > MEM_ALIGNMENT
+            ? central_alloc_aligned(size + tag_size, alignment)
+            : central_alloc(size + tag_size);
+    const size_t usable_size = block != NULL ? central_usable_size(block) : 0;
+    central_unlock();
+    if (block == NULL) return NULL;
+    block->tag = 0;
+    stats_count_alloc(usable_size - tag_size);
+    return (void*)block + tag_size;
+}
+
+static size_t alloc_uncached_batch(size_t size, size_t count, void** out) {
+    if (size > SIZE_MAX - tag_size) return 0;
+    size_t done = 0;
+    while (done < count) {
+        const size_t wanted = count - done < MAX_BATCH ? count - done : MAX_BATCH;
+        size_t usable_sizes[MAX_BATCH];
+        central_lock();
+        const size_t got = central_alloc_batch(size + tag_size, wanted, out + done);
+        for (size_t i = 0; i < got; ++i) {
+            usable_sizes[i] = central_usable_size(out[done + i]);
+        }
+        central_unlock();
+
+        for (size_t i = 0; i < got; ++i) {
+            CachedBlock* const block = out[done + i];
+            block->tag = 0;
+            out[done + i] = (void*)block + tag_size;
+            stats_count_alloc(usable_sizes[i] - tag_size);
+        }
+        done += got;
+        if (got < wanted) break;
+    }
+    return done;
+}
+
+static void free_uncached_batch(void* const* addrs, size_t count) {
+    void* blocks[MAX_BATCH];
+    size_t usable_sizes[MAX_BATCH];
+    while (count > 0) {
+        const size_t taken = count < MAX_BATCH ? count : MAX_BATCH;
+        for (size_t i = 0; i < taken; ++i) {
+            blocks[i] = addrs[i] - tag_size;
+        }
+        central_lock();
+        for (size_t i = 0; i < taken; ++i) {
+            usable_sizes[i] = central_usable_size(blocks[i]);
+        }
+        central_free_batch(blocks, taken);
+        central_unlock();
+
+        for (size_t i = 0; i < taken; ++i) {
+            stats_count_free(usable_sizes[i] - tag_size);
+        }
+        addrs += taken;
+        count -= taken;
+    }
+}
+
+static size_t free_uncached(CachedBlock* block) {
+    central_lock();
+    const size_t size = central_usable_size(block);
+    central_free(block);
+    central_unlock();
+    return size;
+}
+
+#endif	/* MEM_THREAD_SAFE */
@@ -0,0 +1,164 @@
+#ifndef THREAD_CACHE_H
+#define	THREAD_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Thread-safe mode (compile with -DMEM_THREAD_SAFE -pthread).
+ *
+ * Every thread owns a cache of small blocks sorted by size class. The cache
+ * refills from and flushes to the central heap in batches, so the central
+ * heap lock is taken once per batch instead of once per call. Blocks freed
+ * by a thread which does not own them are pushed onto the owner's lock-free
+ * remote-free queue and picked up by the owner on its next refill.
+ *
+ * Every block handed out in this mode is prefixed with a tag word holding
+ * the owning cache and the size class (zero for blocks served directly by
+ * the central heap).
+ */
+
+/**
+ * Bytes the thread caches put in front of the user data. central_alloc
+ * returns addresses TC_TAG_SIZE bytes below a multiple of MEM_ALIGNMENT,
+ * so the memory handed out after the tag is aligned
+ */
+#ifdef MEM_THREAD_SAFE
+#define TC_TAG_SIZE sizeof(uintptr_t)
+#else
+#define TC_TAG_SIZE ((size_t)0)
+#endif
+
+/**
+ * Allocate \a size bytes from the central heap. Called with the heap lock held
+ * @param size Number of bytes needed
+ * @return Pointer to the block or NULL
+ */
+void* central_alloc(size_t size);
+
+/**
+ * Allocate \a size bytes from the central heap at an address TC_TAG_SIZE
+ * bytes below a multiple of \a alignment. Called with the heap lock held
+ * @param size Number of bytes needed
+ * @param alignment Power of two
+ * @return Pointer to the block or NULL; it is freed like any other block
+ */
+void* central_alloc_aligned(size_t size, size_t alignment);
+
+/**
+ * Return block \a addr got from central_alloc. Called with the heap lock held
+ * @param addr Pointer returned by central_alloc
+ */
+void central_free(void* addr);
+
+/**
+ * Allocate \a count blocks of \a size bytes from the central heap at once.
+ * Called with the heap lock held
+ * @param size Number of bytes needed in every block
+ * @param count Number of blocks
+ * @param out Receives the blocks
+ * @return Number of blocks allocated, less than \a count when out of memory
+ */
+size_t central_alloc_batch(size_t size, size_t count, void** out);
+
+/**
+ * Return \a count blocks got from central_alloc at once. Called with the
+ * heap lock held
+ * @param addrs Pointers returned by central_alloc, NULL ones are skipped
+ * @param count Number of pointers
+ */
+void central_free_batch(void** addrs, size_t count);
+
+/**
+ * Number of bytes which can be used in block \a addr got from central_alloc.
+ * Called with the heap lock held
+ * @param addr Pointer returned by central_alloc
+ * @return Usable size of the block
+ */
+size_t central_usable_size(void* addr);
+
+/**
+ * Resize block \a addr got from central_alloc to \a size bytes without
+ * moving it. Called with the heap lock held
+ * @param addr Pointer returned by central_alloc
+ * @param size New size in bytes
+ * @return True if the block now holds \a size bytes, false if it has to move
+ */
+bool central_resize(void* addr, size_t size);
+
+/**
+ * Give the pages of every free part of the central heap back to the OS.
+ * Called with the heap lock held
+ * @return Number of bytes given back
+ */
+size_t central_trim(void);
+
+/**
+ * Take the central heap lock
+ */
+void central_lock(void);
+
+/**
+ * Release the central heap lock
+ */
+void central_unlock(void);
+
+/**
+ * Allocate \a size bytes through the calling thread's cache
+ * @param size Number of bytes needed
+ * @return Pointer to memory or NULL
+ */
+void* tc_alloc(size_t size);
+
+/**
+ * Allocate \a size bytes aligned to \a alignment, a power of two. Blocks
+ * aligned to more than MEM_ALIGNMENT come from the central heap
+ * @return Pointer to memory, freed with tc_free, or NULL
+ */
+void* tc_alloc_aligned(size_t size, size_t alignment);
+
+/**
+ * Free memory got from tc_alloc, possibly allocated by another thread
+ * @param addr Pointer returned by tc_alloc
+ */
+void tc_free(void* addr);
+
+/**
+ * Allocate \a count blocks of \a size bytes through the calling thread's cache
+ * @param size Number of bytes needed in every block
+ * @param count Number of blocks
+ * @param out Receives the blocks
+ * @return Number of blocks allocated, less than \a count when out of memory
+ */
+size_t tc_alloc_batch(size_t size, size_t count, void** out);
+
+/**
+ * Free \a count blocks got from tc_alloc or tc_alloc_batch
+ * @param addrs Pointers to free, NULL ones are skipped
+ * @param count Number of pointers
+ */
+void tc_free_batch(void** addrs, size_t count);
+
+/**
+ * Resize memory got from tc_alloc
+ * @param addr Pointer returned by tc_alloc
+ * @param new_size New size in bytes
+ * @return New pointer to memory or NULL if it could not be resized
+ */
+void* tc_realloc(void* addr, size_t new_size);
+
+/**
+ * Give the blocks cached by the calling thread, and the ones other threads
+ * freed to it, back to the central heap
+ */
+void tc_flush(void);
+
+/**
+ * Number of bytes which can be used in memory got from tc_alloc
+ * @param addr Pointer returned by tc_alloc
+ * @return Usable size
+ */
+size_t tc_usable_size(void* addr);
+
+#endif	/* THREAD_CACHE_H */
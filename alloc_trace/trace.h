@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define	TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary allocation trace: a TraceHeader followed by TraceRecords up to the
+ * end of the file, all in the byte order of the recording machine.
+ *
+ * Objects are named by ids instead of addresses. An id is given out when an
+ * object is allocated and may be reused after the object is freed, so ids
+ * stay below the peak number of live objects and replay can keep its
+ * objects in a flat array. An object keeps its id when it is resized.
+ */
+
+/**
+ * "MTRC" in the first four bytes of a little-endian trace
+ */
+#define TRACE_MAGIC 0x4352544du
+
+#define TRACE_VERSION 1
+
+typedef enum TraceOperation {
+    /**
+     * malloc, calloc, realloc(NULL, size) and the aligned allocations
+     */
+    TRACE_ALLOC = 1,
+    /**
+     * free and realloc(ptr, 0)
+     */
+    TRACE_FREE = 2,
+    /**
+     * realloc of a live object
+     */
+    TRACE_REALLOC = 3
+} TraceOperation;
+
+typedef struct TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Size of one record, so older readers can skip fields added later
+     */
+    uint32_t record_size;
+    uint32_t reserved;
+} TraceHeader;
+
+typedef struct TraceRecord {
+    /**
+     * Nanoseconds since the trace was started
+     */
+    uint64_t time;
+    /**
+     * Requested size, 0 for TRACE_FREE
+     */
+    uint64_t size;
+    /**
+     * Object id
+     */
+    uint32_t id;
+    /**
+     * Recording thread, numbered from 0 in order of the first call
+     */
+    uint16_t thread;
+    /**
+     * TraceOperation
+     */
+    uint8_t operation;
+    /**
+     * log2 of the requested alignment, 0 when the default one was enough
+     */
+    uint8_t alignment_shift;
+} TraceRecord;
+
+#endif	/* TRACE_H */
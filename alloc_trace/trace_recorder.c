@@ -0,0 +1,515 @@
+/*
+ * LD_PRELOAD library which records every malloc, calloc, realloc, free and
+ * aligned allocation of a process into a binary trace (see trace.h).
+ *
+ * Usage: MEM_TRACE_FILE=app.trace LD_PRELOAD=./build/libmemtrace.so app
+ * Without MEM_TRACE_FILE the trace goes to memtrace.<pid>.bin, which is
+ * what programs starting other programs need: every process that inherits
+ * MEM_TRACE_FILE truncates the same file.
+ *
+ * Calls are forwarded to the next malloc in the search order (glibc) under
+ * one lock, so the recorded order is the order in which the heap saw them.
+ * Forked children are not recorded.
+ */
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Records buffered before a write
+ */
+#define BUFFER_RECORDS 65536
+
+/**
+ * Initial number of slots in the address map, a power of two
+ */
+#define MAP_INITIAL_CAPACITY 65536
+
+/**
+ * Memory handed out while the real allocator is being looked up
+ * (dlsym may allocate)
+ */
+#define BOOTSTRAP_SIZE 8192
+
+#define TLS _Thread_local __attribute__((tls_model("initial-exec")))
+
+/**
+ * Slot of the address to id map, address 0 marks an empty slot
+ */
+typedef struct MapSlot {
+    uintptr_t address;
+    uint32_t id;
+} MapSlot;
+
+static void* (*real_malloc)(size_t);
+static void (*real_free)(void*);
+static void* (*real_calloc)(size_t, size_t);
+static void* (*real_realloc)(void*, size_t);
+static int (*real_posix_memalign)(void**, size_t, size_t);
+static void* (*real_aligned_alloc)(size_t, size_t);
+static void* (*real_memalign)(size_t, size_t);
+static void* (*real_valloc)(size_t);
+
+static char bootstrap_heap[BOOTSTRAP_SIZE] __attribute__((aligned(64)));
+static size_t bootstrap_used = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static bool is_resolving = false;
+static bool is_initialized = false;
+static struct timespec start_time;
+
+static TraceRecord buffer[BUFFER_RECORDS];
+static size_t buffered = 0;
+
+static MapSlot* map = NULL;
+static size_t map_capacity = 0;
+static size_t map_count = 0;
+
+/**
+ * Stack of ids of freed objects, reused before new ones are given out
+ */
+static uint32_t* free_ids = NULL;
+static size_t free_id_count = 0;
+static size_t free_id_capacity = 0;
+static uint32_t next_id = 0;
+
+static uint16_t thread_count = 0;
+
+/**
+ * Set while the recorder itself runs, so allocations made by libc on its
+ * behalf are passed through without recording
+ */
+static TLS bool in_recorder = false;
+static TLS int thread_number = -1;
+
+/**
+ * Look up the real allocator and open the trace file, once
+ */
+static void initialize(void);
+
+static void flush(void);
+
+static void stop_recording(void);
+
+static void fork_prepare(void);
+
+static void fork_parent(void);
+
+static void fork_child(void);
+
+static void* bootstrap_alloc(size_t size, size_t alignment);
+
+static bool is_bootstrap(const void* ptr);
+
+/**
+ * Start recording a call: take the trace lock unless the call comes from
+ * the recorder itself or nothing is recorded
+ * @return True if the call has to be recorded and end_event called
+ */
+static bool begin_event(void);
+
+static void end_event(void);
+
+static void emit(TraceOperation operation, uint32_t id, size_t size, size_t alignment);
+
+static void record_alloc(void* ptr, size_t size, size_t alignment);
+
+static void record_free(void* ptr);
+
+static void record_realloc(void* old_ptr, void* new_ptr, size_t size);
+
+static size_t map_slot(uintptr_t address);
+
+static void map_insert(uintptr_t address, uint32_t id);
+
+/**
+ * Remove \a address from the map
+ * @return Id of the object or false if the address is unknown
+ */
+static bool map_remove(uintptr_t address, uint32_t* id);
+
+static bool map_grow(void);
+
+static uint32_t take_id(void);
+
+static void release_id(uint32_t id);
+
+/**
+ * Anonymous memory for the recorder's own tables
+ */
+static void* map_memory(size_t size);
+
+void* malloc(size_t size) {
+    if (!begin_event()) {
+        return real_malloc ? real_malloc(size) : bootstrap_alloc(size, 16);
+    }
+    void* const ptr = real_malloc(size);
+    if (ptr != NULL) record_alloc(ptr, size, 0);
+    end_event();
+    return ptr;
+}
+
+void free(void* ptr) {
+    if (ptr == NULL || is_bootstrap(ptr)) return;
+    if (!begin_event()) {
+        real_free(ptr);
+        return;
+    }
+    record_free(ptr);
+    real_free(ptr);
+    end_event();
+}
+
+void* calloc(size_t count, size_t size) {
+    if (!begin_event()) {
+        // memory from bootstrap_heap is never reused, so it is zeroed
+        return real_calloc ? real_calloc(count, size)
+                           : (size && count > SIZE_MAX / size) ? NULL
+                           : bootstrap_alloc(count * size, 16);
+    }
+    void* const ptr = real_calloc(count, size);
+    if (ptr != NULL) record_alloc(ptr, count * size, 0);
+    end_event();
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (is_bootstrap(ptr)) {
+        void* const new_ptr = malloc(size);
+        const size_t available = bootstrap_heap + BOOTSTRAP_SIZE - (char*)ptr;
+        if (new_ptr != NULL) memcpy(new_ptr, ptr, size < available ? size : available);
+        return new_ptr;
+    }
+    if (!begin_event()) {
+        if (real_realloc) return real_realloc(ptr, size);
+        return ptr == NULL ? bootstrap_alloc(size, 16) : NULL;
+    }
+    void* const new_ptr = real_realloc(ptr, size);
+    if (ptr == NULL) {
+        if (new_ptr != NULL) record_alloc(new_ptr, size, 0);
+    } else if (new_ptr != NULL) {
+        record_realloc(ptr, new_ptr, size);
+    } else if (size == 0) {
+        record_free(ptr);
+    }
+    end_event();
+    return new_ptr;
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (!begin_event()) {
+        if (real_posix_memalign) return real_posix_memalign(result, alignment, size);
+        *result = bootstrap_alloc(size, alignment);
+        return *result ? 0 : ENOMEM;
+    }
+    const int error = real_posix_memalign(result, alignment, size);
+    if (error == 0) record_alloc(*result, size, alignment);
+    end_event();
+    return error;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (!begin_event()) {
+        return real_aligned_alloc ? real_aligned_alloc(alignment, size)
+                                  : bootstrap_alloc(size, alignment);
+    }
+    void* const ptr = real_aligned_alloc(alignment, size);
+    if (ptr != NULL) record_alloc(ptr, size, alignment);
+    end_event();
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (!begin_event()) {
+        return real_memalign ? real_memalign(alignment, size)
+                             : bootstrap_alloc(size, alignment);
+    }
+    void* const ptr = real_memalign(alignment, size);
+    if (ptr != NULL) record_alloc(ptr, size, alignment);
+    end_event();
+    return ptr;
+}
+
+void* valloc(size_t size) {
+    if (!begin_event()) {
+        return real_valloc ? real_valloc(size) : bootstrap_alloc(size, 4096);
+    }
+    void* const ptr = real_valloc(size);
+    if (ptr != NULL) record_alloc(ptr, size, sysconf(_SC_PAGESIZE));
+    end_event();
+    return ptr;
+}
+
+__attribute__((constructor))
+static void recorder_constructor(void) {
+    initialize();
+}
+
+__attribute__((destructor))
+static void recorder_destructor(void) {
+    pthread_mutex_lock(&trace_lock);
+    stop_recording();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void initialize(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (is_initialized || is_resolving) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    is_resolving = true;
+    in_recorder = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_valloc = dlsym(RTLD_NEXT, "valloc");
+
+    char path[4096];
+    const char* const name = getenv("MEM_TRACE_FILE");
+    if (name != NULL && name[0] != '\0') {
+        snprintf(path, sizeof(path), "%s", name);
+    } else {
+        snprintf(path, sizeof(path), "memtrace.%ld.bin", (long)getpid());
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd >= 0) {
+        const TraceHeader header = {
+            .magic = TRACE_MAGIC,
+            .version = TRACE_VERSION,
+            .record_size = sizeof(TraceRecord),
+        };
+        if (write(trace_fd, &header, sizeof(header)) != sizeof(header)
+                || !map_grow()) {
+            close(trace_fd);
+            trace_fd = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+    in_recorder = false;
+    is_resolving = false;
+    is_initialized = true;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void flush(void) {
+    const char* data = (const char*)buffer;
+    size_t left = buffered * sizeof(TraceRecord);
+    while (left > 0 && trace_fd >= 0) {
+        const ssize_t written = write(trace_fd, data, left);
+        if (written <= 0) {
+            stop_recording();
+            break;
+        }
+        data += written;
+        left -= written;
+    }
+    buffered = 0;
+}
+
+static void stop_recording(void) {
+    if (trace_fd < 0) return;
+    const int fd = trace_fd;
+    // flush must see the file open, later calls must not
+    flush();
+    trace_fd = -1;
+    close(fd);
+}
+
+static void fork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void fork_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void fork_child(void) {
+    // the parent owns the file and the buffered records
+    if (trace_fd >= 0) close(trace_fd);
+    trace_fd = -1;
+    buffered = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void* bootstrap_alloc(size_t size, size_t alignment) {
+    if (alignment < 16) alignment = 16;
+    const size_t start = (bootstrap_used + alignment - 1) & ~(alignment - 1);
+    if (start > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - start) return NULL;
+    bootstrap_used = start + size;
+    return bootstrap_heap + start;
+}
+
+static bool is_bootstrap(const void* ptr) {
+    return (const char*)ptr >= bootstrap_heap
+            && (const char*)ptr < bootstrap_heap + BOOTSTRAP_SIZE;
+}
+
+static bool begin_event(void) {
+    if (in_recorder || is_resolving) return false;
+    if (!is_initialized) initialize();
+    if (trace_fd < 0) return false;
+    in_recorder = true;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        in_recorder = false;
+        return false;
+    }
+    return true;
+}
+
+static void end_event(void) {
+    pthread_mutex_unlock(&trace_lock);
+    in_recorder = false;
+}
+
+static void emit(TraceOperation operation, uint32_t id, size_t size, size_t alignment) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (thread_number < 0) {
+        thread_number = thread_count++;
+    }
+    TraceRecord* const record = &buffer[buffered++];
+    record->time = (uint64_t)(now.tv_sec - start_time.tv_sec) * 1000000000u
+            + now.tv_nsec - start_time.tv_nsec;
+    record->size = size;
+    record->id = id;
+    record->thread = thread_number;
+    record->operation = operation;
+    record->alignment_shift = alignment > 16 ? __builtin_ctzll(alignment) : 0;
+    if (buffered == BUFFER_RECORDS) {
+        flush();
+    }
+}
+
+static void record_alloc(void* ptr, size_t size, size_t alignment) {
+    if (map_count + 1 > map_capacity / 2 && !map_grow()) {
+        stop_recording();
+        return;
+    }
+    const uint32_t id = take_id();
+    map_insert((uintptr_t)ptr, id);
+    emit(TRACE_ALLOC, id, size, alignment);
+}
+
+static void record_free(void* ptr) {
+    uint32_t id;
+    // objects allocated before recording started are not known
+    if (!map_remove((uintptr_t)ptr, &id)) return;
+    emit(TRACE_FREE, id, 0, 0);
+    release_id(id);
+}
+
+static void record_realloc(void* old_ptr, void* new_ptr, size_t size) {
+    uint32_t id;
+    if (!map_remove((uintptr_t)old_ptr, &id)) {
+        record_alloc(new_ptr, size, 0);
+        return;
+    }
+    map_insert((uintptr_t)new_ptr, id);
+    emit(TRACE_REALLOC, id, size, 0);
+}
+
+static size_t map_slot(uintptr_t address) {
+    return (address >> 4) * (uintptr_t)0x9E3779B97F4A7C15ull >> 20 & (map_capacity - 1);
+}
+
+static void map_insert(uintptr_t address, uint32_t id) {
+    size_t slot = map_slot(address);
+    while (map[slot].address != 0) {
+        slot = (slot + 1) & (map_capacity - 1);
+    }
+    map[slot].address = address;
+    map[slot].id = id;
+    ++map_count;
+}
+
+static bool map_remove(uintptr_t address, uint32_t* id) {
+    size_t slot = map_slot(address);
+    while (map[slot].address != address) {
+        if (map[slot].address == 0) return false;
+        slot = (slot + 1) & (map_capacity - 1);
+    }
+    *id = map[slot].id;
+    --map_count;
+
+    // shift back the entries which probed past the emptied slot
+    size_t empty = slot;
+    for (size_t next = (slot + 1) & (map_capacity - 1); map[next].address != 0;
+            next = (next + 1) & (map_capacity - 1)) {
+        const size_t home = map_slot(map[next].address);
+        // entry may move to the empty slot if its home is not in (empty, next]
+        if (((next - home) & (map_capacity - 1)) >= ((next - empty) & (map_capacity - 1))) {
+            map[empty] = map[next];
+            empty = next;
+        }
+    }
+    map[empty].address = 0;
+    return true;
+}
+
+static bool map_grow(void) {
+    const size_t old_capacity = map_capacity;
+    MapSlot* const old_map = map;
+    const size_t capacity = old_capacity ? old_capacity * 2 : MAP_INITIAL_CAPACITY;
+    MapSlot* const new_map = map_memory(capacity * sizeof(MapSlot));
+    if (new_map == NULL) return false;
+
+    map = new_map;
+    map_capacity = capacity;
+    map_count = 0;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_map[i].address != 0) {
+            map_insert(old_map[i].address, old_map[i].id);
+        }
+    }
+    if (old_map != NULL) munmap(old_map, old_capacity * sizeof(MapSlot));
+    return true;
+}
+
+static uint32_t take_id(void) {
+    return free_id_count > 0 ? free_ids[--free_id_count] : next_id++;
+}
+
+static void release_id(uint32_t id) {
+    if (free_id_count == free_id_capacity) {
+        const size_t capacity = free_id_capacity ? free_id_capacity * 2 : 65536;
+        uint32_t* const ids = map_memory(capacity * sizeof(uint32_t));
+        // without room the id is simply not reused
+        if (ids == NULL) return;
+        if (free_ids != NULL) {
+            memcpy(ids, free_ids, free_id_count * sizeof(uint32_t));
+            munmap(free_ids, free_id_capacity * sizeof(uint32_t));
+        }
+        free_ids = ids;
+        free_id_capacity = capacity;
+    }
+    free_ids[free_id_count++] = id;
+}
+
+static void* map_memory(size_t size) {
+    void* const memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
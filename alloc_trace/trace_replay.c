@@ -0,0 +1,378 @@
+/*
+ * Replays an allocation trace (see trace.h) against one allocator and
+ * reports throughput, latency percentiles, peak RSS and fragmentation.
+ * Built once per allocator:
+ *   replay_system     - the C library malloc (-DREPLAY_SYSTEM)
+ *   replay_allocator  - allocator/ (-DREPLAY_HEAP_INFO adds its heap layout)
+ *   replay_slab       - slab_allocator/
+ *
+ * Usage: replay_<allocator> [-s sample_period] trace_file
+ *
+ * The trace is mapped and read front to back. Pages already replayed are
+ * dropped, so traces much bigger than memory stream through.
+ * Latency is timed for every sample_period-th operation (default 8).
+ * Every page of a new or grown object is written once, outside the timed
+ * part, so the RSS reflects what a program using the memory would see.
+ * Threads are replayed in trace order on one thread.
+ */
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#ifndef REPLAY_SYSTEM
+#include "allocator.h"
+#endif
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replayed trace pages are dropped in steps of this many bytes
+ */
+#define DROP_STEP (64 << 20)
+
+/**
+ * RSS is read every this many operations and whenever the live bytes
+ * passed their last sampled peak by RSS_STEP
+ */
+#define RSS_PERIOD 4096
+#define RSS_STEP (1 << 20)
+
+#define TOUCH_STEP 4096
+
+/**
+ * Latency histogram: exact buckets below 2^SUB_BUCKET_SHIFT ns, then
+ * 2^SUB_BUCKET_SHIFT buckets for every power of two
+ */
+#define SUB_BUCKET_SHIFT 5
+#define SUB_BUCKETS (1 << SUB_BUCKET_SHIFT)
+#define BUCKET_COUNT ((64 - SUB_BUCKET_SHIFT + 1) * SUB_BUCKETS)
+
+/**
+ * Chunk size of the growable heaps of the mem_* allocators
+ */
+#define REPLAY_CHUNK_SIZE (4 << 20)
+
+typedef struct Object {
+    void* ptr;
+    uint64_t size;
+} Object;
+
+typedef struct Stats {
+    uint64_t operations[TRACE_REALLOC + 1];
+    uint64_t failed;
+    uint64_t live_bytes;
+    uint64_t peak_live_bytes;
+    uint64_t sampled_live_bytes;
+    uint64_t peak_rss;
+    /**
+     * Live bytes when the RSS peaked
+     */
+    uint64_t live_at_peak_rss;
+    uint64_t latency[BUCKET_COUNT];
+    uint64_t samples;
+} Stats;
+
+static Object* objects = NULL;
+static size_t object_capacity = 0;
+static Stats stats;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void* replay_alloc(size_t size, unsigned alignment_shift) {
+#ifdef REPLAY_SYSTEM
+    if (alignment_shift != 0) {
+        void* ptr;
+        return posix_memalign(&ptr, (size_t)1 << alignment_shift, size) == 0 ? ptr : NULL;
+    }
+    return malloc(size);
+#else
+    // the mem_* allocators have no aligned allocation, the size is replayed
+    (void)alignment_shift;
+    return mem_alloc(size);
+#endif
+}
+
+static void* replay_realloc(void* ptr, size_t size) {
+#ifdef REPLAY_SYSTEM
+    return realloc(ptr, size);
+#else
+    return mem_realloc(ptr, size);
+#endif
+}
+
+static void replay_free(void* ptr) {
+#ifdef REPLAY_SYSTEM
+    free(ptr);
+#else
+    mem_free(ptr);
+#endif
+}
+
+/**
+ * Resident anonymous memory in bytes, pages of the mapped trace excluded
+ */
+static uint64_t anonymous_rss() {
+    FILE* const file = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0, shared = 0;
+    if (file == NULL) return 0;
+    if (fscanf(file, "%lu %lu %lu", &size, &resident, &shared) != 3) {
+        resident = shared = 0;
+    }
+    fclose(file);
+    return (uint64_t)(resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+static void sample_rss() {
+    const uint64_t rss = anonymous_rss();
+    if (stats.live_bytes > stats.sampled_live_bytes) {
+        stats.sampled_live_bytes = stats.live_bytes;
+    }
+    if (rss > stats.peak_rss) {
+        stats.peak_rss = rss;
+        stats.live_at_peak_rss = stats.live_bytes;
+    }
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) return value;
+    const unsigned exponent = 63 - __builtin_clzll(value);
+    const size_t sub_bucket = (value >> (exponent - SUB_BUCKET_SHIFT)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_SHIFT + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * Smallest value which falls into \a bucket
+ */
+static uint64_t bucket_value(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    const unsigned exponent = bucket / SUB_BUCKETS + SUB_BUCKET_SHIFT - 1;
+    return ((uint64_t)1 << exponent)
+            + ((uint64_t)(bucket % SUB_BUCKETS) << (exponent - SUB_BUCKET_SHIFT));
+}
+
+static uint64_t percentile(double fraction) {
+    const uint64_t rank = (uint64_t)(fraction * (stats.samples - 1));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += stats.latency[bucket];
+        if (seen > rank) return bucket_value(bucket);
+    }
+    return 0;
+}
+
+/**
+ * Object with id \a id, the table grows on demand
+ */
+static Object* object(uint32_t id) {
+    if (id >= object_capacity) {
+        size_t capacity = object_capacity ? object_capacity : 65536;
+        while (capacity <= id) capacity *= 2;
+        void* const table = object_capacity
+                ? mremap(objects, object_capacity * sizeof(Object),
+                        capacity * sizeof(Object), MREMAP_MAYMOVE)
+                : mmap(NULL, capacity * sizeof(Object), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            fprintf(stderr, "out of memory for %zu objects\n", capacity);
+            exit(EXIT_FAILURE);
+        }
+        objects = table;
+        object_capacity = capacity;
+    }
+    return &objects[id];
+}
+
+/**
+ * Write every page of \a ptr from \a from up to \a size
+ */
+static void touch(char* ptr, uint64_t from, uint64_t size) {
+    for (uint64_t offset = from; offset < size; offset += TOUCH_STEP) {
+        ptr[offset] = 1;
+    }
+    if (size > from) {
+        ptr[size - 1] = 1;
+    }
+}
+
+/**
+ * Replays \a record, returns the object it left live or NULL
+ */
+static Object* replay(const TraceRecord* record, uint64_t* old_size) {
+    Object* const target = object(record->id);
+    *old_size = target->size;
+    switch (record->operation) {
+        case TRACE_ALLOC:
+            if (target->ptr != NULL) {
+                // id reused without a free in the trace, drop the old object
+                replay_free(target->ptr);
+                stats.live_bytes -= target->size;
+            }
+            target->ptr = replay_alloc(record->size, record->alignment_shift);
+            break;
+        case TRACE_REALLOC: {
+            void* const ptr = replay_realloc(target->ptr, record->size);
+            if (ptr == NULL && record->size != 0) {
+                ++stats.failed;
+                return NULL;
+            }
+            target->ptr = ptr;
+            break;
+        }
+        case TRACE_FREE:
+            replay_free(target->ptr);
+            target->ptr = NULL;
+            stats.live_bytes -= target->size;
+            target->size = 0;
+            return NULL;
+        default:
+            return NULL;
+    }
+    if (target->ptr == NULL) {
+        ++stats.failed;
+        stats.live_bytes -= target->size;
+        target->size = 0;
+        return NULL;
+    }
+    if (record->operation == TRACE_ALLOC) {
+        *old_size = 0;
+    }
+    stats.live_bytes += record->size - target->size;
+    target->size = record->size;
+    if (stats.live_bytes > stats.peak_live_bytes) {
+        stats.peak_live_bytes = stats.live_bytes;
+    }
+    return target;
+}
+
+int main(int argc, char** argv) {
+    unsigned long sample_period = 8;
+    int option;
+    while ((option = getopt(argc, argv, "s:")) != -1) {
+        if (option == 's') {
+            sample_period = strtoul(optarg, NULL, 10);
+        } else {
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-s sample_period] trace_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (sample_period == 0) sample_period = 1;
+
+    const int fd = open(argv[optind], O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    const size_t file_size = file_stat.st_size;
+    if (file_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "%s: not a trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    char* const data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    madvise(data, file_size, MADV_SEQUENTIAL);
+
+    const TraceHeader* const header = (const TraceHeader*)data;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION
+            || header->record_size < sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a trace of version %d\n", argv[optind], TRACE_VERSION);
+        return EXIT_FAILURE;
+    }
+    const size_t record_size = header->record_size;
+    const size_t record_count = (file_size - sizeof(TraceHeader)) / record_size;
+
+#ifndef REPLAY_SYSTEM
+    mem_init_growable(REPLAY_CHUNK_SIZE);
+#endif
+    sample_rss();
+
+    size_t dropped = 0;
+    const double start = now_seconds();
+    for (size_t i = 0; i < record_count; ++i) {
+        const char* const position = data + sizeof(TraceHeader) + i * record_size;
+        TraceRecord record;
+        memcpy(&record, position, sizeof(record));
+        if (record.operation <= TRACE_REALLOC) {
+            ++stats.operations[record.operation];
+        }
+
+        Object* live;
+        uint64_t old_size;
+        if (i % sample_period == 0) {
+            const uint64_t before = now_ns();
+            live = replay(&record, &old_size);
+            ++stats.latency[bucket_of(now_ns() - before)];
+            ++stats.samples;
+        } else {
+            live = replay(&record, &old_size);
+        }
+        if (live != NULL) {
+            touch(live->ptr, old_size, live->size);
+        }
+
+        if (i % RSS_PERIOD == 0 || stats.live_bytes >= stats.sampled_live_bytes + RSS_STEP) {
+            sample_rss();
+        }
+        if ((size_t)(position - data) >= dropped + 2 * DROP_STEP) {
+            // give back the pages of the trace which were replayed
+            madvise(data + dropped, DROP_STEP, MADV_DONTNEED);
+            dropped += DROP_STEP;
+        }
+    }
+    const double seconds = now_seconds() - start;
+    sample_rss();
+
+    printf("operations: %zu (alloc %llu, realloc %llu, free %llu), failed %llu\n",
+            record_count, (unsigned long long)stats.operations[TRACE_ALLOC],
+            (unsigned long long)stats.operations[TRACE_REALLOC],
+            (unsigned long long)stats.operations[TRACE_FREE],
+            (unsigned long long)stats.failed);
+    printf("throughput: %.0f ops/sec\n", record_count / seconds);
+    if (stats.samples > 0) {
+        printf("latency ns: p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+                (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.9),
+                (unsigned long long)percentile(0.99), (unsigned long long)percentile(0.999),
+                (unsigned long long)percentile(1.0));
+    }
+    printf("peak live: %.1f MiB, peak rss: %.1f MiB\n",
+            stats.peak_live_bytes / 1048576.0, stats.peak_rss / 1048576.0);
+    if (stats.peak_rss > 0) {
+        // memory at the RSS peak which did not hold live objects
+        printf("fragmentation at peak rss: %.1f%%\n",
+                100.0 * (1.0 - (double)stats.live_at_peak_rss / stats.peak_rss));
+    }
+#ifdef REPLAY_HEAP_INFO
+    MemHeapInfo info;
+    mem_heap_info(&info);
+    printf("heap: %zu KiB, used %zu KiB in %zu blocks, free %zu KiB in %zu blocks, "
+            "largest free %zu KiB\n", info.heap_bytes >> 10, info.used_bytes >> 10,
+            info.used_blocks, info.free_bytes >> 10, info.free_blocks,
+            info.largest_free_block >> 10);
+#endif
+    return EXIT_SUCCESS;
+}
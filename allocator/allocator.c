@@ -1,8 +1,26 @@
+#define _DEFAULT_SOURCE
+
+#ifdef MEM_HARDENED
+// the checked mem_* calls of mem_hardening.c wrap the ones defined here
+#define MEM_HARDENED_RAW_NAMES
+#include "mem_hardening.h"
+#endif
 #include "allocator.h"
+#include "free_index.h"
+#include "thread_cache.h"
 
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 /**
  * Default buffer size if mem_init was not called manually
@@ -10,51 +28,174 @@
 static const size_t default_buffer_size = 0x10000; // 65536 bytes
 
 /**
- * Pointer to buffer start
+ * Header of every buffer got from the OS. The heap is a list of chunks:
+ * one malloc-ed chunk by default, or chunks mapped on demand in growable mode
  */
-static void* baseptr = NULL;
+typedef struct Chunk {
+    struct Chunk* prev;
+    struct Chunk* next;
+    /**
+     * Number of bytes in the chunk, header included
+     */
+    size_t size;
+    /**
+     * Chunk was got from mmap and is given back with munmap
+     */
+    bool is_mapped;
+} Chunk;
 
 /**
- * Size of OS-allocated buffer
+ * Offset of the first block in a chunk: the chunk header, padded so the
+ * data of the first block (tag of a thread-cached block included) lands on
+ * MEM_ALIGNMENT. Chunks themselves are page or malloc aligned
+ */
+static const size_t chunk_header_size =
+        (sizeof(Chunk) + sizeof(size_t) + TC_TAG_SIZE + MEM_ALIGNMENT - 1)
+        / MEM_ALIGNMENT * MEM_ALIGNMENT - sizeof(size_t) - TC_TAG_SIZE;
+
+/**
+ * List of all chunks of the heap
+ */
+static Chunk* chunks = NULL;
+
+/**
+ * Total size of OS-allocated buffers
  */
 static size_t buffer_size = 0;
 
 /**
- * Data alignment is architecture-dependent
- * and equals to pointer size
+ * New chunks are mapped when the heap runs out of space
+ */
+static bool is_growable = false;
+
+/**
+ * Minimal size of a chunk mapped in growable mode
+ */
+static size_t min_chunk_size = 0;
+
+/**
+ * Placement policy, kept across mem_init calls
+ */
+static MemFitPolicy fit_policy = MEM_FIT_SEGREGATED;
+
+/**
+ * Free blocks with whole pages give them back to the OS after being idle
+ * this many milliseconds, see mem_set_decay
  */
-static const size_t alignment = sizeof(void*);
+static long decay_ms = 1000;
 
 /**
- A struct which represents allocated memory buffers
+ * Time of the next scavenger walk, in milliseconds
  */
-typedef struct AllocatedMemoryNode {
+static uint64_t next_scavenge = 0;
+
+/**
+ * Walks are this many times their own duration apart at least, so short
+ * decay times on big heaps do not turn every free into a walk
+ */
+#define SCAVENGE_SPACING 100
+
+/**
+ * Idle stamp of a free block whose pages were given back
+ */
+#define PAGES_RELEASED 0
+
+/**
+ * Block sizes are multiples of the alignment, so once the first block of
+ * a chunk is aligned, all of them are
+ */
+static const size_t alignment = MEM_ALIGNMENT;
+
+/**
+ * Header of an allocated block, user data follows it.
+ * Blocks of a chunk lie back to back, so the next block starts \a size bytes
+ * further. A free block also keeps its size in its last word (footer), so
+ * the block after it can find it when the two are merged.
+ * Every chunk is laid out as:
+ * (chunk header) (block) ... (block) (epilogue)
+ * The epilogue is a header of size 0 marked as allocated, blocks are never
+ * merged past it. It points back to the chunk, so a free block followed by
+ * the epilogue can tell whether it spans the whole chunk.
+ * The first block is always marked as having an allocated block below it,
+ * so nothing in front of the chunk is read.
+ */
+typedef struct Block {
     /**
-     * Pointer to the previous allocated buffer
+     * Block size (header included) ORed with BLOCK_IN_USE,
+     * BLOCK_PREV_IN_USE and BLOCK_MOVABLE
      */
-    struct AllocatedMemoryNode* prev;
+    size_t header;
+} Block;
+
+static const size_t block_header_size = sizeof(Block);
+
+/**
+ * Last block of every chunk
+ */
+typedef struct Epilogue {
+    Block block;
+    Chunk* chunk;
+} Epilogue;
+
+/**
+ * Free blocks hold the list links and a footer, so no block is smaller
+ */
+static const size_t min_block_size =
+        (FREE_BLOCK_MIN_SIZE + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT * MEM_ALIGNMENT;
+
+#ifdef MEM_THREAD_SAFE
+/**
+ * Lock which protects the central heap. Thread caches take it once per batch
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Handle of a movable block. The slot stays put while the block moves, its
+ * address is what mem_halloc hands out
+ */
+struct MemHandleSlot {
     /**
-     * Pointer to the next allocated buffer
+     * Data of the block, or the next slot of free_slots once freed
      */
-    struct AllocatedMemoryNode* next;
+    void* addr;
     /**
-     * Number of bytes allocated in heap for this buffer
+     * Number of mem_hlock calls not undone yet, or HANDLE_MOVING while the
+     * compactor moves the block
      */
-    size_t size;
-} AllocatedMemoryNode;
+    int pins;
+};
+
+typedef struct MemHandleSlot MemHandleSlot;
+
+/**
+ * Pin count of a slot whose block is being moved
+ */
+#define HANDLE_MOVING (-1)
 
-static const size_t node_size = sizeof(AllocatedMemoryNode);
+/**
+ * Number of slots allocated at once. Slot tables are blocks of the heap
+ * which are never freed, so slots stay valid while handles come and go
+ */
+#define HANDLE_TABLE_SLOTS 256
+
+/**
+ * Slots of freed handles, linked through their addr
+ */
+static MemHandleSlot* free_slots = NULL;
 
 /**
- * Pointer to the head and tail nodes.
- * Note: head always has the lowest address and tail has the highest!
- * The structure is the following:
- * (head) <-> (element) <-> ... <-> (element) <-> (tail)
- * Head and tail are sentinel notes with 0 allocated memory and
- * take additional overhead of 2 pointers for each (32 bytes on 64-bit machine)
+ * Room in front of the data of a movable block. Its first word points back
+ * to the slot, so the compactor finds the handle of a block it moves. Keeps
+ * the data on MEM_ALIGNMENT, as the blocks of mem_alloc are
  */
-static AllocatedMemoryNode* head = NULL;
-static AllocatedMemoryNode* tail = NULL;
+static const size_t handle_prefix_size = TC_TAG_SIZE != 0 ? TC_TAG_SIZE : MEM_ALIGNMENT;
+
+/**
+ * Block where the next mem_compact call goes on, NULL to start over at the
+ * first chunk
+ */
+static Block* compact_cursor = NULL;
 
 
 /**
@@ -62,6 +203,39 @@ static AllocatedMemoryNode* tail = NULL;
  */
 static void mem_release();
 
+/**
+ * mem_init without locking, called with the heap lock held
+ * @param size Number of bytes to allocate
+ * @param growable Map new chunks when the first one is full
+ */
+static bool heap_init(const size_t size, const bool growable);
+
+/**
+ * Get a chunk of \a size bytes from the OS and make it available
+ * @param size Chunk size, header and epilogue included
+ * @param mapped Use mmap instead of malloc
+ * @return New chunk or NULL
+ */
+static Chunk* add_chunk(const size_t size, const bool mapped);
+
+/**
+ * Give an empty chunk back to the OS
+ * @param chunk Chunk without allocated blocks
+ */
+static void remove_chunk(Chunk* chunk);
+
+/**
+ * First block of \a chunk
+ */
+static Block* chunk_first_block(Chunk* chunk);
+
+/**
+ * Called when the last block of \a chunk was freed: unmap the chunk, or
+ * drop the physical pages of the only chunk of a growable heap
+ * @param chunk Chunk without allocated blocks
+ */
+static void release_empty_chunk(Chunk* chunk);
+
 /**
  * Print \a value in hex
  * @param value Value to be printed
@@ -83,53 +257,447 @@ static char value_to_hex_character(char value);
  */
 static size_t align_size(size_t size);
 
+/**
+ * Size of the block which holds \a size bytes of user data
+ * @param size Number of bytes needed by the user, at most SIZE_MAX / 2
+ * @return Block size, header included
+ */
+static size_t block_size_for(size_t size);
+
+/**
+ * Size of \a block, header included
+ */
+static size_t block_size(const Block* block);
+
+/**
+ * Block which follows \a block in its chunk (the epilogue after the last one)
+ */
+static Block* next_block(Block* block);
+
+/**
+ * Turn \a size bytes at \a start into a free block and index it.
+ * The block below must be allocated, the block above must not be free
+ * @param start Block address
+ * @param size Block size, at least min_block_size
+ */
+static void add_free_block(void* start, const size_t size);
+
+/**
+ * Take a free block of at least \a size bytes out of the index, mapping a
+ * new chunk if the heap is growable and has none
+ * @param size Block size needed, header included
+ * @return Free block (not indexed anymore) or NULL
+ */
+static FreeBlock* take_free_block(const size_t size);
+
+/**
+ * Allocate \a size bytes of free block \a block, which is not indexed
+ * anymore. The rest of the block, if big enough, becomes a new free block
+ * @param block Free block
+ * @param size Block size needed, header included
+ */
+static void use_block(Block* block, const size_t size);
+
+/**
+ * Put every free block of the heap into a fresh index for \a policy
+ * @param policy Placement policy
+ */
+static void reindex(const MemFitPolicy policy);
+
+/**
+ * Current time in milliseconds, never PAGES_RELEASED
+ */
+static uint64_t now_ms(void);
+
+/**
+ * Whole pages of a free block which the OS can take back: past the links
+ * and before the idle stamp and the footer
+ * @param block Free block
+ * @param first Set to the first page
+ * @param end Set to the end of the last page
+ * @return False if the block holds no such page
+ */
+static bool block_pages(const FreeBlock* block, uintptr_t* first, uintptr_t* end);
+
+/**
+ * Word below the footer of a free block with whole pages, holding the time
+ * the block was freed or PAGES_RELEASED. Free blocks split off the top of
+ * such a block end at the same place, so they keep its stamp
+ */
+static uint64_t* idle_stamp(FreeBlock* block);
+
+/**
+ * Stamp a block which just became free with the current time
+ */
+static void mark_freed(FreeBlock* block);
+
+/**
+ * Give the whole pages of a free block back to the OS
+ * @return Number of bytes given back
+ */
+static size_t release_pages(FreeBlock* block);
+
+/**
+ * Walk the heap and give back the pages of free blocks idle for decay_ms
+ * @param all Give back the pages of every free block, idle or not
+ * @return Number of bytes given back
+ */
+static size_t scavenge(const bool all);
+
+/**
+ * Called when \a block became free: stamp it, then give its pages back at
+ * once or walk the heap if decay_ms passed since the last walk
+ */
+static void scavenge_after_free(FreeBlock* block);
+
+/**
+ * Called when \a gone is merged into the block \a survivor below it, so the
+ * compactor does not go on from the middle of a block
+ */
+static void forget_block(Block* gone, Block* survivor);
+
+/**
+ * Take a slot for a new handle, allocating a slot table if none is free
+ * @return Slot, or NULL if out of memory
+ */
+static MemHandleSlot* take_slot(void);
+
+/**
+ * Current time in microseconds, for the time slices of the compactor
+ */
+static uint64_t now_us(void);
+
+/**
+ * Move the block above \a free_block down to its start, if the block is
+ * movable and not pinned. The free space ends up above the moved block and
+ * is merged with the block after it if that one is free too
+ * @param free_block Free block
+ * @return Size of the moved block, 0 if nothing was moved
+ */
+static size_t slide_block(FreeBlock* free_block);
+
+/**
+ * Walk the heap from compact_cursor and slide every movable block it can,
+ * leaving the cursor where the walk stopped
+ * @param deadline now_us time to stop at, or 0 to go to the end of the heap
+ * @return Number of bytes moved
+ */
+static size_t compact(const uint64_t deadline);
+
 void* mem_alloc(const size_t size) {
-    if (buffer_size == 0) {
-        if (!mem_init(default_buffer_size)) {
-            return NULL;
-        }
+    const uint64_t start = stats_sample_start();
+#ifdef MEM_THREAD_SAFE
+    void* const addr = tc_alloc(size);
+#else
+    void* const addr = central_alloc(size);
+    if (addr != NULL) {
+        stats_count_alloc(central_usable_size(addr));
     }
-    const size_t real_size = align_size(size) + node_size;
-
-    for (AllocatedMemoryNode* cur_node = head; cur_node != NULL;
-            cur_node = cur_node->next) {
-        void* free_block_start = (void*)cur_node + cur_node->size;
-        void* free_block_end = cur_node->next;
-        const size_t block_size = free_block_end - free_block_start;
-        if (block_size >= real_size) {
-            // Insert new_node between cur_node and cur_node->next
-            AllocatedMemoryNode* const new_node = free_block_start;
-            new_node->prev = cur_node;
-            new_node->next = cur_node->next;
-            new_node->size = real_size;
-            cur_node->next = new_node;
-            new_node->next->prev = new_node;
-            return (void*)new_node + node_size;
-        }
+#endif
+    if (start != 0) {
+        stats_sample_alloc(start);
     }
-    return NULL;
+    return addr;
 }
 
 void* mem_realloc(void* old_addr, size_t new_size) {
+    stats_count_realloc();
+#ifdef MEM_THREAD_SAFE
+    return tc_realloc(old_addr, new_size);
+#else
     if (old_addr == NULL || buffer_size == 0) return mem_alloc(new_size);
-    AllocatedMemoryNode* node = old_addr - node_size;
-    const size_t block_size = (void*)node->next - old_addr;
-    if (block_size >= align_size(new_size)) {
-        node->size = align_size(new_size) + node_size;
+    const size_t old_size = central_usable_size(old_addr);
+    if (central_resize(old_addr, new_size)) {
+        stats_count_resize(old_size, central_usable_size(old_addr));
         return old_addr;
     }
 
     void* new_addr = mem_alloc(new_size);
-    mem_copy(new_addr, old_addr, node->size - node_size);
+    if (new_addr == NULL) return NULL;
+    mem_copy(new_addr, old_addr, old_size);
     mem_free(old_addr);
     return new_addr;
+#endif
+}
+
+void* mem_alloc_aligned(const size_t size, const size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    const uint64_t start = stats_sample_start();
+#ifdef MEM_THREAD_SAFE
+    void* const addr = tc_alloc_aligned(size, alignment);
+#else
+    void* const addr = central_alloc_aligned(size, alignment);
+    if (addr != NULL) {
+        stats_count_alloc(central_usable_size(addr));
+    }
+#endif
+    if (start != 0) {
+        stats_sample_alloc(start);
+    }
+    return addr;
 }
 
 void mem_free(void* addr) {
+    const uint64_t start = stats_sample_start();
+#ifdef MEM_THREAD_SAFE
+    tc_free(addr);
+#else
+    if (addr != NULL && buffer_size != 0) {
+        stats_count_free(central_usable_size(addr));
+    }
+    central_free(addr);
+#endif
+    if (start != 0) {
+        stats_sample_free(start);
+    }
+}
+
+void mem_free_sized(void* addr, const size_t size) {
+    // the header next to the data is read for coalescing anyway
+    (void)size;
+    mem_free(addr);
+}
+
+void* mem_realloc_sized(void* addr, const size_t old_size, const size_t new_size) {
+    (void)old_size;
+    return mem_realloc(addr, new_size);
+}
+
+size_t mem_alloc_batch(const size_t size, const size_t count, void** out) {
+#ifdef MEM_THREAD_SAFE
+    return tc_alloc_batch(size, count, out);
+#else
+    const size_t done = central_alloc_batch(size, count, out);
+    for (size_t i = 0; i < done; ++i) {
+        stats_count_alloc(central_usable_size(out[i]));
+    }
+    return done;
+#endif
+}
+
+void mem_free_batch(void** addrs, const size_t count) {
+#ifdef MEM_THREAD_SAFE
+    tc_free_batch(addrs, count);
+#else
+    if (buffer_size == 0) return;
+    for (size_t i = 0; i < count; ++i) {
+        if (addrs[i] != NULL) {
+            stats_count_free(central_usable_size(addrs[i]));
+        }
+    }
+    central_free_batch(addrs, count);
+#endif
+}
+
+size_t mem_usable_size(void* addr) {
+    if (addr == NULL) return 0;
+#ifdef MEM_THREAD_SAFE
+    return tc_usable_size(addr);
+#else
+    return central_usable_size(addr);
+#endif
+}
+
+void* central_alloc(const size_t size) {
+    if (buffer_size == 0) {
+        if (!heap_init(default_buffer_size, false)) {
+            return NULL;
+        }
+    }
+    if (size > SIZE_MAX / 2) return NULL;
+    const size_t real_size = block_size_for(size);
+
+    FreeBlock* const free_block = take_free_block(real_size);
+    if (free_block == NULL) {
+        return NULL;
+    }
+
+    Block* const block = (Block*)free_block;
+    use_block(block, real_size);
+    return (void*)block + block_header_size;
+}
+
+void* central_alloc_aligned(const size_t size, const size_t alignment) {
+    if (alignment <= MEM_ALIGNMENT) {
+        return central_alloc(size);
+    }
+    if (buffer_size == 0) {
+        if (!heap_init(default_buffer_size, false)) {
+            return NULL;
+        }
+    }
+    if (size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4) return NULL;
+    const size_t real_size = block_size_for(size);
+
+    // room to move the block up to the alignment, leaving a free block
+    // in front of it
+    FreeBlock* const free_block = take_free_block(real_size + alignment + min_block_size);
+    if (free_block == NULL) {
+        return NULL;
+    }
+
+    Block* block = (Block*)free_block;
+    const size_t total = block_size(block);
+    const uintptr_t data = ((uintptr_t)block + block_header_size + TC_TAG_SIZE
+            + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t gap = data - TC_TAG_SIZE - block_header_size - (uintptr_t)block;
+    if (gap != 0 && gap < min_block_size) {
+        gap += alignment;
+    }
+    if (gap != 0) {
+        // the block below a free block is in use, so the gap needs no merging
+        add_free_block(block, gap);
+        mark_freed((FreeBlock*)block);
+        block = (void*)block + gap;
+        block->header = total - gap;
+    }
+    use_block(block, real_size);
+    return (void*)block + block_header_size;
+}
+
+void central_free(void* addr) {
     if (addr == NULL || buffer_size == 0) return;
-    AllocatedMemoryNode* node = addr - node_size;
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
+    Block* block = addr - block_header_size;
+    size_t size = block_size(block);
+    Block* const next = next_block(block);
+
+    // merge with the free neighbours, found through the footer below
+    // and the header above
+    if (!(block->header & BLOCK_PREV_IN_USE)) {
+        const size_t prev_size = *(size_t*)((void*)block - sizeof(size_t));
+        Block* const prev = (void*)block - prev_size;
+        free_index_remove((FreeBlock*)prev);
+        forget_block(block, prev);
+        block = prev;
+        size += prev_size;
+    }
+    if (!(next->header & BLOCK_IN_USE)) {
+        free_index_remove((FreeBlock*)next);
+        forget_block(next, block);
+        size += block_size(next);
+    }
+    add_free_block(block, size);
+    next_block(block)->header &= ~BLOCK_PREV_IN_USE;
+
+    Epilogue* const epilogue = (Epilogue*)next_block(block);
+    if (is_growable && block_size(&epilogue->block) == 0
+            && chunk_first_block(epilogue->chunk) == block) {
+        release_empty_chunk(epilogue->chunk);
+    } else {
+        scavenge_after_free((FreeBlock*)block);
+    }
+}
+
+size_t central_alloc_batch(const size_t size, const size_t count, void** out) {
+    if (count == 0 || size > SIZE_MAX / 2) return 0;
+    const size_t real_size = block_size_for(size);
+    size_t done = 0;
+    while (done < count) {
+        // the blocks are carved out of one free block, so the index is
+        // searched once per batch while a big enough block is free
+        const size_t wanted = count - done;
+        FreeBlock* const free_block = buffer_size != 0 && wanted <= SIZE_MAX / 2 / real_size
+                ? free_index_take(real_size * wanted) : NULL;
+        if (free_block == NULL) {
+            // one block at a time, growing the heap if it can
+            out[done] = central_alloc(size);
+            if (out[done] == NULL) break;
+            ++done;
+            continue;
+        }
+
+        Block* block = (Block*)free_block;
+        const size_t total = block_size(block);
+        size_t prev_in_use = block->header & BLOCK_PREV_IN_USE;
+        for (size_t i = 1; i < wanted; ++i) {
+            block->header = real_size | prev_in_use | BLOCK_IN_USE;
+            out[done++] = (void*)block + block_header_size;
+            block = (void*)block + real_size;
+            prev_in_use = BLOCK_PREV_IN_USE;
+        }
+        // the last block gives the rest back to the index
+        block->header = (total - (wanted - 1) * real_size) | prev_in_use;
+        use_block(block, real_size);
+        out[done++] = (void*)block + block_header_size;
+    }
+    return done;
+}
+
+void central_free_batch(void** addrs, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        central_free(addrs[i]);
+    }
+}
+
+size_t central_usable_size(void* addr) {
+    const Block* block = addr - block_header_size;
+    return block_size(block) - block_header_size;
+}
+
+bool central_resize(void* addr, const size_t size) {
+    if (size > SIZE_MAX / 2) return false;
+    Block* const block = addr - block_header_size;
+    const size_t old_size = block_size(block);
+    const size_t new_size = block_size_for(size);
+    Block* const next = next_block(block);
+    const bool next_is_free = !(next->header & BLOCK_IN_USE);
+    size_t available = old_size;
+
+    if (new_size > old_size) {
+        // grow into the free block above
+        if (!next_is_free || old_size + block_size(next) < new_size) return false;
+        free_index_remove((FreeBlock*)next);
+        forget_block(next, block);
+        available += block_size(next);
+    } else if (old_size - new_size < min_block_size) {
+        return true;    // the rest would not make a free block
+    }
+
+    const size_t flags = block->header & BLOCK_FLAGS;
+    if (available - new_size >= min_block_size) {
+        block->header = new_size | flags;
+        size_t rest = available - new_size;
+        if (available == old_size && next_is_free) {
+            // shrinking, the rest merges with the free block above
+            free_index_remove((FreeBlock*)next);
+            forget_block(next, (void*)block + new_size);
+            rest += block_size(next);
+        }
+        Block* const rest_block = (void*)block + new_size;
+        add_free_block(rest_block, rest);
+        next_block(rest_block)->header &= ~BLOCK_PREV_IN_USE;
+        if (available == old_size) {
+            mark_freed((FreeBlock*)rest_block);
+        }
+    } else {
+        block->header = available | flags;
+        next_block(block)->header |= BLOCK_PREV_IN_USE;
+    }
+    return true;
+}
+
+void central_stats(MemStats* stats) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    stats->bytes_mapped = buffer_size;
+    stats->page_size = page_size;
+    stats->pages_mapped = (buffer_size + page_size - 1) / page_size;
+    stats->pages_in_use = stats->pages_mapped - free_index_stats(stats);
+}
+
+size_t central_trim(void) {
+    return buffer_size != 0 ? scavenge(true) : 0;
+}
+
+void central_lock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&heap_lock);
+#endif
+}
+
+void central_unlock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&heap_lock);
+#endif
 }
 
 void mem_dump(const char * addr, const size_t size) {
@@ -142,55 +710,236 @@ void mem_dump(const char * addr, const size_t size) {
 }
 
 bool mem_init(const size_t size) {
-    // Pretend to be an OS and to have all memory available...
-    // Yup, you could use malloc directly. And better just do that.
-    // This is just an university assignment
-    if (baseptr) mem_release();
-    baseptr = malloc(size);
-    if (baseptr != NULL) {
-        printf("Initialize with baseptr = %p\n", baseptr);
-        buffer_size = size;
+    central_lock();
+    const bool result = heap_init(size, false);
+    central_unlock();
+    return result;
+}
+
+bool mem_init_growable(const size_t chunk_size) {
+    central_lock();
+    const bool result = heap_init(chunk_size, true);
+    central_unlock();
+    return result;
+}
+
+void mem_set_policy(const MemFitPolicy policy) {
+    central_lock();
+    fit_policy = policy;
+    reindex(policy);
+    central_unlock();
+}
+
+void mem_set_decay(const long decay) {
+    central_lock();
+    decay_ms = decay;
+    central_unlock();
+}
+
+size_t mem_trim(void) {
+#ifdef MEM_THREAD_SAFE
+    tc_flush();
+#endif
+    central_lock();
+    const size_t released = central_trim();
+    central_unlock();
+    return released;
+}
+
+void mem_heap_info(MemHeapInfo* info) {
+    *info = (MemHeapInfo) { .heap_bytes = 0 };
+    central_lock();
+    info->heap_bytes = buffer_size;
+    for (Chunk* chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        for (Block* block = chunk_first_block(chunk); block_size(block) != 0;
+                block = next_block(block)) {
+            const size_t size = block_size(block);
+            if (block->header & BLOCK_IN_USE) {
+                info->used_bytes += size;
+                ++info->used_blocks;
+            } else {
+                info->free_bytes += size;
+                ++info->free_blocks;
+                if (size > info->largest_free_block) {
+                    info->largest_free_block = size;
+                }
+            }
+        }
+    }
+    central_unlock();
+}
+
+MemHandle mem_halloc(const size_t size) {
+    if (size > SIZE_MAX / 2) return NULL;
+    central_lock();
+    MemHandleSlot* const slot = take_slot();
+    void* block_data = slot != NULL ? central_alloc(size + handle_prefix_size) : NULL;
+    if (slot != NULL && block_data == NULL && buffer_size != 0) {
+        // the free space between movable blocks may add up to enough
+        compact_cursor = NULL;
+        compact(0);
+        block_data = central_alloc(size + handle_prefix_size);
+    }
+    if (block_data == NULL) {
+        if (slot != NULL) {
+            slot->addr = free_slots;
+            free_slots = slot;
+        }
+        central_unlock();
+        return NULL;
+    }
+    Block* const block = block_data - block_header_size;
+    block->header |= BLOCK_MOVABLE;
+    *(MemHandleSlot**)block_data = slot;
+    slot->addr = block_data + handle_prefix_size;
+    slot->pins = 0;
+    const size_t usable_size = central_usable_size(block_data);
+    central_unlock();
+    stats_count_alloc(usable_size);
+    return slot;
+}
+
+void* mem_hlock(MemHandle handle) {
+    int pins = __atomic_load_n(&handle->pins, __ATOMIC_RELAXED);
+    for (;;) {
+        if (pins == HANDLE_MOVING) {
+            // the compactor holds the block for one memmove
+#ifdef MEM_THREAD_SAFE
+            sched_yield();
+#endif
+            pins = __atomic_load_n(&handle->pins, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&handle->pins, &pins, pins + 1, true,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return handle->addr;
+        }
+    }
+}
 
-        // setup head and tail sentinel nodes
-        head = baseptr;
-        tail = baseptr + buffer_size - node_size;
-        head->size = tail->size = node_size;
+void mem_hunlock(MemHandle handle) {
+    __atomic_sub_fetch(&handle->pins, 1, __ATOMIC_RELEASE);
+}
 
-        head->prev = NULL;
-        head->next = tail;
+void mem_hfree(MemHandle handle) {
+    if (handle == NULL) return;
+    central_lock();
+    void* const block_data = handle->addr - handle_prefix_size;
+    const size_t usable_size = central_usable_size(block_data);
+    central_free(block_data);
+    handle->addr = free_slots;
+    free_slots = handle;
+    central_unlock();
+    stats_count_free(usable_size);
+}
 
-        tail->prev = head;
-        tail->next = NULL;
+size_t mem_compact(const unsigned long budget_us) {
+    central_lock();
+    const size_t moved = compact(budget_us != 0 ? now_us() + budget_us : 0);
+    central_unlock();
+    return moved;
+}
 
+static bool heap_init(const size_t size, const bool growable) {
+    // Pretend to be an OS and to have all memory available...
+    // Yup, you could use malloc directly. And better just do that.
+    // This is just an university assignment
+    if (chunks) mem_release();
+    free_index_reset(fit_policy);
+    is_growable = growable;
+    min_chunk_size = size;
+    Chunk* const chunk = add_chunk(size, growable);
+    if (chunk != NULL) {
+        // growable heaps may back malloc itself, printf must not allocate
+        if (!growable) {
+            printf("Initialize with baseptr = %p\n", (void*)chunk);
+        }
         return true;
     }
     return false;
 }
 
-static void mem_release() {
-    free(baseptr);
-    baseptr = NULL;
-    buffer_size = 0;
-    head = NULL;
-    tail = NULL;
+static Chunk* add_chunk(const size_t size, const bool mapped) {
+    if (size < chunk_header_size + min_block_size + sizeof(Epilogue)) return NULL;
+    Chunk* chunk;
+    if (mapped) {
+        chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) return NULL;
+    } else {
+        chunk = malloc(size);
+        if (chunk == NULL) return NULL;
+    }
+    chunk->size = size;
+    chunk->is_mapped = mapped;
+    chunk->prev = NULL;
+    chunk->next = chunks;
+    if (chunks != NULL) {
+        chunks->prev = chunk;
+    }
+    chunks = chunk;
+    buffer_size += size;
+
+    // one free block up to the epilogue
+    Block* const first = chunk_first_block(chunk);
+    Epilogue* const epilogue = (void*)first
+            + (size - chunk_header_size - sizeof(Epilogue)) / alignment * alignment;
+    epilogue->block.header = BLOCK_IN_USE;
+    epilogue->chunk = chunk;
+    add_free_block(first, (void*)epilogue - (void*)first);
+    uintptr_t first_page, end_page;
+    if (block_pages((FreeBlock*)first, &first_page, &end_page)) {
+        // fresh mappings have no pages yet
+        *idle_stamp((FreeBlock*)first) = mapped ? PAGES_RELEASED : now_ms();
+    }
+    return chunk;
 }
 
-void mem_copy(void* to_void, const void* from_void, const size_t bytes) {
-    // Duff's copying device
-    const char* from = from_void;
-    char* to = to_void;
-    size_t n = (bytes + 7) / 8;;
-    switch (bytes % 8) {
-    case 0: do {    *to = *from++;
-    case 7:         *to = *from++;
-    case 6:         *to = *from++;
-    case 5:         *to = *from++;
-    case 4:         *to = *from++;
-    case 3:         *to = *from++;
-    case 2:         *to = *from++;
-    case 1:         *to = *from++;
-            } while(--n > 0);
+static void remove_chunk(Chunk* chunk) {
+    Block* const first = chunk_first_block(chunk);
+    if (!(first->header & BLOCK_IN_USE)) {
+        free_index_remove((FreeBlock*)first);
+    }
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        chunks = chunk->next;
     }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+    buffer_size -= chunk->size;
+    if ((void*)compact_cursor >= (void*)chunk
+            && (void*)compact_cursor < (void*)chunk + chunk->size) {
+        compact_cursor = NULL;
+    }
+    if (chunk->is_mapped) {
+        munmap(chunk, chunk->size);
+    } else {
+        free(chunk);
+    }
+}
+
+static Block* chunk_first_block(Chunk* chunk) {
+    return (void*)chunk + chunk_header_size;
+}
+
+static void release_empty_chunk(Chunk* chunk) {
+    if (chunk->prev != NULL || chunk->next != NULL) {
+        remove_chunk(chunk);
+        return;
+    }
+    // keep the last chunk mapped, but let the OS take its pages
+    release_pages((FreeBlock*)chunk_first_block(chunk));
+}
+
+static void mem_release() {
+    while (chunks != NULL) {
+        remove_chunk(chunks);
+    }
+    buffer_size = 0;
+    is_growable = false;
+    free_slots = NULL;
+    compact_cursor = NULL;
+    free_index_reset(fit_policy);
 }
 
 static void print_byte(char value) {
@@ -206,3 +955,225 @@ static char value_to_hex_character(char value) {
 static size_t align_size(size_t size) {
     return size + ((alignment - size % alignment) % alignment);
 }
+
+static size_t block_size_for(size_t size) {
+    const size_t real_size = align_size(size + block_header_size);
+    return real_size < min_block_size ? min_block_size : real_size;
+}
+
+static size_t block_size(const Block* block) {
+    return block->header & ~BLOCK_FLAGS;
+}
+
+static Block* next_block(Block* block) {
+    return (void*)block + block_size(block);
+}
+
+static void add_free_block(void* start, const size_t size) {
+    FreeBlock* const block = start;
+    block->header = size | BLOCK_PREV_IN_USE;
+    *(size_t*)(start + size - sizeof(size_t)) = size;
+    free_index_insert(block);
+}
+
+static FreeBlock* take_free_block(const size_t size) {
+    FreeBlock* free_block = free_index_take(size);
+    if (free_block == NULL && is_growable) {
+        // chunk header, the new block and the epilogue, rounded to pages
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t new_size = chunk_header_size + size + sizeof(Epilogue);
+        new_size = (new_size + page_size - 1) / page_size * page_size;
+        if (add_chunk(new_size > min_chunk_size ? new_size : min_chunk_size, true)) {
+            free_block = free_index_take(size);
+        }
+    }
+    return free_block;
+}
+
+static void use_block(Block* block, const size_t size) {
+    const size_t total = block_size(block);
+    const size_t flags = (block->header & BLOCK_PREV_IN_USE) | BLOCK_IN_USE;
+    if (total - size >= min_block_size) {
+        block->header = size | flags;
+        // the block above the rest stays marked as following a free block
+        add_free_block((void*)block + size, total - size);
+    } else {
+        block->header = total | flags;
+        next_block(block)->header |= BLOCK_PREV_IN_USE;
+    }
+}
+
+static void reindex(const MemFitPolicy policy) {
+    free_index_reset(policy);
+    for (Chunk* chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        for (Block* block = chunk_first_block(chunk); block_size(block) != 0;
+                block = next_block(block)) {
+            if (!(block->header & BLOCK_IN_USE)) {
+                free_index_insert((FreeBlock*)block);
+            }
+        }
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    // the coarse clock is read without a system call
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+static bool block_pages(const FreeBlock* block, uintptr_t* first, uintptr_t* end) {
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    *first = ((uintptr_t)(block + 1) + page_size - 1) & ~(page_size - 1);
+    *end = ((uintptr_t)block + free_block_size(block) - sizeof(size_t) - sizeof(uint64_t))
+            & ~(page_size - 1);
+    return *first < *end;
+}
+
+static uint64_t* idle_stamp(FreeBlock* block) {
+    return (void*)block + free_block_size(block) - sizeof(size_t) - sizeof(uint64_t);
+}
+
+static void mark_freed(FreeBlock* block) {
+    uintptr_t first, end;
+    if (block_pages(block, &first, &end)) {
+        *idle_stamp(block) = now_ms();
+    }
+}
+
+static size_t release_pages(FreeBlock* block) {
+    uintptr_t first, end;
+    if (!block_pages(block, &first, &end)) return 0;
+    madvise((void*)first, end - first, MADV_DONTNEED);
+    *idle_stamp(block) = PAGES_RELEASED;
+    return end - first;
+}
+
+static size_t scavenge(const bool all) {
+    const uint64_t now = now_ms();
+    size_t released = 0;
+    for (Chunk* chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        for (Block* block = chunk_first_block(chunk); block_size(block) != 0;
+                block = next_block(block)) {
+            uintptr_t first, end;
+            FreeBlock* const free_block = (FreeBlock*)block;
+            if ((block->header & BLOCK_IN_USE) || !block_pages(free_block, &first, &end)) {
+                continue;
+            }
+            const uint64_t stamp = *idle_stamp(free_block);
+            if (stamp != PAGES_RELEASED && (all || now - stamp >= (uint64_t)decay_ms)) {
+                released += release_pages(free_block);
+            }
+        }
+    }
+    const uint64_t walk_time = (now_ms() - now) * SCAVENGE_SPACING;
+    next_scavenge = now + (walk_time > (uint64_t)decay_ms ? walk_time : (uint64_t)decay_ms);
+    return released;
+}
+
+static void scavenge_after_free(FreeBlock* block) {
+    uintptr_t first, end;
+    if (!block_pages(block, &first, &end)) return;
+    if (decay_ms == 0) {
+        release_pages(block);
+        return;
+    }
+    const uint64_t now = now_ms();
+    *idle_stamp(block) = now;
+    if (decay_ms > 0 && now >= next_scavenge) {
+        scavenge(false);
+    }
+}
+
+static void forget_block(Block* gone, Block* survivor) {
+    if (compact_cursor == gone) {
+        compact_cursor = survivor;
+    }
+}
+
+static MemHandleSlot* take_slot(void) {
+    if (free_slots == NULL) {
+        MemHandleSlot* const table = central_alloc(HANDLE_TABLE_SLOTS * sizeof(MemHandleSlot));
+        if (table == NULL) return NULL;
+        for (size_t i = 0; i < HANDLE_TABLE_SLOTS; ++i) {
+            table[i].addr = i + 1 < HANDLE_TABLE_SLOTS ? &table[i + 1] : NULL;
+        }
+        free_slots = table;
+    }
+    MemHandleSlot* const slot = free_slots;
+    free_slots = slot->addr;
+    return slot;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t slide_block(FreeBlock* free_block) {
+    Block* const hole = (Block*)free_block;
+    const size_t hole_size = block_size(hole);
+    Block* const block = next_block(hole);
+    if ((block->header & (BLOCK_IN_USE | BLOCK_MOVABLE)) != (BLOCK_IN_USE | BLOCK_MOVABLE)) {
+        return 0;
+    }
+    // a pinned block stays, mem_hlock waits while it moves
+    MemHandleSlot* const slot = *(MemHandleSlot**)((void*)block + block_header_size);
+    int pins = 0;
+    if (!__atomic_compare_exchange_n(&slot->pins, &pins, HANDLE_MOVING, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    const size_t size = block_size(block);
+    free_index_remove(free_block);
+    memmove(hole, block, size);
+    // the block below a free block is in use
+    hole->header = size | BLOCK_IN_USE | BLOCK_MOVABLE | BLOCK_PREV_IN_USE;
+
+    Block* const rest = (void*)hole + size;
+    Block* const next = (void*)rest + hole_size;
+    size_t rest_size = hole_size;
+    if (!(next->header & BLOCK_IN_USE)) {
+        free_index_remove((FreeBlock*)next);
+        forget_block(next, rest);
+        rest_size += block_size(next);
+    }
+    add_free_block(rest, rest_size);
+    next_block(rest)->header &= ~BLOCK_PREV_IN_USE;
+    mark_freed((FreeBlock*)rest);
+
+    slot->addr = (void*)hole + block_header_size + handle_prefix_size;
+    __atomic_store_n(&slot->pins, 0, __ATOMIC_RELEASE);
+    return size;
+}
+
+static size_t compact(const uint64_t deadline) {
+    if (compact_cursor == NULL) {
+        if (chunks == NULL) return 0;
+        compact_cursor = chunk_first_block(chunks);
+    }
+    size_t moved = 0;
+    unsigned steps = 0;
+    while (compact_cursor != NULL) {
+        Block* const block = compact_cursor;
+        if (block_size(block) == 0) {
+            Chunk* const next_chunk = ((Epilogue*)block)->chunk->next;
+            compact_cursor = next_chunk != NULL ? chunk_first_block(next_chunk) : NULL;
+            continue;
+        }
+        size_t size = 0;
+        if (!(block->header & BLOCK_IN_USE)) {
+            size = slide_block((FreeBlock*)block);
+            moved += size;
+        }
+        // after a move the free rest comes next, it may slide the block above
+        compact_cursor = next_block(block);
+        // reading the clock costs more than a step, not more than a move
+        if (deadline != 0 && (size != 0 || ++steps % 64 == 0) && now_us() >= deadline) {
+            break;
+        }
+    }
+    return moved;
+}
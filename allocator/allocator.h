@@ -1,9 +1,65 @@
 #ifndef ALLOCATOR_H
 #define	ALLOCATOR_H
 
+#include "arena.h"
+#include "mem_stats.h"
+
 #include <stddef.h>
 #include <stdbool.h>
 
+/**
+ * Alignment of the memory returned by mem_alloc and mem_realloc,
+ * enough for any fundamental type (as with malloc)
+ */
+#define MEM_ALIGNMENT 16
+
+/**
+ * How mem_alloc chooses a free block
+ */
+typedef enum MemFitPolicy {
+    /**
+     * Block from the smallest non-empty power-of-two bin which fits (default)
+     */
+    MEM_FIT_SEGREGATED,
+    /**
+     * Lowest address block which fits
+     */
+    MEM_FIT_FIRST,
+    /**
+     * First block which fits at or above the end of the previous
+     * allocation, wrapping around to the lowest address
+     */
+    MEM_FIT_NEXT,
+    /**
+     * Smallest block which fits, lowest address among equal sizes
+     */
+    MEM_FIT_BEST
+} MemFitPolicy;
+
+/**
+ * Snapshot of the heap layout
+ */
+typedef struct MemHeapInfo {
+    /**
+     * Bytes got from the OS, chunk headers included
+     */
+    size_t heap_bytes;
+    /**
+     * Bytes in allocated blocks, headers included
+     */
+    size_t used_bytes;
+    /**
+     * Bytes in free blocks
+     */
+    size_t free_bytes;
+    /**
+     * Size of the biggest free block
+     */
+    size_t largest_free_block;
+    size_t used_blocks;
+    size_t free_blocks;
+} MemHeapInfo;
+
 /**
  * Allocate \a size bytes of memory
  * @param size allocate \a size bytes of memory
@@ -11,6 +67,17 @@
  */
 void* mem_alloc(size_t size);
 
+/**
+ * Allocate \a size bytes aligned to \a alignment. The block is carved out
+ * of a free block at the aligned address, the part in front of it stays
+ * free. mem_realloc keeps the alignment only while the block does not move
+ * @param size Number of bytes needed
+ * @param alignment Power of two
+ * @return Pointer to memory, freed with mem_free, or NULL if out of memory
+ * or \a alignment is not a power of two
+ */
+void* mem_alloc_aligned(size_t size, size_t alignment);
+
 /**
  * Increase memory buffer pointed to by \a addr to \a new_size.
  * Memory could be moved - new memory address is returned
@@ -26,6 +93,48 @@ void* mem_realloc(void* addr, size_t new_size);
  */
 void mem_free(void* addr);
 
+/**
+ * Free memory pointed by \a addr whose size the caller knows
+ * @param addr Pointer returned by mem_alloc or mem_realloc, or NULL
+ * @param size Size passed to the call which returned \a addr
+ */
+void mem_free_sized(void* addr, size_t size);
+
+/**
+ * mem_realloc for memory whose size the caller knows
+ * @param addr Pointer returned by mem_alloc or mem_realloc, or NULL
+ * @param old_size Size passed to the call which returned \a addr
+ * @param new_size New size of the memory
+ * @return New pointer to memory or NULL if out of memory
+ */
+void* mem_realloc_sized(void* addr, size_t old_size, size_t new_size);
+
+/**
+ * Allocate \a count blocks of \a size bytes at once, cheaper than as many
+ * mem_alloc calls
+ * @param size Size of every block
+ * @param count Number of blocks
+ * @param out Receives pointers to the blocks
+ * @return Number of blocks allocated, less than \a count if memory ran out
+ */
+size_t mem_alloc_batch(size_t size, size_t count, void** out);
+
+/**
+ * Free \a count blocks at once
+ * @param addrs Pointers returned by mem_alloc, mem_alloc_batch or
+ * mem_realloc, NULL ones are skipped
+ * @param count Number of pointers
+ */
+void mem_free_batch(void** addrs, size_t count);
+
+/**
+ * Number of bytes which can be used at \a addr, at least the size it was
+ * allocated with
+ * @param addr Pointer returned by mem_alloc or mem_realloc, or NULL
+ * @return Usable size, 0 for NULL
+ */
+size_t mem_usable_size(void* addr);
+
 /**
  * Dump \a size bytes of memory starting with byte pointed by \a addr
  * @param addr Address of start of memory to be dumped
@@ -35,7 +144,9 @@ void mem_dump(const char* addr, const size_t size);
 
 
 /**
- * Copy \a bytes bytes from \a from to \a to
+ * Copy \a bytes bytes from \a from to \a to. The areas must not overlap.
+ * Uses the widest vector stores the CPU supports and bypasses the cache
+ * for big copies
  * @param to
  * @param from
  * @param bytes
@@ -43,9 +154,107 @@ void mem_dump(const char* addr, const size_t size);
 void mem_copy(void* to, const void* from, const size_t bytes);
 
 /**
- * Initialize allocator with buffer of size \a size
+ * Initialize allocator with buffer of size \a size.
+ * In the thread-safe build (-DMEM_THREAD_SAFE) call it before other threads
+ * start allocating: blocks cached by threads are not moved to the new buffer
  * @param size Number of bytes to allocate
  */
 bool mem_init(const size_t size);
 
+/**
+ * Initialize allocator in growable mode: the heap starts with a chunk of
+ * \a chunk_size bytes mapped from the OS and maps more chunks (at least
+ * \a chunk_size bytes each) when it runs out of space. Chunks which become
+ * completely free are unmapped again
+ * @param chunk_size Size of the first and minimal size of further chunks
+ */
+bool mem_init_growable(const size_t chunk_size);
+
+/**
+ * Change the placement policy. Free blocks are reindexed, which takes time
+ * proportional to the number of blocks in the heap
+ * @param policy New placement policy
+ */
+void mem_set_policy(const MemFitPolicy policy);
+
+/**
+ * Set how long the pages of a free block stay with the process. Free blocks
+ * spanning whole pages are stamped when freed; frees of such blocks walk the
+ * heap once per \a decay_ms milliseconds (less often if walks take more
+ * than 1% of the time) and give the pages of blocks idle for at least that
+ * long back to the OS (MADV_DONTNEED). The block keeps its
+ * header, links and footer, the pages come back zeroed when touched again.
+ * The default is 1000 ms
+ * @param decay_ms Idle time in milliseconds, 0 to give pages back as soon
+ * as they are free, negative to give them back only on mem_trim
+ */
+void mem_set_decay(long decay_ms);
+
+/**
+ * Give the pages of every free block back to the OS now, for quiet periods.
+ * The calling thread's cached blocks are freed first; blocks cached by
+ * other threads are not, nor are the pooled chunks of arena.h, which
+ * mem_arena_trim frees
+ * @return Size of the pages given back, pages which were not resident
+ * included
+ */
+size_t mem_trim(void);
+
+/**
+ * Relocatable block got from mem_halloc. The compactor may move the block
+ * while no mem_hlock holds it, the handle stays the same
+ */
+typedef struct MemHandleSlot* MemHandle;
+
+/**
+ * Allocate \a size bytes which mem_compact may move. If the heap has no
+ * free block big enough (and no new chunk can be mapped in growable mode),
+ * a whole compaction pass runs before giving up
+ * @param size Number of bytes needed
+ * @return Handle of the memory, or NULL if out of memory
+ */
+MemHandle mem_halloc(size_t size);
+
+/**
+ * Pin the block of \a handle where it is and get its address, aligned to
+ * MEM_ALIGNMENT. Calls nest, the block may move again once every one of
+ * them was undone by mem_hunlock. Does not take the heap lock
+ * @param handle Handle got from mem_halloc
+ * @return Address of the memory, valid until the matching mem_hunlock
+ */
+void* mem_hlock(MemHandle handle);
+
+/**
+ * Undo one mem_hlock of \a handle
+ * @param handle Handle got from mem_halloc
+ */
+void mem_hunlock(MemHandle handle);
+
+/**
+ * Free the memory of \a handle, which must not be locked
+ * @param handle Handle got from mem_halloc, or NULL
+ */
+void mem_hfree(MemHandle handle);
+
+/**
+ * Slide unlocked handle blocks toward the start of their chunk, each into
+ * the free block right below it, so free space gathers into bigger blocks
+ * above them. Every call goes on where the previous one stopped and stops
+ * once \a budget_us microseconds passed (a block being moved is finished
+ * first); a call which reaches the end of the heap stops there and the next
+ * one starts over. Locked blocks and blocks of mem_alloc are never moved,
+ * the free space below them stays where it is
+ * @param budget_us Time slice in microseconds, 0 to go on to the end of the
+ * heap
+ * @return Number of bytes moved
+ */
+size_t mem_compact(unsigned long budget_us);
+
+/**
+ * Walk the heap and describe its layout. External fragmentation is
+ * 1 - largest_free_block / free_bytes
+ * @param info Filled with the current heap layout
+ */
+void mem_heap_info(MemHeapInfo* info);
+
 #endif	/* ALLOCATOR_H */
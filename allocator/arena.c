@@ -0,0 +1,230 @@
+#include "arena.h"
+#include "allocator.h"
+
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#include <stdint.h>
+
+/**
+ * Size of the arena chunks got from mem_alloc, header included
+ */
+#define ARENA_CHUNK_SIZE ((size_t)64 << 10)
+
+/**
+ * Objects bigger than this get a block of their own
+ */
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+/**
+ * Chunk of an arena, or of the pool
+ */
+typedef struct ArenaChunk {
+    /**
+     * Chunk allocated after this one by the same arena, or next pooled chunk
+     */
+    struct ArenaChunk* next;
+    size_t padding;
+} ArenaChunk;
+
+/**
+ * Header of an object which got a block of its own
+ */
+typedef struct LargeBlock {
+    /**
+     * Large block allocated before this one by the same arena
+     */
+    struct LargeBlock* prev;
+    size_t padding;
+} LargeBlock;
+
+struct MemArena {
+    /**
+     * Chunk holding the arena, kept over resets
+     */
+    ArenaChunk* first;
+    /**
+     * Chunk being filled, the last one of the list starting at first
+     */
+    ArenaChunk* current;
+    /**
+     * Free part of the current chunk
+     */
+    void* top;
+    void* end;
+    /**
+     * Newest large block
+     */
+    LargeBlock* large;
+};
+
+/**
+ * Bytes at the start of the first chunk of an arena taken by the chunk
+ * header and the arena
+ */
+static const size_t first_chunk_header = (sizeof(ArenaChunk) + sizeof(struct MemArena)
+        + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT * MEM_ALIGNMENT;
+
+/**
+ * Chunks given up by arenas
+ */
+static ArenaChunk* pool = NULL;
+
+#ifdef MEM_THREAD_SAFE
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Chunk from the pool or a new one
+ * @return Chunk with next set to NULL, or NULL if out of memory
+ */
+static ArenaChunk* take_chunk(void);
+
+/**
+ * Put the chunks from \a first to \a last, linked through next, into the pool
+ */
+static void pool_chunks(ArenaChunk* first, ArenaChunk* last);
+
+/**
+ * Free the large blocks of \a arena allocated after \a mark
+ * @param arena Arena
+ * @param mark Newest large block to keep, NULL to free them all
+ */
+static void free_large_blocks(MemArena* arena, LargeBlock* mark);
+
+/**
+ * Allocate when the current chunk has no room for \a size bytes
+ * @param arena Arena
+ * @param size Number of bytes needed, multiple of MEM_ALIGNMENT
+ */
+static void* alloc_slow(MemArena* arena, size_t size);
+
+static void pool_lock_take(void);
+
+static void pool_lock_release(void);
+
+MemArena* mem_arena_create(void) {
+    ArenaChunk* const chunk = take_chunk();
+    if (chunk == NULL) return NULL;
+    MemArena* const arena = (MemArena*)(chunk + 1);
+    arena->first = arena->current = chunk;
+    arena->top = (void*)chunk + first_chunk_header;
+    arena->end = (void*)chunk + ARENA_CHUNK_SIZE;
+    arena->large = NULL;
+    return arena;
+}
+
+void mem_arena_destroy(MemArena* arena) {
+    if (arena == NULL) return;
+    free_large_blocks(arena, NULL);
+    pool_chunks(arena->first, arena->current);
+}
+
+void* mem_arena_alloc(MemArena* arena, size_t size) {
+    if (size > SIZE_MAX - MEM_ALIGNMENT) return NULL;
+    size = (size + MEM_ALIGNMENT - 1) & ~(size_t)(MEM_ALIGNMENT - 1);
+    if (size <= (size_t)(arena->end - arena->top)) {
+        void* const addr = arena->top;
+        arena->top += size;
+        return addr;
+    }
+    return alloc_slow(arena, size);
+}
+
+MemArenaMark mem_arena_mark(const MemArena* arena) {
+    return (MemArenaMark) { .chunk = arena->current, .top = arena->top,
+                            .large = arena->large };
+}
+
+void mem_arena_rewind(MemArena* arena, MemArenaMark mark) {
+    free_large_blocks(arena, mark.large);
+    ArenaChunk* const chunk = mark.chunk;
+    if (chunk != arena->current) {
+        pool_chunks(chunk->next, arena->current);
+        chunk->next = NULL;
+        arena->current = chunk;
+        arena->end = (void*)chunk + ARENA_CHUNK_SIZE;
+    }
+    arena->top = mark.top;
+}
+
+void mem_arena_reset(MemArena* arena) {
+    mem_arena_rewind(arena, (MemArenaMark) { .chunk = arena->first,
+            .top = (void*)arena->first + first_chunk_header, .large = NULL });
+}
+
+void mem_arena_trim(void) {
+    pool_lock_take();
+    ArenaChunk* chunk = pool;
+    pool = NULL;
+    pool_lock_release();
+
+    while (chunk != NULL) {
+        ArenaChunk* const next = chunk->next;
+        mem_free(chunk);
+        chunk = next;
+    }
+}
+
+static ArenaChunk* take_chunk(void) {
+    pool_lock_take();
+    ArenaChunk* chunk = pool;
+    if (chunk != NULL) {
+        pool = chunk->next;
+    }
+    pool_lock_release();
+
+    if (chunk == NULL) {
+        chunk = mem_alloc(ARENA_CHUNK_SIZE);
+        if (chunk == NULL) return NULL;
+    }
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void pool_chunks(ArenaChunk* first, ArenaChunk* last) {
+    if (first == NULL) return;
+    pool_lock_take();
+    last->next = pool;
+    pool = first;
+    pool_lock_release();
+}
+
+static void free_large_blocks(MemArena* arena, LargeBlock* mark) {
+    while (arena->large != mark) {
+        LargeBlock* const block = arena->large;
+        arena->large = block->prev;
+        mem_free(block);
+    }
+}
+
+static void* alloc_slow(MemArena* arena, size_t size) {
+    if (size > ARENA_LARGE_SIZE) {
+        if (size > SIZE_MAX - sizeof(LargeBlock)) return NULL;
+        LargeBlock* const block = mem_alloc(sizeof(LargeBlock) + size);
+        if (block == NULL) return NULL;
+        block->prev = arena->large;
+        arena->large = block;
+        return block + 1;
+    }
+
+    ArenaChunk* const chunk = take_chunk();
+    if (chunk == NULL) return NULL;
+    arena->current->next = chunk;
+    arena->current = chunk;
+    arena->top = (void*)(chunk + 1) + size;
+    arena->end = (void*)chunk + ARENA_CHUNK_SIZE;
+    return chunk + 1;
+}
+
+static void pool_lock_take(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&pool_lock);
+#endif
+}
+
+static void pool_lock_release(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&pool_lock);
+#endif
+}
@@ -0,0 +1,78 @@
+#ifndef ARENA_H
+#define	ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Arenas: memory for objects which die together. Allocation bumps a
+ * pointer inside the current chunk of the arena, objects carry no header
+ * and are never freed one by one. Rewinding to a mark or resetting the
+ * arena takes constant time (plus one mem_free per big object): the chunks
+ * it gives up go to a pool shared by all arenas and are reused by the next
+ * arena which runs out of space.
+ *
+ * Chunks come from mem_alloc. An arena must be used by one thread at a
+ * time, the chunk pool may be shared by threads in the thread-safe build.
+ */
+
+typedef struct MemArena MemArena;
+
+/**
+ * Position in an arena got from mem_arena_mark
+ */
+typedef struct MemArenaMark {
+    void* chunk;
+    void* top;
+    void* large;
+} MemArenaMark;
+
+/**
+ * Create an empty arena. The arena itself lives in its first chunk
+ * @return New arena or NULL if out of memory
+ */
+MemArena* mem_arena_create(void);
+
+/**
+ * Give every chunk of \a arena back to the pool, \a arena can not be
+ * used any more
+ * @param arena Arena got from mem_arena_create, or NULL
+ */
+void mem_arena_destroy(MemArena* arena);
+
+/**
+ * Allocate \a size bytes from \a arena, aligned to MEM_ALIGNMENT.
+ * Objects of more than a quarter of a chunk get a block of their own
+ * @param arena Arena to allocate from
+ * @param size Number of bytes needed
+ * @return Pointer to memory or NULL if out of memory
+ */
+void* mem_arena_alloc(MemArena* arena, size_t size);
+
+/**
+ * Remember the current position of \a arena
+ * @param arena Arena
+ * @return Mark to be passed to mem_arena_rewind
+ */
+MemArenaMark mem_arena_mark(const MemArena* arena);
+
+/**
+ * Free everything allocated from \a arena after \a mark was taken.
+ * Marks taken after \a mark become invalid
+ * @param arena Arena the mark was taken from
+ * @param mark Mark got from mem_arena_mark
+ */
+void mem_arena_rewind(MemArena* arena, MemArenaMark mark);
+
+/**
+ * Free everything allocated from \a arena, keeping its first chunk
+ * @param arena Arena
+ */
+void mem_arena_reset(MemArena* arena);
+
+/**
+ * Free the chunks of the pool which no arena uses. Their pages stay with
+ * the heap until mem_trim or the decay of mem_set_decay gives them back
+ */
+void mem_arena_trim(void);
+
+#endif	/* ARENA_H */
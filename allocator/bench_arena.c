@@ -0,0 +1,77 @@
+/*
+ * Per-request scratch memory: every request allocates a number of small
+ * objects which all die when it ends. Compares mem_alloc and mem_free of
+ * every object with an arena reset once per request.
+ *
+ * Usage: bench_arena [requests] [objects_per_request]
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_OBJECTS 100000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t object_size(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return 16 + *state % 112;
+}
+
+int main(int argc, char** argv) {
+    const size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+    size_t objects = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+    if (objects > MAX_OBJECTS) {
+        objects = MAX_OBJECTS;
+    }
+
+    if (!mem_init_growable(4 << 20)) {
+        fprintf(stderr, "mem_init_growable failed\n");
+        return EXIT_FAILURE;
+    }
+
+    static void* blocks[MAX_OBJECTS];
+    uint64_t random = 0x9E3779B97F4A7C15ull;
+    double start = now();
+    for (size_t request = 0; request < requests; ++request) {
+        for (size_t i = 0; i < objects; ++i) {
+            blocks[i] = mem_alloc(object_size(&random));
+        }
+        for (size_t i = 0; i < objects; ++i) {
+            mem_free(blocks[i]);
+        }
+    }
+    const double heap_time = now() - start;
+
+    MemArena* const arena = mem_arena_create();
+    if (arena == NULL) {
+        fprintf(stderr, "mem_arena_create failed\n");
+        return EXIT_FAILURE;
+    }
+    random = 0x9E3779B97F4A7C15ull;
+    start = now();
+    for (size_t request = 0; request < requests; ++request) {
+        for (size_t i = 0; i < objects; ++i) {
+            blocks[i] = mem_arena_alloc(arena, object_size(&random));
+        }
+        mem_arena_reset(arena);
+    }
+    const double arena_time = now() - start;
+    mem_arena_destroy(arena);
+
+    const double count = (double)requests * objects;
+    printf("%-22s %10.1f ns/object\n", "mem_alloc + mem_free", heap_time * 1e9 / count);
+    printf("%-22s %10.1f ns/object\n", "arena + reset", arena_time * 1e9 / count);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+/*
+ * Compactor benchmark. Churns a fixed-size heap of handles whose sizes drift
+ * upwards, so freed blocks are too small for what comes next, once with
+ * compaction only when mem_halloc finds no block and once with a
+ * mem_compact time slice every few operations.
+ * Prints throughput, failed allocations, the mean length of a slice and
+ * the heap layout at the end of the run.
+ *
+ * Usage: bench_compact [operations] [heap_size] [slice_us]
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LIVE_SLOTS 4096
+
+/**
+ * Operations between two time slices
+ */
+#define SLICE_SPACING 64
+
+typedef struct Result {
+    double seconds;
+    double slice_seconds;
+    size_t slices;
+    size_t failed;
+    size_t moved;
+    MemHeapInfo info;
+} Result;
+
+static MemHandle live[LIVE_SLOTS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t next_size(uint64_t* random, const size_t operation) {
+    const size_t base = 32 + operation / 256 % 1024;
+    return base + next_random(random) % (base / 2 + 1);
+}
+
+/**
+ * @param slice_us Length of the time slices, 0 for none
+ */
+static Result run(const size_t operations, const size_t heap_size, const unsigned long slice_us) {
+    Result result = { .seconds = 0 };
+    uint64_t random = 0x9e3779b97f4a7c15;
+    if (!mem_init(heap_size)) {
+        result.failed = operations;
+        return result;
+    }
+    memset(live, 0, sizeof(live));
+
+    const double start = now();
+    for (size_t i = 0; i < operations; ++i) {
+        const size_t slot = next_random(&random) % LIVE_SLOTS;
+        mem_hfree(live[slot]);
+        const size_t size = next_size(&random, i);
+        live[slot] = mem_halloc(size);
+        if (live[slot] == NULL) {
+            ++result.failed;
+        } else {
+            // touch the block like a user would
+            memset(mem_hlock(live[slot]), (int)i, size);
+            mem_hunlock(live[slot]);
+        }
+        if (slice_us != 0 && i % SLICE_SPACING == 0) {
+            const double slice_start = now();
+            result.moved += mem_compact(slice_us);
+            result.slice_seconds += now() - slice_start;
+            ++result.slices;
+        }
+    }
+    result.seconds = now() - start;
+
+    mem_heap_info(&result.info);
+    for (size_t i = 0; i < LIVE_SLOTS; ++i) {
+        mem_hfree(live[i]);
+    }
+    return result;
+}
+
+static void print_result(const char* name, const size_t operations, const Result* result) {
+    const MemHeapInfo* const info = &result->info;
+    const double fragmentation = info->free_bytes != 0
+            ? 1.0 - (double)info->largest_free_block / info->free_bytes : 0.0;
+    printf("%-12s %10.0f %8lu %10.1f %12lu %11lu %10lu %7.3f\n", name,
+            operations / result->seconds, (unsigned long)result->failed,
+            result->slices != 0 ? result->slice_seconds * 1e6 / result->slices : 0.0, (unsigned long)result->moved,
+            (unsigned long)info->free_blocks, (unsigned long)info->largest_free_block,
+            fragmentation);
+}
+
+int main(int argc, char** argv) {
+    const size_t operations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    const size_t heap_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 16 << 20;
+    const unsigned long slice_us = argc > 3 ? strtoul(argv[3], NULL, 10) : 50;
+
+    printf("%lu operations, %lu byte heap, %lu us slices every %d operations\n",
+            (unsigned long)operations, (unsigned long)heap_size, slice_us, SLICE_SPACING);
+    printf("%-12s %10s %8s %10s %12s %11s %10s %7s\n", "compaction", "ops/s", "failed",
+            "slice us", "bytes moved", "free blocks", "largest", "frag");
+
+    Result result = run(operations, heap_size, 0);
+    print_result("on failure", operations, &result);
+    result = run(operations, heap_size, slice_us);
+    print_result("slices", operations, &result);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+ * Placement policy benchmark. Runs every workload against a fixed-size heap
+ * with each placement policy and prints throughput, failed allocations and
+ * the heap layout at the end of the run.
+ *
+ * Usage: bench_fit [operations] [heap_size]
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LIVE_SLOTS 4096
+
+typedef struct Workload {
+    const char* name;
+    /**
+     * Size of the next allocation
+     */
+    size_t (*next_size)(uint64_t* random, size_t operation);
+    /**
+     * Share of operations which resize a live block instead of freeing it
+     */
+    unsigned realloc_percent;
+} Workload;
+
+typedef struct Result {
+    double seconds;
+    size_t failed;
+    MemHeapInfo info;
+} Result;
+
+static const char* const policy_names[] = {
+    [MEM_FIT_SEGREGATED] = "segregated",
+    [MEM_FIT_FIRST] = "first-fit",
+    [MEM_FIT_NEXT] = "next-fit",
+    [MEM_FIT_BEST] = "best-fit",
+};
+
+static void* live[LIVE_SLOTS];
+static size_t live_size[LIVE_SLOTS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Mostly small objects with a few big buffers
+ */
+static size_t mixed_size(uint64_t* random, size_t operation) {
+    (void)operation;
+    const uint64_t value = next_random(random);
+    if (value % 32 == 0) return 1024 + value / 32 % 8192;
+    return 16 + value / 32 % 240;
+}
+
+/**
+ * Object sizes drift upwards, so freed small blocks are rarely reused whole
+ */
+static size_t ramp_size(uint64_t* random, size_t operation) {
+    const size_t base = 16 + operation / 512 % 2048;
+    return base + next_random(random) % (base / 2 + 1);
+}
+
+/**
+ * Growing buffers, most of the work is realloc
+ */
+static size_t buffer_size(uint64_t* random, size_t operation) {
+    (void)operation;
+    return 64 + next_random(random) % 4096;
+}
+
+static const Workload workloads[] = {
+    { "mixed", mixed_size, 0 },
+    { "ramp", ramp_size, 0 },
+    { "realloc", buffer_size, 50 },
+};
+
+static Result run(const Workload* workload, MemFitPolicy policy,
+        size_t operations, size_t heap_size) {
+    Result result = { 0 };
+    uint64_t random = 0x9E3779B97F4A7C15ull;
+    mem_init(heap_size);
+    mem_set_policy(policy);
+
+    const double start = now();
+    for (size_t i = 0; i < operations; ++i) {
+        const size_t slot = next_random(&random) % LIVE_SLOTS;
+        const size_t size = workload->next_size(&random, i);
+        if (live[slot] != NULL && live_size[slot] < 64 << 10
+                && next_random(&random) % 100 < workload->realloc_percent) {
+            // grow by a random amount, up to half of the block again
+            const size_t new_size = live_size[slot] + size % (live_size[slot] / 2 + 1);
+            void* const resized = mem_realloc(live[slot], new_size);
+            if (resized == NULL) {
+                ++result.failed;
+            } else {
+                live[slot] = resized;
+                live_size[slot] = new_size;
+            }
+            continue;
+        }
+        mem_free(live[slot]);
+        live[slot] = mem_alloc(size);
+        live_size[slot] = size;
+        if (live[slot] == NULL) {
+            ++result.failed;
+        }
+    }
+    result.seconds = now() - start;
+    mem_heap_info(&result.info);
+
+    for (size_t slot = 0; slot < LIVE_SLOTS; ++slot) {
+        mem_free(live[slot]);
+        live[slot] = NULL;
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const size_t operations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    const size_t heap_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 16 << 20;
+
+    printf("%-8s %-10s %12s %8s %10s %10s %8s %9s\n", "workload", "policy",
+            "ops/sec", "failed", "used KiB", "free KiB", "holes", "ext.frag");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        for (MemFitPolicy policy = MEM_FIT_SEGREGATED; policy <= MEM_FIT_BEST; ++policy) {
+            const Result result = run(&workloads[w], policy, operations, heap_size);
+            const MemHeapInfo* const info = &result.info;
+            // share of free memory which is not usable for one big request
+            const double fragmentation = info->free_bytes == 0 ? 0
+                    : 1.0 - (double)info->largest_free_block / info->free_bytes;
+            printf("%-8s %-10s %12.0f %8zu %10zu %10zu %8zu %8.1f%%\n",
+                    workloads[w].name, policy_names[policy],
+                    operations / result.seconds, result.failed,
+                    info->used_bytes >> 10, info->free_bytes >> 10,
+                    info->free_blocks, 100 * fragmentation);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/*
+ * Shared heap benchmark. Forked workers allocate and free blocks of one
+ * memfd heap at once, checking that no other process wrote into their
+ * blocks. Then a lookup table is built in a heap file, which is closed and
+ * mapped again the way a restarted process would, timing the attach and a
+ * pass over the table. Last, files which hold no heap must be formatted or
+ * refused, not waited on.
+ *
+ * Usage: bench_shared [workers] [operations] [heap_mb] [file]
+ */
+#define _GNU_SOURCE
+
+#include "shared_heap.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIVE_SLOTS 1024
+
+/**
+ * Entries of the lookup table, one block each
+ */
+#define TABLE_ENTRIES 1000000
+
+typedef struct TableEntry {
+    uint64_t key;
+    uint64_t value;
+} TableEntry;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Churn of one worker. Every block is filled with a byte of the worker's
+ * own and checked before it is freed
+ * @return Number of corrupted blocks
+ */
+static size_t churn(MemSharedHeap* heap, const size_t operations, const unsigned worker) {
+    size_t live[LIVE_SLOTS] = { 0 };
+    size_t live_size[LIVE_SLOTS];
+    uint64_t random = 0x9e3779b97f4a7c15 * (worker + 1);
+    const unsigned char fill = 0x40 + worker;
+    size_t corrupted = 0;
+
+    for (size_t i = 0; i < operations + LIVE_SLOTS; ++i) {
+        const size_t slot = i < operations ? next_random(&random) % LIVE_SLOTS : i - operations;
+        if (live[slot] != 0) {
+            const unsigned char* const data = mem_shared_addr(heap, live[slot]);
+            for (size_t k = 0; k < live_size[slot]; ++k) {
+                if (data[k] != fill) {
+                    ++corrupted;
+                    break;
+                }
+            }
+            mem_shared_free(heap, live[slot]);
+            live[slot] = 0;
+        }
+        if (i < operations) {
+            live_size[slot] = 16 + next_random(&random) % 1024;
+            live[slot] = mem_shared_alloc(heap, live_size[slot]);
+            if (live[slot] != 0) {
+                memset(mem_shared_addr(heap, live[slot]), fill, live_size[slot]);
+            }
+        }
+    }
+    return corrupted;
+}
+
+static int run_workers(const unsigned workers, const size_t operations, const size_t heap_size) {
+    const int fd = memfd_create("bench_shared", MFD_CLOEXEC);
+    MemSharedHeap* const heap = fd >= 0 ? mem_shared_open_fd(fd, heap_size) : NULL;
+    if (heap == NULL) {
+        fprintf(stderr, "memfd heap: can not be mapped\n");
+        return 0;
+    }
+
+    const double start = now();
+    for (unsigned i = 0; i < workers; ++i) {
+        if (fork() == 0) {
+            // the mapping is inherited, a worker could map the fd as well
+            _exit(churn(heap, operations, i) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    int ok = 1;
+    int status;
+    while (wait(&status) > 0) {
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+    const double seconds = now() - start;
+
+    MemHeapInfo info;
+    mem_shared_info(heap, &info);
+    printf("%u workers: %.0f alloc/free pairs/s, %lu blocks left, %lu free blocks%s\n",
+            workers, workers * operations / seconds, (unsigned long)info.used_blocks,
+            (unsigned long)info.free_blocks, ok ? "" : ", corrupted blocks");
+    mem_shared_close(heap);
+    close(fd);
+    return ok && info.used_blocks == 0;
+}
+
+static int run_table(const char* path, const size_t heap_size) {
+    unlink(path);
+    MemSharedHeap* heap = mem_shared_open(path, heap_size);
+    if (heap == NULL) {
+        fprintf(stderr, "%s: can not be mapped\n", path);
+        return 0;
+    }
+    double start = now();
+    const size_t table = mem_shared_alloc(heap, TABLE_ENTRIES * sizeof(size_t));
+    size_t* const entries = mem_shared_addr(heap, table);
+    for (size_t i = 0; entries != NULL && i < TABLE_ENTRIES; ++i) {
+        entries[i] = mem_shared_alloc(heap, sizeof(TableEntry));
+        TableEntry* const entry = mem_shared_addr(heap, entries[i]);
+        if (entry == NULL) break;
+        *entry = (TableEntry) { .key = i, .value = i * i };
+    }
+    mem_shared_set_root(heap, 0, table);
+    const double build = now() - start;
+    mem_shared_close(heap);
+
+    start = now();
+    heap = mem_shared_open(path, 0);
+    const double attach = now() - start;
+    int ok = heap != NULL && mem_shared_root(heap) != 0;
+    start = now();
+    const size_t* const table_entries = ok ? mem_shared_addr(heap, mem_shared_root(heap)) : NULL;
+    for (size_t i = 0; ok && i < TABLE_ENTRIES; ++i) {
+        const TableEntry* const entry = mem_shared_addr(heap, table_entries[i]);
+        ok = entry != NULL && entry->key == i && entry->value == i * i;
+    }
+    const double lookup = now() - start;
+    printf("table of %d entries: built in %.3f s, attached in %.1f us, "
+            "read in %.3f s%s\n", TABLE_ENTRIES, build, attach * 1e6, lookup,
+            ok ? "" : ", bad entries");
+    mem_shared_close(heap);
+    unlink(path);
+    return ok;
+}
+
+/**
+ * Write \a size bytes of zeros to \a path, but \a value at \a offset
+ */
+static int write_file(const char* path, const size_t size, const size_t offset,
+        const unsigned char value) {
+    unsigned char* const data = calloc(size, 1);
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = data != NULL && fd >= 0;
+    if (ok) {
+        data[offset] = value;
+        ok = write(fd, data, size) == (ssize_t)size;
+    }
+    if (fd >= 0) close(fd);
+    free(data);
+    return ok;
+}
+
+static int run_garbage(const char* path) {
+    const size_t size = 64 << 10;
+    // a lock word of pid 0, held by nobody: the file of zeros is formatted
+    MemSharedHeap* heap = write_file(path, size, 20, 1) ? mem_shared_open(path, 0) : NULL;
+    int ok = heap != NULL && mem_shared_alloc(heap, 64) != 0;
+    mem_shared_close(heap);
+    // a magic of no heap, with the same lock word
+    ok = ok && write_file(path, size, 20, 1);
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    ok = ok && fd >= 0 && pwrite(fd, "x", 1, 0) == 1;
+    if (fd >= 0) close(fd);
+    heap = ok ? mem_shared_open(path, 0) : NULL;
+    ok = ok && heap == NULL;
+    mem_shared_close(heap);
+    printf("files without a heap: %s\n", ok ? "formatted or refused" : "mishandled");
+    unlink(path);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const unsigned workers = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    const size_t operations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    const size_t heap_size = (argc > 3 ? strtoul(argv[3], NULL, 10) : 256) << 20;
+    const char* const path = argc > 4 ? argv[4] : "bench_shared.heap";
+
+    const int ok = run_workers(workers, operations, heap_size)
+            && run_table(path, heap_size) && run_garbage(path);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,136 @@
+/*
+ * Thread scaling benchmark for the thread-safe build of the allocator.
+ * Runs the same small-object workload on 1..N threads and prints throughput.
+ * Every thread also hands some of its blocks to its neighbour, so part of
+ * the frees are cross-thread.
+ *
+ * Usage: bench_threads [max_threads] [operations_per_thread]
+ */
+#define _DEFAULT_SOURCE
+
+#include "allocator.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIVE_SLOTS 256
+#define MAX_BLOCK 512
+#define HANDOFF_PERIOD 16
+#define MAX_THREADS 256
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t index;
+    size_t thread_count;
+    size_t operations;
+    size_t failed;
+} Worker;
+
+/**
+ * One mailbox per thread: thread i puts blocks into mailbox[i + 1],
+ * thread i + 1 frees them
+ */
+typedef struct Mailbox {
+    void* block;
+} __attribute__((aligned(64))) Mailbox;
+
+static Mailbox mailbox[MAX_THREADS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void* worker_main(void* arg) {
+    Worker* const worker = arg;
+    void* live[LIVE_SLOTS] = { NULL };
+    uint64_t random = 0x9E3779B97F4A7C15ull * (worker->index + 1);
+    void** const own_box = &mailbox[worker->index].block;
+    void** const next_box = &mailbox[(worker->index + 1) % worker->thread_count].block;
+
+    for (size_t i = 0; i < worker->operations; ++i) {
+        const size_t slot = next_random(&random) % LIVE_SLOTS;
+        if (live[slot] != NULL) {
+            void* expected = NULL;
+            if (i % HANDOFF_PERIOD == 0 && worker->thread_count > 1
+                    && __atomic_compare_exchange_n(next_box, &expected, live[slot],
+                            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                // neighbour frees it
+            } else {
+                mem_free(live[slot]);
+            }
+        }
+        live[slot] = mem_alloc(8 + next_random(&random) % MAX_BLOCK);
+        if (live[slot] == NULL) {
+            ++worker->failed;
+        }
+
+        void* const received = __atomic_exchange_n(own_box, NULL, __ATOMIC_ACQUIRE);
+        if (received != NULL) {
+            mem_free(received);
+        }
+    }
+
+    for (size_t slot = 0; slot < LIVE_SLOTS; ++slot) {
+        mem_free(live[slot]);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                  : (size_t)(cpus > 0 ? cpus : 1);
+    if (max_threads > MAX_THREADS) {
+        max_threads = MAX_THREADS;
+    }
+    const size_t operations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    if (!mem_init(64 << 20)) {
+        fprintf(stderr, "mem_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    Worker* const workers = calloc(max_threads, sizeof(Worker));
+    double single_rate = 0;
+
+    printf("%8s %14s %10s %10s\n", "threads", "ops/sec", "speedup", "failed");
+    for (size_t threads = 1; threads <= max_threads; ++threads) {
+        const double start = now();
+        for (size_t i = 0; i < threads; ++i) {
+            workers[i] = (Worker) { .index = i, .thread_count = threads,
+                                    .operations = operations };
+            pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        }
+        size_t failed = 0;
+        for (size_t i = 0; i < threads; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            failed += workers[i].failed;
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            mem_free(mailbox[i].block);
+            mailbox[i].block = NULL;
+        }
+        const double rate = threads * operations / (now() - start);
+        if (threads == 1) {
+            single_rate = rate;
+        }
+        printf("%8zu %14.0f %9.2fx %10zu\n", threads, rate, rate / single_rate, failed);
+    }
+
+    free(workers);
+    return EXIT_SUCCESS;
+}
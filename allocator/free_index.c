@@ -0,0 +1,377 @@
+#include "free_index.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ * Number of bins. Bin \a i holds blocks of [2^i, 2^(i+1)) bytes
+ */
+#define BIN_COUNT 64
+
+static MemFitPolicy policy = MEM_FIT_SEGREGATED;
+
+/**
+ * Heads of the free block lists, one per bin
+ */
+static FreeBlock* bins[BIN_COUNT];
+
+/**
+ * Bit \a i is set when bins[i] is not empty
+ */
+static uint64_t bin_bitmap = 0;
+
+/**
+ * Root of the treap used by the tree policies
+ */
+static FreeBlock* tree_root = NULL;
+
+/**
+ * Next-fit search starts at this address and wraps around
+ */
+static uintptr_t rover = 0;
+
+/**
+ * Running totals of the indexed blocks for free_index_stats
+ */
+static size_t indexed_bytes = 0;
+static size_t indexed_pages = 0;
+static size_t class_blocks[MEM_STATS_CLASS_COUNT];
+
+static size_t page_size = 0;
+
+/**
+ * \a block can not hold the treap links, so it is kept in a bin whatever
+ * the policy
+ */
+static bool is_small(const FreeBlock* block);
+
+/**
+ * Add \a block to the running totals, or take it away when \a sign is -1
+ */
+static void count_block(const FreeBlock* block, int sign);
+
+/**
+ * Index of the bin which blocks of \a size bytes belong to
+ * @param size Block size, must be non-zero
+ * @return floor(log2(size))
+ */
+static size_t bin_index(size_t size);
+
+static void bin_insert(FreeBlock* block);
+
+static void bin_remove(FreeBlock* block);
+
+/**
+ * Find a block of at least \a size bytes in the bins
+ * @return Free block (still indexed) or NULL
+ */
+static FreeBlock* bin_find(size_t size);
+
+/**
+ * Treap priority of \a block, a hash of its address
+ */
+static uintptr_t priority(const FreeBlock* block);
+
+/**
+ * Order of blocks in the treap of the current policy
+ * @return True if \a a goes before \a b
+ */
+static bool tree_less(const FreeBlock* a, const FreeBlock* b);
+
+/**
+ * Recompute max_size of \a node from its children
+ */
+static void tree_update(FreeBlock* node);
+
+static FreeBlock* rotate_left(FreeBlock* node);
+
+static FreeBlock* rotate_right(FreeBlock* node);
+
+/**
+ * Insert \a block into the subtree of \a node
+ * @return New root of the subtree
+ */
+static FreeBlock* tree_insert(FreeBlock* node, FreeBlock* block);
+
+/**
+ * Remove \a block from the subtree of \a node
+ * @return New root of the subtree
+ */
+static FreeBlock* tree_remove(FreeBlock* node, FreeBlock* block);
+
+/**
+ * Join two treaps, every block of \a low goes before every block of \a high
+ * @return Root of the joined treap
+ */
+static FreeBlock* tree_join(FreeBlock* low, FreeBlock* high);
+
+/**
+ * Lowest address block of at least \a size bytes at or above \a min_address
+ * in the address-ordered treap
+ * @return Free block (still indexed) or NULL
+ */
+static FreeBlock* tree_first_fit(FreeBlock* node, size_t size, uintptr_t min_address);
+
+/**
+ * Smallest block of at least \a size bytes in the size-ordered treap
+ * @return Free block (still indexed) or NULL
+ */
+static FreeBlock* tree_best_fit(size_t size);
+
+void free_index_reset(MemFitPolicy new_policy) {
+    policy = new_policy;
+    for (size_t i = 0; i < BIN_COUNT; ++i) {
+        bins[i] = NULL;
+    }
+    bin_bitmap = 0;
+    tree_root = NULL;
+    rover = 0;
+    indexed_bytes = 0;
+    indexed_pages = 0;
+    for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+        class_blocks[i] = 0;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+void free_index_insert(FreeBlock* block) {
+    count_block(block, 1);
+    if (policy == MEM_FIT_SEGREGATED || is_small(block)) {
+        bin_insert(block);
+    } else {
+        tree_root = tree_insert(tree_root, block);
+    }
+}
+
+void free_index_remove(FreeBlock* block) {
+    count_block(block, -1);
+    if (policy == MEM_FIT_SEGREGATED || is_small(block)) {
+        bin_remove(block);
+    } else {
+        tree_root = tree_remove(tree_root, block);
+    }
+}
+
+FreeBlock* free_index_take(size_t size) {
+    FreeBlock* block = NULL;
+    if (policy != MEM_FIT_SEGREGATED && size < sizeof(FreeBlock) + sizeof(size_t)) {
+        // small requests use up the small blocks first, the tree has none
+        block = bin_find(size);
+    }
+    if (block == NULL) {
+        switch (policy) {
+            case MEM_FIT_FIRST:
+                block = tree_first_fit(tree_root, size, 0);
+                break;
+            case MEM_FIT_NEXT:
+                block = tree_first_fit(tree_root, size, rover);
+                if (block == NULL) {
+                    block = tree_first_fit(tree_root, size, 0);
+                }
+                break;
+            case MEM_FIT_BEST:
+                block = tree_best_fit(size);
+                break;
+            default:
+                block = bin_find(size);
+                break;
+        }
+    }
+    if (block == NULL) return NULL;
+    free_index_remove(block);
+    // the rest of the block, if any, is where the next search starts
+    rover = (uintptr_t)block + size;
+    return block;
+}
+
+size_t free_index_stats(MemStats* stats) {
+    stats->bytes_free += indexed_bytes;
+    for (size_t i = 0; i < MEM_STATS_CLASS_COUNT; ++i) {
+        stats->classes[i].free_blocks += class_blocks[i];
+    }
+    return indexed_pages;
+}
+
+static bool is_small(const FreeBlock* block) {
+    return free_block_size(block) < sizeof(FreeBlock) + sizeof(size_t);
+}
+
+static void count_block(const FreeBlock* block, int sign) {
+    const size_t size = free_block_size(block);
+    // usable bytes once allocated: everything but the header
+    const size_t usable = size - sizeof(size_t);
+    // the links and the footer stay in use while the block is free
+    const uintptr_t start = ((uintptr_t)(block + 1) + page_size - 1) & ~(page_size - 1);
+    const uintptr_t end = ((uintptr_t)block + size - sizeof(size_t)) & ~(page_size - 1);
+    const size_t pages = end > start ? (end - start) / page_size : 0;
+    if (sign > 0) {
+        indexed_bytes += usable;
+        indexed_pages += pages;
+        class_blocks[mem_stats_class(usable)]++;
+    } else {
+        indexed_bytes -= usable;
+        indexed_pages -= pages;
+        class_blocks[mem_stats_class(usable)]--;
+    }
+}
+
+static size_t bin_index(size_t size) {
+    return 63 - __builtin_clzll(size);
+}
+
+static void bin_insert(FreeBlock* block) {
+    const size_t index = bin_index(free_block_size(block));
+    block->list.prev = NULL;
+    block->list.next = bins[index];
+    if (block->list.next != NULL) {
+        block->list.next->list.prev = block;
+    }
+    bins[index] = block;
+    bin_bitmap |= (uint64_t)1 << index;
+}
+
+static void bin_remove(FreeBlock* block) {
+    const size_t index = bin_index(free_block_size(block));
+    if (block->list.prev != NULL) {
+        block->list.prev->list.next = block->list.next;
+    } else {
+        bins[index] = block->list.next;
+        if (bins[index] == NULL) {
+            bin_bitmap &= ~((uint64_t)1 << index);
+        }
+    }
+    if (block->list.next != NULL) {
+        block->list.next->list.prev = block->list.prev;
+    }
+}
+
+static FreeBlock* bin_find(size_t size) {
+    const size_t index = bin_index(size);
+    // every block in a bin above floor(log2(size)) is big enough,
+    // unless size is an exact power of two - then its own bin fits too
+    const size_t fit_index = (size & (size - 1)) ? index + 1 : index;
+    const uint64_t fit_bins =
+            fit_index < BIN_COUNT ? bin_bitmap & (~(uint64_t)0 << fit_index) : 0;
+    if (fit_bins != 0) {
+        return bins[__builtin_ctzll(fit_bins)];
+    }
+    // only blocks of the size's own bin are left, some of them may fit
+    for (FreeBlock* block = bins[index]; block != NULL; block = block->list.next) {
+        if (free_block_size(block) >= size) return block;
+    }
+    return NULL;
+}
+
+static uintptr_t priority(const FreeBlock* block) {
+    return ((uintptr_t)block >> 3) * (uintptr_t)0x9E3779B97F4A7C15ull;
+}
+
+static bool tree_less(const FreeBlock* a, const FreeBlock* b) {
+    if (policy == MEM_FIT_BEST && free_block_size(a) != free_block_size(b)) {
+        return free_block_size(a) < free_block_size(b);
+    }
+    return a < b;
+}
+
+static void tree_update(FreeBlock* node) {
+    size_t max_size = free_block_size(node);
+    if (node->tree.left != NULL && node->tree.left->tree.max_size > max_size) {
+        max_size = node->tree.left->tree.max_size;
+    }
+    if (node->tree.right != NULL && node->tree.right->tree.max_size > max_size) {
+        max_size = node->tree.right->tree.max_size;
+    }
+    node->tree.max_size = max_size;
+}
+
+static FreeBlock* rotate_left(FreeBlock* node) {
+    FreeBlock* const right = node->tree.right;
+    node->tree.right = right->tree.left;
+    right->tree.left = node;
+    tree_update(node);
+    tree_update(right);
+    return right;
+}
+
+static FreeBlock* rotate_right(FreeBlock* node) {
+    FreeBlock* const left = node->tree.left;
+    node->tree.left = left->tree.right;
+    left->tree.right = node;
+    tree_update(node);
+    tree_update(left);
+    return left;
+}
+
+static FreeBlock* tree_insert(FreeBlock* node, FreeBlock* block) {
+    if (node == NULL) {
+        block->tree.left = block->tree.right = NULL;
+        block->tree.max_size = free_block_size(block);
+        return block;
+    }
+    if (tree_less(block, node)) {
+        node->tree.left = tree_insert(node->tree.left, block);
+        if (priority(node->tree.left) > priority(node)) {
+            return rotate_right(node);
+        }
+    } else {
+        node->tree.right = tree_insert(node->tree.right, block);
+        if (priority(node->tree.right) > priority(node)) {
+            return rotate_left(node);
+        }
+    }
+    tree_update(node);
+    return node;
+}
+
+static FreeBlock* tree_remove(FreeBlock* node, FreeBlock* block) {
+    if (node == NULL) return NULL;
+    if (node == block) {
+        return tree_join(node->tree.left, node->tree.right);
+    }
+    if (tree_less(block, node)) {
+        node->tree.left = tree_remove(node->tree.left, block);
+    } else {
+        node->tree.right = tree_remove(node->tree.right, block);
+    }
+    tree_update(node);
+    return node;
+}
+
+static FreeBlock* tree_join(FreeBlock* low, FreeBlock* high) {
+    if (low == NULL) return high;
+    if (high == NULL) return low;
+    if (priority(low) > priority(high)) {
+        low->tree.right = tree_join(low->tree.right, high);
+        tree_update(low);
+        return low;
+    }
+    high->tree.left = tree_join(low, high->tree.left);
+    tree_update(high);
+    return high;
+}
+
+static FreeBlock* tree_first_fit(FreeBlock* node, size_t size, uintptr_t min_address) {
+    while (node != NULL && node->tree.max_size >= size) {
+        if ((uintptr_t)node >= min_address) {
+            // lower addresses first, only then the node itself
+            FreeBlock* const block = tree_first_fit(node->tree.left, size, min_address);
+            if (block != NULL) return block;
+            if (free_block_size(node) >= size) return node;
+        }
+        node = node->tree.right;
+    }
+    return NULL;
+}
+
+static FreeBlock* tree_best_fit(size_t size) {
+    FreeBlock* best = NULL;
+    for (FreeBlock* node = tree_root; node != NULL; ) {
+        if (free_block_size(node) >= size) {
+            best = node;
+            node = node->tree.left;
+        } else {
+            node = node->tree.right;
+        }
+    }
+    return best;
+}
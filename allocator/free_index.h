@@ -0,0 +1,117 @@
+#ifndef FREE_INDEX_H
+#define	FREE_INDEX_H
+
+#include "allocator.h"
+
+#include <stddef.h>
+
+/*
+ * Index of the free blocks of the heap. How it is organised depends on the
+ * placement policy:
+ *  - MEM_FIT_SEGREGATED: power-of-two bins with a bitmap of non-empty bins
+ *  - MEM_FIT_FIRST, MEM_FIT_NEXT: treap ordered by address, every node knows
+ *    the biggest block in its subtree
+ *  - MEM_FIT_BEST: treap ordered by size, then by address
+ * Blocks too small to hold the treap links stay in the bins with the tree
+ * policies too.
+ */
+
+/**
+ * Block header bit: the block is allocated
+ */
+#define BLOCK_IN_USE ((size_t)1)
+
+/**
+ * Block header bit: the block right below is allocated, so there is no
+ * footer to read in front of the header
+ */
+#define BLOCK_PREV_IN_USE ((size_t)2)
+
+/**
+ * Block header bit: the block belongs to a handle and the compactor may
+ * move it
+ */
+#define BLOCK_MOVABLE ((size_t)4)
+
+#define BLOCK_FLAGS (BLOCK_IN_USE | BLOCK_PREV_IN_USE | BLOCK_MOVABLE)
+
+/**
+ * Free block. Starts with the same header word as an allocated block, the
+ * links live in what would be user data and the size is repeated in the
+ * last word of the block (footer)
+ */
+typedef struct FreeBlock {
+    /**
+     * Block size (header and footer included) ORed with BLOCK_* bits
+     */
+    size_t header;
+    union {
+        /**
+         * Neighbours in a bin
+         */
+        struct {
+            struct FreeBlock* prev;
+            struct FreeBlock* next;
+        } list;
+        /**
+         * Children in a treap
+         */
+        struct {
+            struct FreeBlock* left;
+            struct FreeBlock* right;
+            /**
+             * Biggest block size in the subtree (address-ordered treap)
+             */
+            size_t max_size;
+        } tree;
+    };
+} FreeBlock;
+
+/**
+ * Smallest free block: the header, the list links and the footer
+ */
+#define FREE_BLOCK_MIN_SIZE (4 * sizeof(size_t))
+
+/**
+ * Size of \a block in bytes
+ */
+static inline size_t free_block_size(const FreeBlock* block) {
+    return block->header & ~BLOCK_FLAGS;
+}
+
+/**
+ * Forget every indexed block and organise the index for \a policy
+ * @param policy Placement policy
+ */
+void free_index_reset(MemFitPolicy policy);
+
+/**
+ * Add \a block to the index. Its header must be final
+ * @param block Free block
+ */
+void free_index_insert(FreeBlock* block);
+
+/**
+ * Remove \a block from the index. Must be called before its header changes
+ * @param block Indexed free block
+ */
+void free_index_remove(FreeBlock* block);
+
+/**
+ * Find a block of at least \a size bytes by the current policy and remove
+ * it from the index
+ * @param size Number of bytes needed
+ * @return Free block or NULL if nothing fits
+ */
+FreeBlock* free_index_take(size_t size);
+
+/**
+ * Add the indexed blocks to \a stats: bytes_free and the free_blocks of
+ * the classes. Kept up to date on every insert and remove
+ * @param stats Statistics to add to
+ * @return Number of whole pages inside the indexed blocks, past their links
+ * and before their footers, which the OS could take back
+ */
+size_t free_index_stats(MemStats* stats);
+
+#endif	/* FREE_INDEX_H */
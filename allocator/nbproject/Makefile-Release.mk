@@ -35,8 +35,15 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
+	${OBJECTDIR}/_ext/361493028/mem_copy.o \
+	${OBJECTDIR}/_ext/361493028/mem_hardening.o \
+	${OBJECTDIR}/_ext/361493028/mem_stats.o \
+	${OBJECTDIR}/_ext/361493028/thread_cache.o \
 	${OBJECTDIR}/allocator.o \
-	${OBJECTDIR}/main.o
+	${OBJECTDIR}/arena.o \
+	${OBJECTDIR}/free_index.o \
+	${OBJECTDIR}/main.o \
+	${OBJECTDIR}/shared_heap.o
 
 
 # C Compiler Flags
@@ -63,15 +70,50 @@ ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/allocator: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
 	${LINK.c} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/allocator ${OBJECTFILES} ${LDLIBSOPTIONS}
 
+${OBJECTDIR}/_ext/361493028/mem_copy.o: ../alloc_common/mem_copy.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_copy.o ../alloc_common/mem_copy.c
+
+${OBJECTDIR}/_ext/361493028/mem_hardening.o: ../alloc_common/mem_hardening.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_hardening.o ../alloc_common/mem_hardening.c
+
+${OBJECTDIR}/_ext/361493028/mem_stats.o: ../alloc_common/mem_stats.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_stats.o ../alloc_common/mem_stats.c
+
+${OBJECTDIR}/_ext/361493028/thread_cache.o: ../alloc_common/thread_cache.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/thread_cache.o ../alloc_common/thread_cache.c
+
 ${OBJECTDIR}/allocator.o: allocator.c 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} $@.d
-	$(COMPILE.c) -O2 -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/allocator.o allocator.c
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/allocator.o allocator.c
+
+${OBJECTDIR}/arena.o: arena.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/arena.o arena.c
+
+${OBJECTDIR}/free_index.o: free_index.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/free_index.o free_index.c
 
 ${OBJECTDIR}/main.o: main.c 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} $@.d
-	$(COMPILE.c) -O2 -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/main.o main.c
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/main.o main.c
+
+${OBJECTDIR}/shared_heap.o: shared_heap.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -O2 -I. -I../alloc_common -std=c11 -MMD -MP -MF $@.d -o ${OBJECTDIR}/shared_heap.o shared_heap.c
 
 # Subprojects
 .build-subprojects:
@@ -0,0 +1,529 @@
+#define _DEFAULT_SOURCE
+
+#include "shared_heap.h"
+#include "free_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * First word of a heap file, "memheap2" read as a little-endian number
+ */
+#define SHARED_MAGIC ((uint64_t)0x327061656865656dULL)
+
+/**
+ * The top bits of the header word of an allocated block hold a check of its
+ * offset and size, which tells it from user data mem_shared_free is given
+ */
+#define CHECK_SHIFT 48
+#define SIZE_MASK (((uint64_t)1 << CHECK_SHIFT) - 1)
+
+/**
+ * Number of bins. Bin \a i holds blocks of [2^i, 2^(i+1)) bytes
+ */
+#define BIN_COUNT 64
+
+/**
+ * Failed attempts to take the lock between two checks that its owner is
+ * still alive
+ */
+#define LOCK_CHECK_SPINS 64
+
+/**
+ * Start of every heap file. Block offsets count from here as well
+ */
+typedef struct SharedHeader {
+    /**
+     * SHARED_MAGIC, written last when the heap is set up
+     */
+    uint64_t magic;
+    /**
+     * Size of the heap file
+     */
+    uint64_t size;
+    /**
+     * Pid of the process holding the heap lock in the low half, the low half
+     * of its start time in the high one, 0 if free
+     */
+    uint64_t lock;
+    /**
+     * See mem_shared_root
+     */
+    uint64_t root;
+    /**
+     * Bit \a i is set when bins[i] is not empty
+     */
+    uint64_t bin_bitmap;
+    /**
+     * Offsets of the first free block of every bin, 0 for none
+     */
+    uint64_t bins[BIN_COUNT];
+} SharedHeader;
+
+/**
+ * Free block, laid out like FreeBlock with offsets for links. Allocated
+ * blocks keep the header word only, their data follows it
+ */
+typedef struct SharedFreeBlock {
+    /**
+     * Block size (header and footer included) ORed with BLOCK_IN_USE and
+     * BLOCK_PREV_IN_USE, and with the block check while allocated
+     */
+    uint64_t header;
+    uint64_t prev;
+    uint64_t next;
+} SharedFreeBlock;
+
+/**
+ * Offset of the first block: the header, padded so the data of the block
+ * lands on MEM_ALIGNMENT. The last word of the heap is an epilogue header,
+ * of size 0 and marked as allocated, like at the end of a chunk
+ */
+static const size_t first_block =
+        (sizeof(SharedHeader) + sizeof(uint64_t) + MEM_ALIGNMENT - 1)
+        / MEM_ALIGNMENT * MEM_ALIGNMENT - sizeof(uint64_t);
+
+/**
+ * Free blocks hold the list links and a footer, so no block is smaller
+ */
+static const size_t min_block_size =
+        (sizeof(SharedFreeBlock) + sizeof(uint64_t) + MEM_ALIGNMENT - 1)
+        / MEM_ALIGNMENT * MEM_ALIGNMENT;
+
+/**
+ * Heap header of \a heap
+ */
+static SharedHeader* header_of(const MemSharedHeap* heap);
+
+/**
+ * Block at \a offset of \a heap
+ */
+static SharedFreeBlock* block_at(const MemSharedHeap* heap, uint64_t offset);
+
+static uint64_t block_size(const SharedFreeBlock* block);
+
+/**
+ * Check bits of the allocated block of \a size bytes at \a offset
+ */
+static uint64_t block_check(uint64_t offset, uint64_t size);
+
+/**
+ * Offset of the epilogue of a heap file of \a size bytes
+ */
+static uint64_t epilogue_offset(size_t size);
+
+/**
+ * Take the heap lock, taking it over from a process which died holding it
+ * @param heap Heap
+ */
+static void lock_heap(MemSharedHeap* heap);
+
+/**
+ * Lock word of the calling process
+ */
+static uint64_t lock_owner(void);
+
+/**
+ * Whether the process of lock word \a owner is gone: its pid names no
+ * process, or one which started at another time and so reuses the pid. A
+ * pid of 0 or below is left by no process and taken for a dead one
+ */
+static bool owner_dead(uint64_t owner);
+
+/**
+ * Start time of process \a pid in clock ticks since boot, from /proc
+ * @return The time or 0 if it can not be read
+ */
+static uint64_t start_time(pid_t pid);
+
+static void unlock_heap(MemSharedHeap* heap);
+
+/**
+ * Lay out an empty heap over a file of zeros: no root and one free block
+ * between the header and the epilogue
+ */
+static void format_heap(MemSharedHeap* heap);
+
+/**
+ * Rebuild the free lists of \a heap from the block headers, after a process
+ * died in the middle of an update. Free blocks next to each other are
+ * merged and the footers and BLOCK_PREV_IN_USE bits are set again
+ */
+static void recover_heap(MemSharedHeap* heap);
+
+/**
+ * Turn \a size bytes at \a offset into a free block and put it in its bin.
+ * The block below must be allocated
+ */
+static void add_free_block(MemSharedHeap* heap, uint64_t offset, uint64_t size);
+
+static size_t bin_index(uint64_t size);
+
+static void bin_insert(MemSharedHeap* heap, uint64_t offset);
+
+static void bin_remove(MemSharedHeap* heap, uint64_t offset);
+
+/**
+ * First free block of at least \a size bytes, or 0
+ */
+static uint64_t bin_find(MemSharedHeap* heap, uint64_t size);
+
+MemSharedHeap* mem_shared_open(const char* path, const size_t size) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+    MemSharedHeap* const heap = mem_shared_open_fd(fd, size);
+    close(fd);
+    return heap;
+}
+
+MemSharedHeap* mem_shared_open_fd(const int fd, const size_t size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    size_t file_size = st.st_size;
+    if (file_size == 0) {
+        // processes creating the same file at once pass the same size
+        if (size < first_block + min_block_size + sizeof(uint64_t)) return NULL;
+        if (ftruncate(fd, size) != 0) return NULL;
+        file_size = size;
+    }
+    if (file_size < first_block + min_block_size + sizeof(uint64_t)
+            || file_size > SIZE_MASK) {
+        return NULL;
+    }
+
+    MemSharedHeap* const heap = malloc(sizeof(MemSharedHeap));
+    if (heap == NULL) return NULL;
+    heap->base = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    heap->size = file_size;
+    if (heap->base == MAP_FAILED) {
+        free(heap);
+        return NULL;
+    }
+
+    SharedHeader* const header = header_of(heap);
+    // the lock word of a file which holds no heap means nothing, so it is
+    // not waited for; a heap being formatted still has magic 0
+    const uint64_t magic = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE);
+    if ((magic != 0 && magic != SHARED_MAGIC)
+            || (magic == SHARED_MAGIC && header->size != file_size)) {
+        mem_shared_close(heap);
+        return NULL;
+    }
+    lock_heap(heap);
+    if (header->magic == 0) {
+        format_heap(heap);
+    }
+    const bool valid = header->magic == SHARED_MAGIC && header->size == file_size;
+    unlock_heap(heap);
+    if (!valid) {
+        mem_shared_close(heap);
+        return NULL;
+    }
+    return heap;
+}
+
+void mem_shared_close(MemSharedHeap* heap) {
+    if (heap == NULL) return;
+    munmap(heap->base, heap->size);
+    free(heap);
+}
+
+size_t mem_shared_alloc(MemSharedHeap* heap, const size_t size) {
+    if (size > heap->size) return 0;
+    size_t real_size = (size + sizeof(uint64_t) + MEM_ALIGNMENT - 1)
+            / MEM_ALIGNMENT * MEM_ALIGNMENT;
+    if (real_size < min_block_size) {
+        real_size = min_block_size;
+    }
+
+    lock_heap(heap);
+    const uint64_t offset = bin_find(heap, real_size);
+    if (offset == 0) {
+        unlock_heap(heap);
+        return 0;
+    }
+    bin_remove(heap, offset);
+    SharedFreeBlock* const block = block_at(heap, offset);
+    const uint64_t total = block_size(block);
+    if (total - real_size >= min_block_size) {
+        // the rest is set up before the block shrinks, so a walk finds
+        // either the whole free block or both parts
+        add_free_block(heap, offset + real_size, total - real_size);
+        block->header = real_size | BLOCK_PREV_IN_USE | BLOCK_IN_USE
+                | block_check(offset, real_size);
+    } else {
+        block->header |= BLOCK_IN_USE | block_check(offset, total);
+        block_at(heap, offset + total)->header |= BLOCK_PREV_IN_USE;
+    }
+    unlock_heap(heap);
+    return offset + sizeof(uint64_t);
+}
+
+void mem_shared_free(MemSharedHeap* heap, const size_t offset) {
+    if (offset < first_block + sizeof(uint64_t) || offset >= epilogue_offset(heap->size)
+            || (offset - first_block - sizeof(uint64_t)) % MEM_ALIGNMENT != 0) {
+        return;
+    }
+    uint64_t start = offset - sizeof(uint64_t);
+    lock_heap(heap);
+    SharedFreeBlock* const block = block_at(heap, start);
+    uint64_t size = block_size(block);
+    // an offset into the data of a live block is taken for a block only when
+    // the data looks like a header with the right check and size
+    if (!(block->header & BLOCK_IN_USE)
+            || (block->header & ~SIZE_MASK) != block_check(start, size)
+            || size < min_block_size || size > epilogue_offset(heap->size) - start
+            || !(block_at(heap, start + size)->header & BLOCK_PREV_IN_USE)) {
+        unlock_heap(heap);
+        return;
+    }
+    // marked free first: if this process dies, recovery merges what is left
+    block->header &= ~BLOCK_IN_USE & SIZE_MASK;
+    const uint64_t next = start + size;
+    if (!(block->header & BLOCK_PREV_IN_USE)) {
+        const uint64_t prev_size = *(uint64_t*)(heap->base + start - sizeof(uint64_t));
+        start -= prev_size;
+        bin_remove(heap, start);
+        size += prev_size;
+    }
+    if (!(block_at(heap, next)->header & BLOCK_IN_USE)) {
+        bin_remove(heap, next);
+        size += block_size(block_at(heap, next));
+    }
+    add_free_block(heap, start, size);
+    block_at(heap, start + size)->header &= ~BLOCK_PREV_IN_USE;
+    unlock_heap(heap);
+}
+
+size_t mem_shared_root(const MemSharedHeap* heap) {
+    return __atomic_load_n(&header_of(heap)->root, __ATOMIC_ACQUIRE);
+}
+
+bool mem_shared_set_root(MemSharedHeap* heap, const size_t expected, const size_t root) {
+    uint64_t seen = expected;
+    return __atomic_compare_exchange_n(&header_of(heap)->root, &seen, root, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void mem_shared_info(MemSharedHeap* heap, MemHeapInfo* info) {
+    *info = (MemHeapInfo) { .heap_bytes = heap->size };
+    lock_heap(heap);
+    for (uint64_t offset = first_block; block_size(block_at(heap, offset)) != 0;
+            offset += block_size(block_at(heap, offset))) {
+        const SharedFreeBlock* const block = block_at(heap, offset);
+        const size_t size = block_size(block);
+        if (block->header & BLOCK_IN_USE) {
+            info->used_bytes += size;
+            ++info->used_blocks;
+        } else {
+            info->free_bytes += size;
+            ++info->free_blocks;
+            if (size > info->largest_free_block) {
+                info->largest_free_block = size;
+            }
+        }
+    }
+    unlock_heap(heap);
+}
+
+static SharedHeader* header_of(const MemSharedHeap* heap) {
+    return (SharedHeader*)heap->base;
+}
+
+static SharedFreeBlock* block_at(const MemSharedHeap* heap, const uint64_t offset) {
+    return (SharedFreeBlock*)(heap->base + offset);
+}
+
+static uint64_t block_size(const SharedFreeBlock* block) {
+    return block->header & SIZE_MASK & ~BLOCK_FLAGS;
+}
+
+static uint64_t block_check(const uint64_t offset, const uint64_t size) {
+    // never 0, so a free block's header can not pass for an allocated one
+    const uint64_t mixed = (offset * 0x9e3779b97f4a7c15ULL ^ size) * 0xbf58476d1ce4e5b9ULL;
+    return (mixed >> CHECK_SHIFT | 1) << CHECK_SHIFT;
+}
+
+static uint64_t epilogue_offset(const size_t size) {
+    return first_block + (size - first_block - sizeof(uint64_t)) / MEM_ALIGNMENT * MEM_ALIGNMENT;
+}
+
+static void lock_heap(MemSharedHeap* heap) {
+    SharedHeader* const header = header_of(heap);
+    const uint64_t self = lock_owner();
+    for (unsigned spins = 1; ; ++spins) {
+        uint64_t owner = 0;
+        if (__atomic_compare_exchange_n(&header->lock, &owner, self, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // another thread of this process holds it when owner is self
+        if (spins % LOCK_CHECK_SPINS == 0 && owner != self && owner_dead(owner)
+                && __atomic_compare_exchange_n(&header->lock, &owner, self, false,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if (header->magic == SHARED_MAGIC) {
+                recover_heap(heap);
+            }
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void unlock_heap(MemSharedHeap* heap) {
+    __atomic_store_n(&header_of(heap)->lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t lock_owner(void) {
+    // a forked child finds the pid changed and reads its own start time
+    static uint64_t owner;
+    const uint64_t pid = (uint32_t)getpid();
+    uint64_t seen = __atomic_load_n(&owner, __ATOMIC_RELAXED);
+    if ((seen & UINT32_MAX) != pid) {
+        seen = pid | start_time(pid) << 32;
+        __atomic_store_n(&owner, seen, __ATOMIC_RELAXED);
+    }
+    return seen;
+}
+
+static bool owner_dead(const uint64_t owner) {
+    const pid_t pid = (pid_t)(owner & UINT32_MAX);
+    // kill would signal a process group or every process for these
+    if (pid <= 0) return true;
+    if (kill(pid, 0) != 0) return errno == ESRCH;
+    // without /proc, here or for the owner, a live pid is taken for the owner
+    const uint64_t started = start_time(pid);
+    return started != 0 && owner >> 32 != 0 && (uint32_t)started != owner >> 32;
+}
+
+static uint64_t start_time(const pid_t pid) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char text[1024];
+    const ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0) return 0;
+    text[length] = '\0';
+    // the name in parentheses may hold spaces, the fields after it do not;
+    // the start time is the 20th of them
+    const char* field = strrchr(text, ')');
+    for (int i = 0; field != NULL && i < 20; ++i) {
+        field = strchr(field + 1, ' ');
+    }
+    return field != NULL ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+static void format_heap(MemSharedHeap* heap) {
+    SharedHeader* const header = header_of(heap);
+    header->size = heap->size;
+    header->root = 0;
+    header->bin_bitmap = 0;
+    for (size_t i = 0; i < BIN_COUNT; ++i) {
+        header->bins[i] = 0;
+    }
+    const uint64_t epilogue = epilogue_offset(heap->size);
+    block_at(heap, epilogue)->header = BLOCK_IN_USE;
+    add_free_block(heap, first_block, epilogue - first_block);
+    __atomic_store_n(&header->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void recover_heap(MemSharedHeap* heap) {
+    SharedHeader* const header = header_of(heap);
+    header->bin_bitmap = 0;
+    for (size_t i = 0; i < BIN_COUNT; ++i) {
+        header->bins[i] = 0;
+    }
+    const uint64_t epilogue = epilogue_offset(heap->size);
+    uint64_t offset = first_block;
+    bool prev_in_use = true;
+    while (offset < epilogue) {
+        SharedFreeBlock* const block = block_at(heap, offset);
+        uint64_t size = block_size(block);
+        if (block->header & BLOCK_IN_USE) {
+            block->header = size | BLOCK_IN_USE | (prev_in_use ? BLOCK_PREV_IN_USE : 0)
+                    | block_check(offset, size);
+            prev_in_use = true;
+        } else {
+            // one free block up to the next allocated one
+            while (offset + size < epilogue
+                    && !(block_at(heap, offset + size)->header & BLOCK_IN_USE)) {
+                size += block_size(block_at(heap, offset + size));
+            }
+            add_free_block(heap, offset, size);
+            prev_in_use = false;
+        }
+        offset += size;
+    }
+    SharedFreeBlock* const end = block_at(heap, epilogue);
+    end->header = BLOCK_IN_USE | (prev_in_use ? BLOCK_PREV_IN_USE : 0);
+}
+
+static void add_free_block(MemSharedHeap* heap, const uint64_t offset, const uint64_t size) {
+    *(uint64_t*)(heap->base + offset + size - sizeof(uint64_t)) = size;
+    block_at(heap, offset)->header = size | BLOCK_PREV_IN_USE;
+    bin_insert(heap, offset);
+}
+
+static size_t bin_index(const uint64_t size) {
+    return 63 - __builtin_clzll(size);
+}
+
+static void bin_insert(MemSharedHeap* heap, const uint64_t offset) {
+    SharedHeader* const header = header_of(heap);
+    SharedFreeBlock* const block = block_at(heap, offset);
+    const size_t index = bin_index(block_size(block));
+    block->prev = 0;
+    block->next = header->bins[index];
+    if (block->next != 0) {
+        block_at(heap, block->next)->prev = offset;
+    }
+    header->bins[index] = offset;
+    header->bin_bitmap |= (uint64_t)1 << index;
+}
+
+static void bin_remove(MemSharedHeap* heap, const uint64_t offset) {
+    SharedHeader* const header = header_of(heap);
+    const SharedFreeBlock* const block = block_at(heap, offset);
+    const size_t index = bin_index(block_size(block));
+    if (block->prev != 0) {
+        block_at(heap, block->prev)->next = block->next;
+    } else {
+        header->bins[index] = block->next;
+        if (header->bins[index] == 0) {
+            header->bin_bitmap &= ~((uint64_t)1 << index);
+        }
+    }
+    if (block->next != 0) {
+        block_at(heap, block->next)->prev = block->prev;
+    }
+}
+
+static uint64_t bin_find(MemSharedHeap* heap, const uint64_t size) {
+    const SharedHeader* const header = header_of(heap);
+    const size_t index = bin_index(size);
+    // every block in a bin above floor(log2(size)) is big enough,
+    // unless size is an exact power of two - then its own bin fits too
+    const size_t fit_index = (size & (size - 1)) ? index + 1 : index;
+    const uint64_t fit_bins =
+            fit_index < BIN_COUNT ? header->bin_bitmap & (~(uint64_t)0 << fit_index) : 0;
+    if (fit_bins != 0) {
+        return header->bins[__builtin_ctzll(fit_bins)];
+    }
+    // only blocks of the size's own bin are left, some of them may fit
+    for (uint64_t offset = header->bins[index]; offset != 0;
+            offset = block_at(heap, offset)->next) {
+        if (block_size(block_at(heap, offset)) >= size) return offset;
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+#ifndef SHARED_HEAP_H
+#define	SHARED_HEAP_H
+
+#include "allocator.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Shared heaps: a heap which lives in a file or a memfd mapped by several
+ * processes, each at an address of its own. Blocks and free lists refer to
+ * each other by offsets from the start of the mapping, and so does the
+ * user data: mem_shared_alloc returns an offset, which mem_shared_addr
+ * turns into an address of the calling process. A heap file outlives the
+ * processes, so a restarted process maps a warm heap back at once and finds
+ * its data through the root offset.
+ *
+ * The heap has the size of the file and never grows. It is protected by a
+ * lock word in the mapping which holds the pid and the start time of the
+ * process using the heap. A process which dies holding it is found out by
+ * the others, the first one to notice takes the lock over and rebuilds the
+ * free lists from the block headers, which are updated in an order that
+ * keeps them walkable at every step. A block being allocated or freed at
+ * that time may leak. Threads of a process share its pid, so the lock works
+ * for them too.
+ *
+ * The owner is dead when its pid names no process, or one with another
+ * start time as read from /proc/<pid>/stat, so a reused pid is caught where
+ * /proc can be read. Pids only mean something within one PID namespace:
+ * all processes must share one, or a dead owner may never be found out and
+ * a live one may be taken for dead.
+ *
+ * All processes must be 64-bit builds of this file.
+ */
+
+/**
+ * Heap mapped by this process
+ */
+typedef struct MemSharedHeap {
+    /**
+     * Start of the mapping, offsets count from here
+     */
+    char* base;
+    /**
+     * Size of the mapping, which is the size of the file
+     */
+    size_t size;
+} MemSharedHeap;
+
+/**
+ * Map the heap in the file at \a path. A missing or empty file is created
+ * with \a size bytes, a file of zeros is turned into an empty heap. Any
+ * other file which does not start with the header of a heap of its size
+ * gives NULL at once, whatever its lock word holds
+ * @param path Heap file
+ * @param size Size of a new heap, ignored if the file has a size already
+ * @return Heap or NULL if the file can not be mapped or holds no heap
+ */
+MemSharedHeap* mem_shared_open(const char* path, size_t size);
+
+/**
+ * Map the heap in the file open as \a fd, like mem_shared_open. A memfd
+ * works as well, so processes which inherit it or get it through a socket
+ * share a heap which is never written to disk. \a fd may be closed after
+ * the call
+ * @param fd File open for reading and writing
+ * @param size Size of a new heap, ignored if the file has a size already
+ * @return Heap or NULL if the file can not be mapped or holds no heap
+ */
+MemSharedHeap* mem_shared_open_fd(int fd, size_t size);
+
+/**
+ * Unmap \a heap. Its data stays in the file
+ * @param heap Heap got from mem_shared_open, or NULL
+ */
+void mem_shared_close(MemSharedHeap* heap);
+
+/**
+ * Allocate \a size bytes from \a heap, aligned to MEM_ALIGNMENT
+ * @param heap Heap
+ * @param size Number of bytes needed
+ * @return Offset of the memory in the heap, 0 if out of memory
+ */
+size_t mem_shared_alloc(MemSharedHeap* heap, size_t size);
+
+/**
+ * Free memory got from mem_shared_alloc by any process. Offsets outside of
+ * the heap and of free blocks are ignored. Other offsets are told from those
+ * of allocated blocks by a check of the offset and size in the top 16 bits
+ * of the block header, so an offset into live data is ignored unless that
+ * data happens to look like a header, at worst once in 2^15 times
+ * @param heap Heap
+ * @param offset Offset of the memory, or 0
+ */
+void mem_shared_free(MemSharedHeap* heap, size_t offset);
+
+/**
+ * Offset of a block which processes find their data through. It is only
+ * stored, never freed with the heap
+ * @param heap Heap
+ * @return Root offset, 0 until one is set
+ */
+size_t mem_shared_root(const MemSharedHeap* heap);
+
+/**
+ * Replace the root offset of \a heap, if it is still \a expected. The
+ * processes racing to set up shared data this way agree on one copy
+ * @param heap Heap
+ * @param expected Root offset the caller saw
+ * @param root New root offset
+ * @return False if another process changed the root first
+ */
+bool mem_shared_set_root(MemSharedHeap* heap, size_t expected, size_t root);
+
+/**
+ * Walk \a heap and describe its layout, like mem_heap_info
+ * @param heap Heap
+ * @param info Filled with the figures, heap_bytes being the file size
+ */
+void mem_shared_info(MemSharedHeap* heap, MemHeapInfo* info);
+
+/**
+ * Address of \a offset in this process
+ * @param heap Heap
+ * @param offset Offset got from mem_shared_alloc, or 0
+ * @return Address, NULL for offset 0
+ */
+static inline void* mem_shared_addr(const MemSharedHeap* heap, const size_t offset) {
+    return offset != 0 ? heap->base + offset : NULL;
+}
+
+/**
+ * Offset of \a addr, an address inside \a heap, to be stored in the heap
+ * or passed to another process
+ * @param heap Heap
+ * @param addr Address in the mapping of \a heap, or NULL
+ * @return Offset, 0 for NULL
+ */
+static inline size_t mem_shared_offset(const MemSharedHeap* heap, const void* addr) {
+    return addr != NULL ? (size_t)((const char*)addr - heap->base) : 0;
+}
+
+#endif	/* SHARED_HEAP_H */
@@ -1,7 +1,20 @@
+#define _POSIX_C_SOURCE 200112L
+
+#ifdef MEM_HARDENED
+// the checked mem_* calls of mem_hardening.c wrap the ones defined here
+#define MEM_HARDENED_RAW_NAMES
+#include "mem_hardening.h"
+#endif
 #include "allocator.h"
+#include "mem_profile.h"
+#include "page_heap.h"
+#include "thread_cache.h"
 
-#include <math.h>
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,481 +23,927 @@ typedef struct BlockHeader {
     struct BlockHeader* next_header;
 } BlockHeader;
 
+// sits at the start of every multiblock page, so it is found by masking
+// a block address with the page size; with -DSLAB_OUTLINE_HEADERS it is kept
+// in the page heap's metadata instead, so blocks never share a cache line
+// with it, at the price of a chunk lookup to find it
 typedef struct MultiBlockPageHeader {
-    BlockHeader* next_free_block;
-    size_t block_size;
+    // blocks freed by the user, reused first
+    BlockHeader* free_blocks;
+    // start of the part of the page which was never handed out
+    void* unused_space;
+    unsigned int live_blocks;
+    // index in classes, which has the classes of every node pool in turn
+    unsigned int class_index;
+    // neighbours in the partial or full page list of the page's class
+    struct MultiBlockPageHeader* prev_page;
+    struct MultiBlockPageHeader* next_page;
+#ifdef SLAB_OUTLINE_HEADERS
+    void* page;
+#endif
 } MultiBlockPageHeader;
 
-typedef struct ClassItem {
-    struct ClassItem* next;
-    MultiBlockPageHeader* first_block_header;
-} ClassItem;
-
 typedef struct BlockClass {
     size_t block_size;
-    struct BlockClass* next;
-    ClassItem* first_item;
+    // where the first block of a page starts, so the data of every block is
+    // aligned to the block size
+    size_t first_block_offset;
+    // pages of the class which still have free blocks
+    MultiBlockPageHeader* partial_pages;
+    // pages with every block in use
+    MultiBlockPageHeader* full_pages;
+    // for heap statistics: pages of the class and blocks handed out from them
+    size_t pages;
+    size_t live_blocks;
 } BlockClass;
 
-static void mem_init();
-static int find_page_sequence(size_t pages_needed);
-static void* create_multiblock_page(size_t block_size);
-void* alloc_pages(int pages_number);
+static bool mem_init(size_t page_count, bool growable);
+static MultiBlockPageHeader* create_multiblock_page(size_t class_index);
 void* alloc_multiblock(size_t size);
-static void delete_block(MultiBlockPageHeader* page_header, void* addr);
+static void free_block(void* addr);
+static void free_chain(MultiBlockPageHeader* page_header, BlockHeader* first,
+                       BlockHeader* last, unsigned int count);
+static MultiBlockPageHeader* page_header_of(void* addr);
+static void* page_start(const MultiBlockPageHeader* page_header);
+static bool is_block(void* addr);
+static size_t run_offset_of(void* addr);
+static void* start_run(void* run, size_t offset);
+static bool is_page_full(const MultiBlockPageHeader* page_header);
 static size_t align_size(size_t size);
+static size_t class_index(size_t size);
+static size_t local_class_index(size_t size);
+static void push_page(MultiBlockPageHeader** list, MultiBlockPageHeader* page_header);
+static void unlink_page(MultiBlockPageHeader** list, MultiBlockPageHeader* page_header);
+static void dump_page(size_t page_number, void* page, size_t run_length, bool is_free);
+static void dump_multiblock_page(MultiBlockPageHeader* header);
 static bool address_out_of_range(void* addr);
 bool should_use_multiblock(size_t size);
+static void* alloc_unsampled(size_t size);
+static void* alloc_sampled(size_t size, size_t alignment) __attribute__((noinline));
+static uint32_t take_sample(void* addr, size_t* size);
+static size_t alloc_batch(size_t size, size_t count, void** out);
 
 // 0x20000000 = 0.5 GiB  0x64000 - 100 pages
-static const size_t buffer_size = 0xa000;
-static const size_t page_size = 0x1000; // 4096 bytes
-static const size_t page_count = buffer_size / page_size;
+#ifndef SLAB_BUFFER_SIZE
+#define SLAB_BUFFER_SIZE 0xa000
+#endif
+// smallest block has to hold a BlockHeader
+#define MIN_CLASS_SHIFT 3
+
+// with -DSLAB_CACHE_LINE_BLOCKS the data of blocks of a cache line and more
+// starts on a cache line, so no two of them share one
+#ifdef SLAB_CACHE_LINE_BLOCKS
+#define BLOCK_ALIGNMENT 64
+#else
+#define BLOCK_ALIGNMENT MEM_ALIGNMENT
+#endif
+
+#ifdef SLAB_OUTLINE_HEADERS
+#define INLINE_HEADER_SIZE 0
+#else
+#define INLINE_HEADER_SIZE sizeof(MultiBlockPageHeader)
+#endif
+
+static const size_t page_size = SLAB_PAGE_SIZE;
+// a buffer smaller than a page still gets one
+enum { page_count = (SLAB_BUFFER_SIZE + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE };
+// power-of-two block sizes from 1 << MIN_CLASS_SHIFT up to half a page
+enum { class_count = SLAB_PAGE_SHIFT - MIN_CLASS_SHIFT };
+
+// blocks of a page start after its header, padded so blocks of 16 bytes and
+// more (and the data after a thread cache tag) are BLOCK_ALIGNMENT aligned;
+// classes of bigger blocks start further, see BlockClass
+static const size_t first_block_offset =
+        (INLINE_HEADER_SIZE + TC_TAG_SIZE + BLOCK_ALIGNMENT - 1)
+        / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT - TC_TAG_SIZE;
+// page runs are handed out this far into their first page, for the same
+// reason, aligned runs further; with inline headers single-threaded blocks
+// never start there, so runs are told apart from blocks by the offset of
+// their address in the page
+static const size_t run_offset = (MEM_ALIGNMENT - TC_TAG_SIZE) % MEM_ALIGNMENT;
+
+#if defined(MEM_THREAD_SAFE) && !defined(SLAB_OUTLINE_HEADERS)
+// first word of the first page of a run in the thread-safe build, which
+// block pages hold a pointer in; its tag may then sit anywhere in the page
+#define RUN_MARK ((uintptr_t)1)
+#endif
+
+// the classes of each node's page pool, so threads take blocks from pages
+// of their own node
+static BlockClass classes[SLAB_MAX_NODES * class_count];
+static MemNumaPolicy numa_policy = MEM_NUMA_LOCAL;
+
+#ifdef MEM_THREAD_SAFE
+// protects everything above, thread caches take it once per batch
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+bool mem_init(size_t page_count, bool growable) {
+    if (page_heap_is_initialized()) {
+        return false;
+    }
 
-static BlockClass* first_class = NULL;
-static bool is_initialized_memory = false;
-static void** pages[page_count];
-static void* memory_start;
+    for (int i = 0; i < SLAB_MAX_NODES * class_count; ++i) {
+        classes[i].block_size = (size_t)1 << (i % class_count + MIN_CLASS_SHIFT);
+        size_t alignment = classes[i].block_size > BLOCK_ALIGNMENT
+                ? classes[i].block_size : BLOCK_ALIGNMENT;
+        classes[i].first_block_offset = (INLINE_HEADER_SIZE + TC_TAG_SIZE + alignment - 1)
+                / alignment * alignment - TC_TAG_SIZE;
+        classes[i].partial_pages = NULL;
+        classes[i].full_pages = NULL;
+        classes[i].pages = 0;
+        classes[i].live_blocks = 0;
+    }
+
+    // pages are page aligned, so page headers are found by masking block addresses
+    return page_heap_init(page_count, growable, numa_policy == MEM_NUMA_INTERLEAVE);
+}
 
-void mem_init() {
-    if (!is_initialized_memory) {
-        is_initialized_memory = true;
-        memory_start = (void**) malloc(buffer_size);
+bool mem_init_growable(size_t chunk_size) {
+    central_lock();
+    bool result = mem_init((chunk_size + page_size - 1) / page_size, true);
+    central_unlock();
+    return result;
+}
+
+// the object caches of mem_cache.c take their slabs from the page heap
+// directly, with the heap lock held
+void central_init_default() {
+    if (!page_heap_is_initialized()) {
+        mem_init(page_count, false);
     }
 }
 
+bool mem_set_numa_policy(MemNumaPolicy policy) {
+    central_lock();
+    bool result = !page_heap_is_initialized();
+
+    if (result) {
+        numa_policy = policy;
+    }
+
+    central_unlock();
+    return result;
+}
+
+void mem_set_decay(long decay_ms) {
+    central_lock();
+    page_heap_set_decay(decay_ms);
+    central_unlock();
+}
+
+size_t mem_trim() {
+#ifdef MEM_THREAD_SAFE
+    tc_flush();
+#endif
+    central_lock();
+    size_t released = central_trim();
+    central_unlock();
+    return released;
+}
+
+bool mem_set_paging(const char* swap_path, size_t resident_pages, long window_ms) {
+    // the fault handler thread is made without the heap lock, making it may
+    // allocate
+    if (!page_heap_start_paging(swap_path)) {
+        return false;
+    }
+
+    central_lock();
+    bool result = page_heap_set_paging(resident_pages, window_ms);
+    central_unlock();
+    return result;
+}
+
+void mem_paging_stats(MemPagingStats* stats) {
+    central_lock();
+    page_heap_paging_usage(&stats->faults, &stats->evictions, &stats->write_backs,
+            &stats->resident_pages, &stats->swapped_pages);
+    central_unlock();
+}
+
 void* mem_alloc(size_t size) {
-    size_t real_size = align_size(size);
+    uint64_t start = stats_sample_start();
+    void* addr = profile_count(size) ? alloc_sampled(size, 0) : alloc_unsampled(size);
 
-    if (!is_initialized_memory) {
-        mem_init();
+    if (start != 0) {
+        stats_sample_alloc(start);
     }
-    if (memory_start == NULL) {
+
+    return addr;
+}
+
+void* alloc_unsampled(size_t size) {
+#ifdef MEM_THREAD_SAFE
+    return tc_alloc(size);
+#else
+    void* addr = central_alloc(size);
+
+    if (addr != NULL) {
+        stats_count_alloc(central_usable_size(addr));
+    }
+
+    return addr;
+#endif
+}
+
+// sampled allocations are served like the others, from their class or the
+// thread cache; the profiler keeps their addresses aside. alignment is 0
+// for mem_alloc
+void* alloc_sampled(size_t size, size_t alignment) {
+    void* addr;
+
+    if (alignment == 0) {
+        addr = alloc_unsampled(size);
+    } else {
+#ifdef MEM_THREAD_SAFE
+        addr = tc_alloc_aligned(size, alignment);
+#else
+        if ((addr = central_alloc_aligned(size, alignment)) != NULL) {
+            stats_count_alloc(central_usable_size(addr));
+        }
+#endif
+    }
+
+    if (addr != NULL) {
+        profile_record(addr, size);
+    }
+
+    return addr;
+}
+
+// the filter rules out most addresses before profile_take takes a lock
+uint32_t take_sample(void* addr, size_t* size) {
+    return profile_may_have(addr) ? profile_take(addr, size) : 0;
+}
+
+void* mem_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
         return NULL;
     }
 
-    if (should_use_multiblock(real_size)) {
-        return alloc_multiblock(real_size);
+    uint64_t start = stats_sample_start();
+#ifdef MEM_THREAD_SAFE
+    void* addr = profile_count(size) ? alloc_sampled(size, alignment)
+            : tc_alloc_aligned(size, alignment);
+#else
+    void* addr;
+
+    if (profile_count(size)) {
+        addr = alloc_sampled(size, alignment);
+    } else if ((addr = central_alloc_aligned(size, alignment)) != NULL) {
+        stats_count_alloc(central_usable_size(addr));
+    }
+#endif
+
+    if (start != 0) {
+        stats_sample_alloc(start);
+    }
+
+    return addr;
+}
+
+void* central_alloc(size_t size) {
+    if (!page_heap_is_initialized()) {
+        mem_init(page_count, false);
+    }
+
+    if (should_use_multiblock(size)) {
+        return alloc_multiblock(align_size(size));
+    } else if (size > SIZE_MAX - page_size - run_offset) {
+        return NULL;
     } else {
-        size_t pages_needed = (size_t) ceil((double)size / (double)page_size);
-        return alloc_pages(pages_needed);
+        size_t pages_needed = (size + run_offset + page_size - 1) / page_size;
+        return start_run(alloc_page_run(pages_needed), run_offset);
+    }
+}
+
+void* central_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment <= MEM_ALIGNMENT) {
+        return central_alloc(size);
+    }
+
+    if (!page_heap_is_initialized()) {
+        mem_init(page_count, false);
+    }
+
+    // a class at least as big as the alignment has its blocks aligned
+    if (should_use_multiblock(size > alignment ? size : alignment)) {
+        return alloc_multiblock(align_size(size > alignment ? size : alignment));
+    }
+
+    // runs start on a page, their tag (if any) goes at the end of the part
+    // of the first page in front of the alignment, or at the end of the
+    // whole first page for alignments beyond it
+    size_t unit = alignment < page_size ? alignment : page_size;
+    size_t offset = (unit - TC_TAG_SIZE) % unit;
+
+    if (size > SIZE_MAX - page_size - offset || alignment > SIZE_MAX / 2) {
+        return NULL;
     }
+
+    // a byte after the tag at least, so even an empty run has its own address
+    size_t needed = size > TC_TAG_SIZE ? size : TC_TAG_SIZE + 1;
+    size_t pages_needed = (needed + offset + page_size - 1) / page_size;
+    void* run = alignment <= page_size ? alloc_page_run(pages_needed)
+            : alloc_page_run_aligned(pages_needed, alignment, offset + TC_TAG_SIZE);
+    return start_run(run, offset);
 }
 
 void* mem_realloc(void* addr, size_t size) {
+    stats_count_realloc();
+
+    if (addr == NULL) {
+        return mem_alloc(size);
+    }
+
+#ifndef MEM_THREAD_SAFE
     if (address_out_of_range(addr)) {
         return NULL;
     }
+#endif
 
-    void* new_addr = mem_alloc(size);
+    // to the profile a reallocation frees the block and allocates the new
+    // size, which the countdown may pick
+    if (profile_count(size)) {
+        void* new_addr = alloc_sampled(size, 0);
+
+        if (new_addr != NULL) {
+            size_t old_size = mem_usable_size(addr);
+            mem_copy(new_addr, addr, old_size < size ? old_size : size);
+            mem_free(addr);
+        }
 
-    if (new_addr) {
-        mem_copy(new_addr, addr, size);
-        mem_free(addr);
         return new_addr;
-    } else {
-        return NULL;
     }
-}
 
-void mem_copy(void* to_void, const void* from_void, const size_t bytes) {
-    // Duff's copying device
-    const char* from = from_void;
-    char* to = to_void;
-    size_t n = (bytes + 7) / 8;;
-    switch (bytes % 8) {
-    case 0: do {    *to = *from++;
-    case 7:         *to = *from++;
-    case 6:         *to = *from++;
-    case 5:         *to = *from++;
-    case 4:         *to = *from++;
-    case 3:         *to = *from++;
-    case 2:         *to = *from++;
-    case 1:         *to = *from++;
-            } while(--n > 0);
+    size_t sample_size = 0;
+    uint32_t sample = take_sample(addr, &sample_size);
+#ifdef MEM_THREAD_SAFE
+    void* new_addr = tc_realloc(addr, size);
+#else
+    size_t old_size = central_usable_size(addr);
+    void* new_addr = addr;
+
+    if (central_resize(addr, size)) {
+        stats_count_resize(old_size, central_usable_size(addr));
+    } else if ((new_addr = alloc_unsampled(size)) != NULL) {
+        mem_copy(new_addr, addr, old_size < size ? old_size : size);
+        mem_free(addr);
     }
+#endif
+
+    if (new_addr == NULL) {
+        profile_put(addr, sample_size, sample);
+    }
+
+    return new_addr;
 }
 
 void mem_free(void* addr) {
-    //address is out of memory bounds
-    if (address_out_of_range(addr)) {
+    uint64_t start = stats_sample_start();
+    size_t sample_size;
+    take_sample(addr, &sample_size);
+#ifdef MEM_THREAD_SAFE
+    tc_free(addr);
+#else
+    if (!address_out_of_range(addr)) {
+        stats_count_free(central_usable_size(addr));
+    }
+
+    central_free(addr);
+#endif
+
+    if (start != 0) {
+        stats_sample_free(start);
+    }
+}
+
+void mem_free_sized(void* addr, size_t size) {
+#ifdef MEM_THREAD_SAFE
+    // the tag tells the class and the owner, the size adds nothing
+    (void)size;
+    mem_free(addr);
+#else
+    if (addr == NULL || !should_use_multiblock(size)) {
+        mem_free(addr);
         return;
     }
 
-    size_t space_distance = (size_t)addr - (size_t)memory_start;
-    int page_index = space_distance / page_size;
-    bool is_block_page = true;
+    uint64_t start = stats_sample_start();
+    size_t sample_size;
+    take_sample(addr, &sample_size);
+    // small sizes always get a block, so addr is in a page of blocks and the
+    // range check of central_free is not needed; the page header has the
+    // class, which may be bigger than size's if addr was shrunk in place
+    stats_count_free(classes[page_header_of(addr)->class_index].block_size);
+    free_block(addr);
+
+    if (start != 0) {
+        stats_sample_free(start);
+    }
+#endif
+}
 
-    // page is a block page only if address points not to the start of a new page
-    if (space_distance % page_size == 0) {
-        is_block_page = false;
+void* mem_realloc_sized(void* addr, size_t old_size, size_t new_size) {
+#ifndef MEM_THREAD_SAFE
+    if (addr != NULL && should_use_multiblock(old_size)
+            && new_size <= align_size(old_size)) {
+        // still fits the block
+        stats_count_realloc();
+        return addr;
     }
+#endif
+    (void)old_size;
+    return mem_realloc(addr, new_size);
+}
 
-    if (is_block_page) {
-        // delete one block from the (pageIndex+1)-th page
-        MultiBlockPageHeader* page_header = (MultiBlockPageHeader*) pages[page_index];
-        size_t block_size = page_header->block_size;
-        BlockClass* class_node;                                // classNode
-        BlockClass* prev_class_node = NULL;
+size_t mem_alloc_batch(size_t size, size_t count, void** out) {
+    // the countdown picks one block of a batch at most, the last
+    if (count != 0 && size <= SIZE_MAX / count && profile_count(size * count)) {
+        size_t done = alloc_batch(size, count - 1, out);
 
-        // try to find a class, where the block belongs to
-        for (class_node = first_class; class_node != NULL; class_node = class_node->next) {
-            if (class_node->block_size == block_size) {
-                break;
-            }
+        if (done == count - 1 && (out[done] = alloc_sampled(size, 0)) != NULL) {
+            ++done;
+        }
 
-            prev_class_node = class_node;
+        return done;
+    }
+
+    return alloc_batch(size, count, out);
+}
+
+size_t alloc_batch(size_t size, size_t count, void** out) {
+#ifdef MEM_THREAD_SAFE
+    return tc_alloc_batch(size, count, out);
+#else
+    size_t done = central_alloc_batch(size, count, out);
+
+    if (done != 0) {
+        // the blocks of a batch are all the same size
+        size_t usable_size = central_usable_size(out[0]);
+
+        for (size_t i = 0; i < done; ++i) {
+            stats_count_alloc(usable_size);
         }
+    }
 
-        // no class for the block found, which means that new class needed
-        if (class_node == NULL) {
-            BlockClass* new_class_node = malloc(sizeof(BlockClass));
-            new_class_node->block_size = block_size;
-            new_class_node->next = NULL;
-            ClassItem* new_class_item = malloc(sizeof(ClassItem));
-            new_class_item->first_block_header = page_header;
-            new_class_item->next = NULL;
-            new_class_node->first_item = new_class_item;
-
-            if (first_class == NULL) {
-                // no classes exist
-                first_class = new_class_node;
-            } else {
-                prev_class_node->next = new_class_node;
-            }
+    return done;
+#endif
+}
 
-            // delete the block
-            delete_block(page_header, addr);
-        } else {
-            bool one_block_on_page = false;
-            size_t used_space = (size_t)page_header->next_free_block
-                               - (size_t)page_header - sizeof(MultiBlockPageHeader);
-
-            for (BlockHeader* b_header = page_header->next_free_block;
-                     b_header->next_header != NULL;
-                     b_header = b_header->next_header) {
-                used_space += (size_t)b_header->next_header - (size_t)b_header;
-            }
+void mem_free_batch(void** addrs, size_t count) {
+    size_t sample_size;
 
-            if (used_space == block_size) {
-                one_block_on_page = true;
-            }
+    for (size_t i = 0; profile_live_samples != 0 && i < count; ++i) {
+        take_sample(addrs[i], &sample_size);
+    }
 
-            if (one_block_on_page) {
-                // only one block in the page
-                pages[page_index] = NULL; // mark the page as free
-                ClassItem* cur_class_item;
-                ClassItem* prev_class_item = NULL;
-
-                // seek for a class item, the block belongs to
-                for (cur_class_item = class_node->first_item
-                                    ; cur_class_item->next != NULL
-                        ; cur_class_item = cur_class_item->next) {
-                    if (cur_class_item->first_block_header == page_header) {
-                        break;
-                    }
-
-                    prev_class_item = cur_class_item;
-                }
-
-                // delete class item of the block
-                if (prev_class_item) {
-                    prev_class_item->next = cur_class_item->next;
-                } else {
-                    class_node->first_item = NULL;        // class has no items
-
-                    // at least two classes exist
-                    if (prev_class_node) {
-                        prev_class_node->next = class_node->next;
-                    }
-                    // only one class exists
-                    else {
-                        first_class = NULL;
-                    }
-                }
-            } else {
-                // delete the block, create new header if needed
-                delete_block(page_header, addr);
-            }
+#ifdef MEM_THREAD_SAFE
+    tc_free_batch(addrs, count);
+#else
+    for (size_t i = 0; i < count; ++i) {
+        if (!address_out_of_range(addrs[i])) {
+            stats_count_free(central_usable_size(addrs[i]));
         }
-    } else {
-        // delete all pages, given to user as one virtual page
-        for (int i = page_index + 1;
-                i < page_count && pages[page_index] == pages[i]; ++i) {
-            pages[i] = NULL;
+    }
+
+    central_free_batch(addrs, count);
+#endif
+}
+
+size_t mem_usable_size(void* addr) {
+#ifdef MEM_THREAD_SAFE
+    return addr != NULL ? tc_usable_size(addr) : 0;
+#else
+    return address_out_of_range(addr) ? 0 : central_usable_size(addr);
+#endif
+}
+
+size_t central_usable_size(void* addr) {
+    if (is_block(addr)) {
+        return classes[page_header_of(addr)->class_index].block_size;
+    }
+
+    size_t offset = run_offset_of(addr);
+    return page_run_length((void*)((size_t)addr - offset)) * page_size - offset;
+}
+
+bool central_resize(void* addr, size_t size) {
+    if (is_block(addr)) {
+        // blocks keep their class
+        return size <= classes[page_header_of(addr)->class_index].block_size;
+    }
+
+    size_t offset = run_offset_of(addr);
+
+    if (should_use_multiblock(size) || size > SIZE_MAX - page_size - offset) {
+        return false;
+    }
+
+    // runs grow into the free pages which follow them
+    return resize_page_run((void*)((size_t)addr - offset),
+            (size + offset + page_size - 1) / page_size);
+}
+
+void central_stats(MemStats* stats) {
+    size_t free_page_count;
+    page_heap_usage(&stats->bytes_mapped, &stats->pages_mapped, &free_page_count);
+    stats->page_size = page_size;
+    stats->pages_in_use = stats->pages_mapped - free_page_count;
+    stats->bytes_free = free_page_count * page_size;
+
+    for (int i = 0; i < class_count; ++i) {
+        // slab classes are the power-of-two statistics classes, summed over
+        // the node pools
+        MemClassStats* class_stats = &stats->classes[i];
+        size_t blocks_per_page = (page_size - classes[i].first_block_offset)
+                / classes[i].block_size;
+        size_t pages = 0;
+        size_t live_blocks = 0;
+
+        for (size_t node = 0; node < page_heap_node_count(); ++node) {
+            pages += classes[node * class_count + i].pages;
+            live_blocks += classes[node * class_count + i].live_blocks;
         }
 
-        pages[page_index] = NULL;
+        class_stats->pages = pages;
+        class_stats->page_blocks = pages * blocks_per_page;
+        class_stats->free_blocks = class_stats->page_blocks - live_blocks;
+        stats->bytes_free += class_stats->free_blocks * classes[i].block_size;
     }
 }
 
-void mem_dump() {
-    for (int page_number = 0; page_number < page_count; ++page_number) {
-        printf("Page #%d", page_number);
-
-        if (pages[page_number] == NULL) {
-            printf(": unused\n");
-        } else {
-            bool is_divided = false;
-
-            for (BlockClass* node = first_class; node != NULL; node = node->next) {
-                for (ClassItem* item = node->first_item; item != NULL; item = item->next) {
-                    // page consists of blocks
-                    if ((void*)(item->first_block_header) == pages[page_number]) {
-                        is_divided = true;
-                        break;
-                    }
-                }
-                if (is_divided) {
-                    break;
-                }
-            }
+size_t central_trim(void) {
+    return page_heap_trim();
+}
 
-            if (!is_divided) {
-                printf(": used (part of a multipage memory block)\n");
-                continue;
-            }
+void central_lock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&heap_lock);
+#endif
+}
 
-            printf(": multiblock");
-            size_t free_space = 0;
-            int block_number = 0;
-            MultiBlockPageHeader* header = (MultiBlockPageHeader*)pages[page_number];
-            BlockHeader* block_header;
-            BlockHeader* prev_block_header = (BlockHeader*)
-                    ((size_t)header + sizeof(MultiBlockPageHeader));
-            printf(", block size: %lu\n", (unsigned long) header->block_size);
-
-            for (block_header = header->next_free_block; block_header != NULL;
-                    block_header = block_header->next_header) {
-                size_t used_space = sizeof(BlockHeader*) *
-                        (size_t)(block_header - prev_block_header);
-                unsigned long block_sz = (unsigned long) header->block_size;
-                if (used_space) {
-                    if (block_header != header->next_free_block) {
-                        used_space -= header->block_size;
-                    }
-
-                    int blocks_count = used_space / header->block_size;
-
-                    for (int block = 0; block <  blocks_count; ++block) {
-                        printf("    block #%d (%lu-%lu): used\n", block_number,
-                                block_number * block_sz + sizeof(MultiBlockPageHeader),
-                                (block_number + 1) * block_sz + sizeof(MultiBlockPageHeader));
-                        ++block_number;
-                    }
-                } else {
-                    free_space += header->block_size;
-                }
-
-                if (block_header->next_header != NULL) {
-                    printf("    block #%d (%lu-%lu): free\n", block_number,
-                            block_number * block_sz + sizeof(MultiBlockPageHeader),
-                            (block_number + 1) * block_sz + sizeof(MultiBlockPageHeader));
-                }
-
-                block_number++;
-                prev_block_header = block_header;
-            }
+void central_unlock(void) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+size_t central_alloc_batch(size_t size, size_t count, void** out) {
+    if (!should_use_multiblock(size)) {
+        size_t done = 0;
+
+        while (done < count && (out[done] = central_alloc(size)) != NULL) {
+            ++done;
+        }
+
+        return done;
+    }
+
+    if (!page_heap_is_initialized()) {
+        mem_init(page_count, false);
+    }
 
-            free_space += (size_t)header + page_size - (size_t)prev_block_header;
+    size_t real_size = align_size(size);
+    size_t index = local_class_index(real_size);
+    BlockClass* block_class = &classes[index];
+    size_t done = 0;
 
-            if (free_space != 0) {
-                printf("    free space available: %5lu\n", (unsigned long) free_space);
+    while (done < count) {
+        MultiBlockPageHeader* page_header = block_class->partial_pages;
+
+        if (page_header == NULL) {
+            page_header = create_multiblock_page(index);
+
+            if (page_header == NULL) {
+                break;
             }
+
+            push_page(&block_class->partial_pages, page_header);
+        }
+
+        // as many blocks as the page has, free ones first, then never used ones
+        size_t taken = 0;
+        BlockHeader* free_blocks = page_header->free_blocks;
+
+        for (; free_blocks != NULL && done + taken < count; ++taken) {
+            out[done + taken] = free_blocks;
+            free_blocks = free_blocks->next_header;
+        }
+
+        page_header->free_blocks = free_blocks;
+        size_t unused_space = (size_t)page_header->unused_space;
+        size_t page_end = (size_t)page_start(page_header) + page_size;
+
+        for (; unused_space + real_size <= page_end && done + taken < count; ++taken) {
+            out[done + taken] = (void*)unused_space;
+            unused_space += real_size;
+        }
+
+        page_header->unused_space = (void*)unused_space;
+        page_header->live_blocks += taken;
+        block_class->live_blocks += taken;
+        done += taken;
+
+        if (is_page_full(page_header)) {
+            unlink_page(&block_class->partial_pages, page_header);
+            push_page(&block_class->full_pages, page_header);
         }
     }
 
-    printf("\n");
+    return done;
 }
 
-int find_page_sequence(size_t pages_needed) {
-    int free_counter = 0;
-    int first_free_page_index = 0;
+void central_free_batch(void** addrs, size_t count) {
+    size_t i = 0;
 
-    for (int i = 0; i < page_count; ++i) {
-        if (pages[i] == NULL) {
-            free_counter++;
-        } else {
-            free_counter = 0;
-            first_free_page_index = i + 1;
+    while (i < count) {
+        void* addr = addrs[i++];
+
+        if (address_out_of_range(addr) || !is_block(addr)) {
+            central_free(addr);
+            continue;
         }
 
-        if (free_counter == pages_needed) {
-            return first_free_page_index;
+        // chain the blocks of the same page which follow, then give them
+        // back to the page at once
+        MultiBlockPageHeader* page_header = page_header_of(addr);
+        BlockHeader* first = addr;
+        BlockHeader* last = first;
+        unsigned int chained = 1;
+
+        for (; i < count && addrs[i] != NULL && page_header_of(addrs[i]) == page_header
+                && is_block(addrs[i]); ++i) {
+            last->next_header = addrs[i];
+            last = addrs[i];
+            ++chained;
         }
+
+        free_chain(page_header, first, last, chained);
+    }
+}
+
+void central_free(void* addr) {
+    //address is out of memory bounds
+    if (address_out_of_range(addr)) {
+        return;
+    }
+
+    // page is a block page only if address points not to the start of a run
+    if (is_block(addr)) {
+        free_block(addr);
+    } else {
+        // delete all pages, given to user as one virtual page
+        free_pages((void*)((size_t)addr - run_offset_of(addr)));
     }
-    return -1;
 }
 
-void* create_multiblock_page(size_t block_size) {
-    int free_page_index = find_page_sequence(1); // seek for 1 free page
+void mem_dump() {
+    central_lock();
+    visit_pages(dump_page);
+    printf("\n");
+    central_unlock();
+}
+
+MultiBlockPageHeader* create_multiblock_page(size_t class_index) {
+    void* start_address = alloc_block_page();
 
-    if (free_page_index == -1) {
+    if (start_address == NULL) {
         return NULL;
     }
 
-    // calculate address of a new page
-    void* start_address = (void*) ((size_t)memory_start + free_page_index * page_size);
-    pages[free_page_index] = (void**)start_address; // mark page as used
     // operations with page header
-    MultiBlockPageHeader* page_header = (MultiBlockPageHeader*)start_address;
-    page_header->block_size = block_size;
-    // next free header
-    BlockHeader* free_header = (BlockHeader*)
-            ((size_t)start_address + sizeof(MultiBlockPageHeader) + block_size);
-    page_header->next_free_block = free_header;
-    free_header->next_header = NULL;
-    return start_address;
+    MultiBlockPageHeader* page_header = page_header_of(start_address);
+#ifdef SLAB_OUTLINE_HEADERS
+    page_header->page = start_address;
+#endif
+    page_header->free_blocks = NULL;
+    page_header->unused_space =
+            (void*)((size_t)start_address + classes[class_index].first_block_offset);
+    page_header->live_blocks = 0;
+    page_header->class_index = class_index;
+    ++classes[class_index].pages;
+    return page_header;
 }
 
 void* alloc_multiblock(size_t real_size) {
-    MultiBlockPageHeader* block_header = NULL; // block with a free space is available
-    BlockClass* node = first_class;
-    BlockClass* prev_node = NULL;
-
-    while (node != NULL) {
-        if (node->block_size == real_size) {
-            block_header = node->first_item->first_block_header;
-            break;
-        }
-        prev_node = node;
-        node = node->next;
-    }
+    size_t index = local_class_index(real_size);
+    BlockClass* block_class = &classes[index];
+    // page with a free space is available
+    MultiBlockPageHeader* page_header = block_class->partial_pages;
 
-    if (node == NULL) {
-        if (first_class == NULL) {
-            first_class = malloc(sizeof(BlockClass));
-            ClassItem* first_item = malloc(sizeof(ClassItem));
-            first_item->next = NULL;
-            first_class->first_item = first_item;
-            void* start_address = create_multiblock_page(real_size);
+    if (page_header == NULL) {
+        page_header = create_multiblock_page(index);
 
-            if (start_address == NULL) {
-                return NULL;    // no pages available
-            }
+        if (page_header == NULL) {
+            return NULL;    // no pages available
+        }
 
-            first_class->block_size = real_size;
-            first_class->next = NULL;
-            first_class->first_item->first_block_header = (MultiBlockPageHeader*)start_address;
-            return (void*)((size_t)start_address + sizeof(MultiBlockPageHeader));
-        } else {
-            // at least one class exist,
-            // but no class with needed block size
-            node = malloc(sizeof(BlockClass));
-            ClassItem* first_item = malloc(sizeof(ClassItem));
-            first_item->next = NULL;
-            node->first_item = first_item;
-            prev_node->next = node;
-            void* start_address = create_multiblock_page(real_size);
-
-            if (start_address == NULL) {
-                // no pages available
-                return NULL;
-            }
+        push_page(&block_class->partial_pages, page_header);
+    }
 
-            node->block_size = real_size;
-            node->next = NULL;
-            node->first_item->first_block_header = (MultiBlockPageHeader*)start_address;
-            return (void*)((size_t)start_address + sizeof(MultiBlockPageHeader));
-        }
+    void* block;
+
+    if (page_header->free_blocks != NULL) {
+        block = page_header->free_blocks;
+        page_header->free_blocks = page_header->free_blocks->next_header;
     } else {
-        // class found
-        BlockHeader* free_block = block_header->next_free_block;
+        block = page_header->unused_space;
+        page_header->unused_space = (void*)((size_t)block + real_size);
+    }
 
-        if (free_block == NULL) {
-            return NULL;
-        }
+    ++page_header->live_blocks;
+    ++block_class->live_blocks;
 
-        if (free_block->next_header == NULL) {
-            BlockHeader* temp = (BlockHeader*) ((size_t)block_header->next_free_block + real_size);
-            block_header->next_free_block = temp;
-            temp->next_header = NULL;
-        } else {
-            block_header->next_free_block = free_block->next_header;
-        }
+    // no more space in the page after block adding
+    if (is_page_full(page_header)) {
+        unlink_page(&block_class->partial_pages, page_header);
+        push_page(&block_class->full_pages, page_header);
+    }
 
-        // no more space in the page after block adding
-        if ((size_t)block_header + page_size - (size_t)free_block - real_size < real_size) {
-            ClassItem* prev_item = NULL;
+    return block;
+}
 
-            // delete block header from its item in the class
-            for (ClassItem* item = node->first_item; item != NULL; item = item->next) {
-                if (item->first_block_header == block_header) {
-                    if (prev_item == NULL) {
-                        node->first_item = item->next;
-                    } else {
-                        prev_item->next = item->next;
-                    }
+void free_block(void* addr) {
+    free_chain(page_header_of(addr), addr, addr, 1);
+}
 
-                    break;
-                }
+// first to last are count blocks of the page linked through next_header
+void free_chain(MultiBlockPageHeader* page_header, BlockHeader* first,
+                BlockHeader* last, unsigned int count) {
+    BlockClass* block_class = &classes[page_header->class_index];
 
-                prev_item = item;
-            }
+    if (is_page_full(page_header)) {
+        // the page has a free block again
+        unlink_page(&block_class->full_pages, page_header);
+        push_page(&block_class->partial_pages, page_header);
+    }
 
-            if (node->first_item == NULL) {
-                if (prev_node == NULL) {
-                    first_class = NULL;
-                } else {
-                    prev_node->next = node->next;
-                }
-            }
-        }
+    block_class->live_blocks -= count;
+    page_header->live_blocks -= count;
 
-        return free_block;
+    if (page_header->live_blocks == 0) {
+        // last blocks of the page, give the page back
+        unlink_page(&block_class->partial_pages, page_header);
+        --block_class->pages;
+        free_pages(page_header);
+        return;
     }
+
+    last->next_header = page_header->free_blocks;
+    page_header->free_blocks = first;
+}
+
+MultiBlockPageHeader* page_header_of(void* addr) {
+#ifdef SLAB_OUTLINE_HEADERS
+    return page_metadata(addr);
+#else
+    return (MultiBlockPageHeader*)((size_t)addr & ~(page_size - 1));
+#endif
+}
+
+void* page_start(const MultiBlockPageHeader* page_header) {
+#ifdef SLAB_OUTLINE_HEADERS
+    return page_header->page;
+#else
+    return (void*)page_header;
+#endif
+}
+
+// addr is in the heap; false if it is the start of a run
+bool is_block(void* addr) {
+#if defined(SLAB_OUTLINE_HEADERS)
+    // blocks may start at run_offset too
+    return page_run_length(addr) == 0;
+#elif defined(RUN_MARK)
+    return *(uintptr_t*)((size_t)addr & ~(page_size - 1)) != RUN_MARK;
+#else
+    return (size_t)addr % page_size != run_offset;
+#endif
 }
 
-void* alloc_pages(int pages_number) {
-    int first_free_page = find_page_sequence(pages_number);
+// bytes between the first page of run addr and addr
+size_t run_offset_of(void* addr) {
+    return (size_t)addr % page_size;
+}
 
-    if (first_free_page == -1) {
+// address handed out for run, NULL if there is no run
+void* start_run(void* run, size_t offset) {
+    if (run == NULL) {
         return NULL;
     }
 
-    void* start_address = (void*)((size_t)memory_start + first_free_page * page_size);
+#ifdef RUN_MARK
+    *(uintptr_t*)run = RUN_MARK;
+#endif
+    return (void*)((size_t)run + offset);
+}
+
+bool is_page_full(const MultiBlockPageHeader* page_header) {
+    size_t block_size = classes[page_header->class_index].block_size;
+    return page_header->free_blocks == NULL
+            && (size_t)page_header->unused_space + block_size
+                    > (size_t)page_start(page_header) + page_size;
+}
 
-    for (size_t i = first_free_page; i < first_free_page + pages_number; ++i) {
-        pages[i] = (void**)start_address;
+size_t align_size(size_t size) {
+    if (size > page_size) {
+        return size;    // only block sizes are rounded
     }
+    return (size_t)1 << (class_index(size) + MIN_CLASS_SHIFT);
+}
 
-    return start_address;
+size_t class_index(size_t size) {
+    if (size <= (size_t)1 << MIN_CLASS_SHIFT) {
+        return 0;
+    }
+    // ceil(log2(size)) is the bit length of size - 1
+    return 8 * sizeof(unsigned long long) - __builtin_clzll(size - 1) - MIN_CLASS_SHIFT;
 }
 
-void delete_block(MultiBlockPageHeader* page_header, void* addr) {
-    size_t block_size = page_header->block_size;
-    BlockHeader* b_header;
-    BlockHeader* prev_header = NULL;
+// class of size in the page pool of the calling thread's node
+size_t local_class_index(size_t size) {
+    return page_heap_node() * class_count + class_index(size);
+}
 
-    // look for header of the previous to current free block
-    for (b_header = (BlockHeader*)page_header; (void*)b_header < addr;
-            b_header = b_header->next_header) {
-        prev_header = b_header;
+void push_page(MultiBlockPageHeader** list, MultiBlockPageHeader* page_header) {
+    page_header->prev_page = NULL;
+    page_header->next_page = *list;
+
+    if (page_header->next_page != NULL) {
+        page_header->next_page->prev_page = page_header;
     }
 
-    // new node for released block of memory
-    BlockHeader* new_header = (BlockHeader*)addr;
+    *list = page_header;
+}
+
+void unlink_page(MultiBlockPageHeader** list, MultiBlockPageHeader* page_header) {
+    if (page_header->prev_page != NULL) {
+        page_header->prev_page->next_page = page_header->next_page;
+    } else {
+        *list = page_header->next_page;
+    }
 
-    // block is before some free block, so delete all free block
-    // node and add new to addr instead
-    if ((size_t)addr + block_size == (size_t)b_header) {
-        new_header->next_header = b_header->next_header;
-        prev_header->next_header = new_header;
-        // just add new node
-    } else if ((size_t)prev_header + block_size != (size_t)addr) {
-        new_header->next_header = prev_header->next_header;
-        prev_header->next_header = new_header;
+    if (page_header->next_page != NULL) {
+        page_header->next_page->prev_page = page_header->prev_page;
     }
+
+    page_header->prev_page = page_header->next_page = NULL;
 }
 
-size_t align_size(size_t size) {
-    return pow(2, ceil(log(size)/log(2)));
+void dump_page(size_t page_number, void* page, size_t run_length, bool is_free) {
+    printf("Page #%lu", (unsigned long) page_number);
+
+    if (is_free) {
+        printf(": unused\n");
+    } else if (run_length != 0) {
+        printf(": used (part of a multipage memory block)\n");
+
+        for (size_t i = 1; i < run_length; ++i) {
+            printf("Page #%lu: used (part of a multipage memory block)\n",
+                    (unsigned long) (page_number + i));
+        }
+    } else {
+        dump_multiblock_page(page_header_of(page));
+    }
+}
+
+void dump_multiblock_page(MultiBlockPageHeader* header) {
+    unsigned long block_sz = (unsigned long) classes[header->class_index].block_size;
+    size_t block_offset = classes[header->class_index].first_block_offset;
+    size_t first_block = (size_t)page_start(header) + block_offset;
+    int blocks_count = ((size_t)header->unused_space - first_block) / block_sz;
+    // one bit per block, a page of 2 MiB holds 256 Ki blocks of 8 bytes
+    uint64_t is_free[(SLAB_PAGE_SIZE >> MIN_CLASS_SHIFT) / 64 + 1] = { 0 };
+
+    printf(": multiblock, block size: %lu\n", block_sz);
+
+    for (BlockHeader* b_header = header->free_blocks; b_header != NULL;
+            b_header = b_header->next_header) {
+        size_t block_number = ((size_t)b_header - first_block) / block_sz;
+        is_free[block_number / 64] |= (uint64_t)1 << (block_number % 64);
+    }
+
+    for (int block_number = 0; block_number < blocks_count; ++block_number) {
+        printf("    block #%d (%lu-%lu): %s\n", block_number,
+                block_number * block_sz + block_offset,
+                (block_number + 1) * block_sz + block_offset,
+                (is_free[block_number / 64] >> (block_number % 64)) & 1 ? "free" : "used");
+    }
+
+    size_t free_space = (size_t)page_start(header) + page_size - (size_t)header->unused_space
+            + (blocks_count - header->live_blocks) * block_sz;
+
+    if (free_space != 0) {
+        printf("    free space available: %5lu\n", (unsigned long) free_space);
+    }
 }
 
 bool address_out_of_range(void* addr) {
-    return addr < memory_start || (size_t)addr > (size_t)memory_start + page_count * page_size;
+    return !page_in_heap(addr);
 }
 
 bool should_use_multiblock(size_t size) {
-    return size <= page_size / 2 - sizeof(MultiBlockPageHeader);
+    return align_size(size) <= page_size / 2 - first_block_offset;
 }
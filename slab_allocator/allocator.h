@@ -1,16 +1,101 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include "mem_stats.h"
+
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// mem_alloc returns memory aligned to MEM_ALIGNMENT bytes; blocks of 8 bytes
+// are 8-byte aligned, which is all an object that fits in them needs. Blocks
+// of bigger classes are aligned to their class size
+#define MEM_ALIGNMENT 16
+
+// optional, before the first mem_alloc: map pages from the OS in chunks of at
+// least chunk_size bytes when needed and unmap chunks which become empty,
+// instead of using one SLAB_BUFFER_SIZE buffer
+bool mem_init_growable(size_t chunk_size);
+
+// optional, before the first mem_alloc: placement of the heap's pages on a
+// NUMA machine. MEM_NUMA_LOCAL (the default) keeps pages for every node and
+// threads allocate from the node they run on; MEM_NUMA_INTERLEAVE spreads
+// all pages over the nodes. With a single node, or where the pages can not be
+// bound, both leave placement to the kernel
+typedef enum MemNumaPolicy {
+    MEM_NUMA_LOCAL,
+    MEM_NUMA_INTERLEAVE
+} MemNumaPolicy;
+
+bool mem_set_numa_policy(MemNumaPolicy policy);
+
+// free pages go back to the OS once they were free for decay_ms, checked
+// when pages are freed, at most once per decay_ms; 0 gives them back at
+// once, a negative value only on mem_trim. 1000 ms by default
+void mem_set_decay(long decay_ms);
+
+// give every free page back to the OS now, for quiet periods, after the
+// blocks cached by the calling thread; returns the bytes given back
+size_t mem_trim();
+
+// overcommit, in builds with -DSLAB_PAGING on Linux: at most resident_pages
+// pages of the heap stay in RAM (no limit with 0, 16 at least), the others
+// go to a swap file at swap_path, unlinked at once, and come back when they
+// are touched. Pages used within window_ms are evicted last, clean ones
+// first. False if userfaultfd or the file is not available; later calls
+// change the limit and the window only. Where the kernel lets the process
+// handle user faults only, system calls given memory which is out fail with
+// EFAULT; a forked child finds zeros in place of it
+bool mem_set_paging(const char* swap_path, size_t resident_pages, long window_ms);
+
+typedef struct MemPagingStats {
+    // pages brought in on a fault, from the swap file or zero filled
+    uint64_t faults;
+    // pages dropped from RAM, and pages written to the swap file
+    uint64_t evictions;
+    uint64_t write_backs;
+    // pages in RAM, and pages only in the swap file
+    size_t resident_pages;
+    size_t swapped_pages;
+} MemPagingStats;
+
+void mem_paging_stats(MemPagingStats* stats);
 
 void* mem_alloc(size_t size);
 
 void* mem_realloc(void* old_addr, size_t size);
 
+// size bytes at a multiple of alignment, a power of two: small requests take
+// the class of the bigger of size and alignment, others a run of pages
+// starting where the data is aligned. Freed with mem_free; mem_realloc keeps
+// the alignment only while the memory does not move
+void* mem_alloc_aligned(size_t size, size_t alignment);
+
 void mem_copy(void* to, const void* from, const size_t bytes);
 
 void mem_free(void* addr);
 
+// addr got from mem_alloc or mem_realloc and size the one passed to the call
+// which returned it. A block of a small size skips the search of mem_free
+// for the chunk holding addr; its class still comes from its page header,
+// as a block shrunk in place keeps its bigger class, and with
+// SLAB_OUTLINE_HEADERS finding that header is a chunk search of its own.
+// Thread-safe builds take the class from the block's tag, like mem_free
+void mem_free_sized(void* addr, size_t size);
+
+void* mem_realloc_sized(void* addr, size_t old_size, size_t new_size);
+
+// count blocks of size bytes at once, returns how many it got; blocks of a
+// page are taken off its free chain together
+size_t mem_alloc_batch(size_t size, size_t count, void** out);
+
+// frees count blocks, NULL ones are skipped; blocks of the same page next to
+// each other in addrs are given back to the page together
+void mem_free_batch(void** addrs, size_t count);
+
+// bytes which can be used at addr, at least the size it was allocated with
+size_t mem_usable_size(void* addr);
+
 void mem_dump();
 
 #endif
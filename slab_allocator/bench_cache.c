@@ -0,0 +1,145 @@
+/*
+ * Object caches against mem_alloc for objects whose size is not a power of
+ * two. For every object size it measures the memory a working set takes,
+ * the time of an alloc/free pair which sets the object up (mem_alloc has to
+ * run the initialization on every allocation, a cache keeps objects
+ * constructed) and the time of sweeps reading one hot field of every object
+ * of the working set.
+ *
+ * Usage: bench_cache [objects] [pairs] [sweeps]
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include "allocator.h"
+#include "mem_cache.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t object_sizes[] = { 33, 72, 100, 192, 320, 1000 };
+
+static size_t object_size;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the setup an object needs before use, which a cache does once
+static void construct(void* obj) {
+    memset(obj, 0, object_size);
+    *(uint64_t*)obj = 1;
+}
+
+static size_t pages_in_use() {
+    MemStats stats;
+    mem_stats(&stats);
+    return stats.pages_in_use * stats.page_size;
+}
+
+static void* alloc_object(MemCache* cache) {
+    if (cache != NULL) {
+        return mem_cache_alloc(cache);
+    }
+
+    void* obj = mem_alloc(object_size);
+
+    if (obj != NULL) {
+        construct(obj);
+    }
+
+    return obj;
+}
+
+static void free_object(MemCache* cache, void* obj) {
+    if (cache != NULL) {
+        mem_cache_free(cache, obj);
+    } else {
+        mem_free(obj);
+    }
+}
+
+// one line of results for cache, or for mem_alloc if cache is NULL
+static int run(const char* name, MemCache* cache, void** objects, size_t object_count,
+               size_t pairs, size_t sweeps) {
+    size_t bytes_before = pages_in_use();
+
+    for (size_t i = 0; i < object_count; ++i) {
+        if ((objects[i] = alloc_object(cache)) == NULL) {
+            fprintf(stderr, "%s: out of memory\n", name);
+            return 0;
+        }
+    }
+
+    size_t bytes = pages_in_use() - bytes_before;
+    double start = now();
+
+    for (size_t i = 0; i < pairs; ++i) {
+        size_t slot = i * 7919 % object_count;
+        free_object(cache, objects[slot]);
+
+        if ((objects[slot] = alloc_object(cache)) == NULL) {
+            fprintf(stderr, "%s: out of memory\n", name);
+            return 0;
+        }
+    }
+
+    double pair_seconds = now() - start;
+    uint64_t sum = 0;
+    start = now();
+
+    for (size_t sweep = 0; sweep < sweeps; ++sweep) {
+        for (size_t i = 0; i < object_count; ++i) {
+            sum += *(volatile uint64_t*)objects[i];
+        }
+    }
+
+    double sweep_seconds = now() - start;
+
+    for (size_t i = 0; i < object_count; ++i) {
+        free_object(cache, objects[i]);
+    }
+
+    printf("%6lu %-10s %10.2f %12.1f %12.2f%s\n", (unsigned long)object_size, name,
+            (double)bytes / object_count, pair_seconds * 1e9 / pairs,
+            sweep_seconds * 1e9 / ((double)sweeps * object_count),
+            sum == (uint64_t)sweeps * object_count ? "" : " (bad sum)");
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    size_t object_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    size_t pairs = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+    size_t sweeps = argc > 3 ? strtoul(argv[3], NULL, 10) : 20;
+
+    if (object_count == 0 || !mem_init_growable(16 << 20)) {
+        return EXIT_FAILURE;
+    }
+
+    void** objects = mem_alloc(object_count * sizeof(void*));
+
+    if (objects == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%lu objects, %lu alloc/free pairs, %lu sweeps\n", (unsigned long)object_count,
+            (unsigned long)pairs, (unsigned long)sweeps);
+    printf("%6s %-10s %10s %12s %12s\n", "size", "", "bytes/obj", "ns/pair", "ns/obj sweep");
+    int ok = 1;
+
+    for (size_t i = 0; ok && i < sizeof(object_sizes) / sizeof(object_sizes[0]); ++i) {
+        object_size = object_sizes[i];
+        ok = run("mem_alloc", NULL, objects, object_count, pairs, sweeps);
+
+        MemCache* cache = mem_cache_create("bench", object_size, 0, construct, NULL);
+        ok = ok && cache != NULL && run("mem_cache", cache, objects, object_count, pairs, sweeps);
+        mem_cache_destroy(cache);
+    }
+
+    mem_free(objects);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,191 @@
+/*
+ * Local against interleaved page placement on NUMA machines. Every thread,
+ * pinned to a CPU, builds a working set of small blocks, then sweeps over it
+ * reading and writing every block and replacing some of them. Each policy
+ * runs in a child process, since it is chosen before the heap is set up.
+ * On a single node (or where pages can not be bound) both runs take the
+ * fallback path, which leaves placement to the kernel, and should match.
+ *
+ * Usage: bench_numa [threads] [megabytes_per_thread] [passes]
+ */
+#define _GNU_SOURCE
+
+#include "allocator.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 256
+#define MAX_THREADS 256
+// every pass frees and allocates again one block in this many
+#define REPLACE_PERIOD 16
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t cpu;
+    size_t block_count;
+    size_t passes;
+    pthread_barrier_t* barrier;
+    // keeps the sweeps from being optimized out
+    uint64_t checksum;
+    double seconds;
+} Worker;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    // stay on one node, so its pages stay local
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    uint64_t** blocks = mem_alloc(worker->block_count * sizeof(uint64_t*));
+
+    for (size_t i = 0; blocks != NULL && i < worker->block_count; ++i) {
+        if ((blocks[i] = mem_alloc(BLOCK_SIZE)) == NULL) {
+            blocks = NULL;
+            break;
+        }
+        memset(blocks[i], (int)i, BLOCK_SIZE);
+    }
+
+    pthread_barrier_wait(worker->barrier);
+
+    if (blocks == NULL) {
+        worker->seconds = 0;
+        return NULL;
+    }
+
+    uint64_t checksum = 0;
+    const double start = now();
+
+    for (size_t pass = 0; pass < worker->passes; ++pass) {
+        for (size_t i = 0; i < worker->block_count; ++i) {
+            uint64_t* block = blocks[i];
+
+            if ((i + pass) % REPLACE_PERIOD == 0) {
+                mem_free(block);
+                block = blocks[i] = mem_alloc(BLOCK_SIZE);
+            }
+
+            for (size_t word = 0; word < BLOCK_SIZE / sizeof(uint64_t); ++word) {
+                checksum += block[word];
+                block[word] = checksum;
+            }
+        }
+    }
+
+    worker->seconds = now() - start;
+    worker->checksum = checksum;
+
+    for (size_t i = 0; i < worker->block_count; ++i) {
+        mem_free(blocks[i]);
+    }
+
+    mem_free(blocks);
+    return NULL;
+}
+
+// runs the workload in this process, false when out of memory
+static int run(const char* name, MemNumaPolicy policy, size_t thread_count,
+               size_t block_count, size_t passes) {
+    if (!mem_set_numa_policy(policy) || !mem_init_growable(16 << 20)) {
+        fprintf(stderr, "%s: could not set the heap up\n", name);
+        return 0;
+    }
+
+    static Worker workers[MAX_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, thread_count);
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers[i] = (Worker) { .cpu = i % (cpu_count > 0 ? cpu_count : 1),
+                                .block_count = block_count, .passes = passes,
+                                .barrier = &barrier };
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    double slowest = 0;
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+
+        if (workers[i].seconds == 0) {
+            fprintf(stderr, "%s: out of memory\n", name);
+            return 0;
+        }
+
+        slowest = workers[i].seconds > slowest ? workers[i].seconds : slowest;
+    }
+
+    const double bytes = (double)thread_count * block_count * BLOCK_SIZE * passes;
+    printf("%-12s %10.2f GB/s %10.2f ns/block\n", name, bytes / slowest * 1e-9,
+            slowest * 1e9 / ((double)block_count * passes));
+    return 1;
+}
+
+// the run in a child process, since the policy can not change afterwards
+static int run_child(const char* name, MemNumaPolicy policy, size_t thread_count,
+                     size_t block_count, size_t passes) {
+    fflush(stdout);
+    const pid_t pid = fork();
+
+    if (pid == 0) {
+        exit(run(name, policy, thread_count, block_count, passes)
+                ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid
+            && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = argc > 1 ? strtoul(argv[1], NULL, 10)
+            : (size_t)(cpu_count > 0 ? cpu_count : 1);
+    const size_t megabytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+    const size_t passes = argc > 3 ? strtoul(argv[3], NULL, 10) : 10;
+
+    if (thread_count == 0 || thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+
+    char nodes[256] = "0";
+    const int file = open("/sys/devices/system/node/online", O_RDONLY);
+
+    if (file != -1) {
+        const ssize_t length = read(file, nodes, sizeof(nodes) - 1);
+
+        if (length > 0) {
+            nodes[length] = '\0';
+            nodes[strcspn(nodes, "\n")] = '\0';
+        }
+
+        close(file);
+    }
+
+    printf("%zu threads, %zu MiB each, %zu passes, online nodes: %s%s\n", thread_count,
+            megabytes, passes, nodes,
+            strpbrk(nodes, ",-") == NULL ? " (single node: placement left to the kernel)" : "");
+
+    const size_t block_count = (megabytes << 20) / BLOCK_SIZE;
+    const int ok = run_child("local", MEM_NUMA_LOCAL, thread_count, block_count, passes)
+            & run_child("interleaved", MEM_NUMA_INTERLEAVE, thread_count, block_count, passes);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
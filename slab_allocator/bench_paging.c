@@ -0,0 +1,145 @@
+/*
+ * Overcommit benchmark. A heap of runs is filled, then read and written with
+ * a skewed pattern: most accesses go to a hot tenth of the runs, the others
+ * anywhere. It runs once with no resident limit, where paging only tracks
+ * writes, and once with the limit, where cold pages go to the swap file.
+ * Prints the access rate, the paging counters and whether every run still
+ * held its data.
+ *
+ * Usage: bench_paging [heap_mb] [resident_mb] [accesses] [swap_file]
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUN_SIZE (64 << 10)
+// runs are checked and written in 4 KiB parts, each with a version
+#define PART_WORDS (4096 / sizeof(uint64_t))
+#define RUN_PARTS (RUN_SIZE / 4096)
+// per cent of the accesses which go to the hot runs, and of writes
+#define HOT_PERCENT 90
+#define WRITE_PERCENT 20
+// pages used within this many milliseconds are the working set
+#define WINDOW_MS 50
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// every word of a part holds its run number and the part's version, bumped
+// by writes
+static int run(const char* name, uint64_t** runs, uint32_t* versions, size_t run_count,
+               size_t accesses) {
+    uint64_t random = 0x9e3779b97f4a7c15;
+    size_t words = RUN_SIZE / sizeof(uint64_t);
+    size_t hot_runs = run_count / 10 > 0 ? run_count / 10 : 1;
+    size_t bad = 0;
+    MemPagingStats before;
+    MemPagingStats after;
+    mem_paging_stats(&before);
+    double start = now();
+
+    for (size_t i = 0; i < accesses; ++i) {
+        uint64_t r = next_random(&random);
+        size_t index = r % 100 < HOT_PERCENT ? (r >> 8) % hot_runs : (r >> 8) % run_count;
+        size_t word = (r >> 32) % words;
+        uint32_t* version = &versions[index * RUN_PARTS + word / PART_WORDS];
+        uint64_t* data = runs[index];
+
+        if (data[word] != ((uint64_t)index << 32 | *version)) {
+            ++bad;
+        }
+
+        if ((r >> 24) % 100 < WRITE_PERCENT) {
+            uint64_t* part = &data[word / PART_WORDS * PART_WORDS];
+            uint64_t value = (uint64_t)index << 32 | ++*version;
+
+            for (size_t k = 0; k < PART_WORDS; ++k) {
+                part[k] = value;
+            }
+        }
+    }
+
+    double seconds = now() - start;
+    mem_paging_stats(&after);
+    printf("%-10s %12.0f %10lu %10lu %11lu %9lu %9lu %s\n", name, accesses / seconds,
+            (unsigned long)(after.faults - before.faults),
+            (unsigned long)(after.evictions - before.evictions),
+            (unsigned long)(after.write_backs - before.write_backs),
+            (unsigned long)after.resident_pages, (unsigned long)after.swapped_pages,
+            bad == 0 ? "ok" : "bad data");
+    return bad == 0;
+}
+
+int main(int argc, char** argv) {
+    size_t heap_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 128;
+    size_t resident_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+    size_t accesses = argc > 3 ? strtoul(argv[3], NULL, 10) : 2000000;
+    const char* swap_path = argc > 4 ? argv[4] : "bench_paging.swap";
+    size_t run_count = (heap_mb << 20) / RUN_SIZE;
+
+    if (run_count == 0 || !mem_init_growable(16 << 20)) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t** runs = mem_alloc(run_count * sizeof(uint64_t*));
+    uint32_t* versions = mem_alloc(run_count * RUN_PARTS * sizeof(uint32_t));
+
+    if (runs == NULL || versions == NULL
+            || !mem_set_paging(swap_path, 0, WINDOW_MS)) {
+        fprintf(stderr, "paging is not available\n");
+        return EXIT_FAILURE;
+    }
+
+    // filled with no limit, the limit then pushes most of it out
+    for (size_t i = 0; i < run_count; ++i) {
+        uint64_t* data = mem_alloc(RUN_SIZE);
+
+        if (data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return EXIT_FAILURE;
+        }
+
+        for (size_t k = 0; k < RUN_SIZE / sizeof(uint64_t); ++k) {
+            data[k] = (uint64_t)i << 32;
+        }
+
+        runs[i] = data;
+    }
+
+    memset(versions, 0, run_count * RUN_PARTS * sizeof(uint32_t));
+    MemStats stats;
+    mem_stats(&stats);
+
+    printf("%lu MiB heap, %lu MiB resident, %lu accesses, %d%% to a tenth of the runs\n",
+            (unsigned long)heap_mb, (unsigned long)resident_mb, (unsigned long)accesses,
+            HOT_PERCENT);
+    printf("%-10s %12s %10s %10s %11s %9s %9s\n", "limit", "accesses/s", "faults",
+            "evictions", "write-backs", "resident", "swapped");
+    int ok = run("none", runs, versions, run_count, accesses);
+    mem_set_paging(swap_path, (resident_mb << 20) / stats.page_size, WINDOW_MS);
+    ok = ok && run("resident", runs, versions, run_count, accesses);
+
+    for (size_t i = 0; i < run_count; ++i) {
+        mem_free(runs[i]);
+    }
+
+    mem_free(versions);
+    mem_free(runs);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
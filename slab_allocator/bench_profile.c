@@ -0,0 +1,192 @@
+/*
+ * Heap profiler benchmark. Threads replace random blocks of a live set with
+ * blocks of random sizes, sampling at the default rate and at a rate of its
+ * own. Every rate is timed in rounds, each a run with profiling between two
+ * runs without it; prints the median time of an alloc/free pair and the
+ * median overhead of the rounds, which a busy machine sways less than a
+ * single run. Then writes the profiles of the live set: path.heap for pprof
+ * and path.folded for flamegraph.pl.
+ *
+ * Usage: bench_profile [threads] [pairs] [sample_bytes] [path]
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include "allocator.h"
+#include "mem_profile.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// live blocks of each thread
+#define LIVE_SLOTS 4096
+#define MAX_SIZE 1024
+#define ROUNDS 15
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t pairs;
+    uint64_t random;
+    void* live[LIVE_SLOTS];
+} Worker;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// small blocks from one call site, large ones from another, so the profiles
+// have stacks to tell apart; not static, -rdynamic exports them
+__attribute__((noinline)) void* alloc_small(size_t size) {
+    void* addr = mem_alloc(size);
+    __asm__ volatile("" ::: "memory");
+    return addr;
+}
+
+__attribute__((noinline)) void* alloc_large(size_t size) {
+    void* addr = mem_alloc(size);
+    __asm__ volatile("" ::: "memory");
+    return addr;
+}
+
+static void* churn(void* arg) {
+    Worker* worker = arg;
+
+    for (size_t i = 0; i < worker->pairs; ++i) {
+        uint64_t r = next_random(&worker->random);
+        void** slot = &worker->live[r % LIVE_SLOTS];
+        size_t size = 16 + (r >> 16) % MAX_SIZE;
+
+        mem_free(*slot);
+        *slot = size < MAX_SIZE / 2 ? alloc_small(size) : alloc_large(size);
+
+        if (*slot != NULL) {
+            *(char*)*slot = 1;
+        }
+    }
+
+    return NULL;
+}
+
+// ns per alloc/free pair of all threads together
+static double run(Worker* workers, unsigned thread_count, size_t pairs) {
+    double start = now();
+
+    for (unsigned i = 0; i < thread_count; ++i) {
+        workers[i].pairs = pairs;
+        pthread_create(&workers[i].thread, NULL, churn, &workers[i]);
+    }
+
+    for (unsigned i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    return (now() - start) * 1e9 / pairs;
+}
+
+static double median(double* values, size_t count) {
+    for (size_t i = 1; i < count; ++i) {
+        for (size_t k = i; k > 0 && values[k] < values[k - 1]; --k) {
+            double value = values[k];
+            values[k] = values[k - 1];
+            values[k - 1] = value;
+        }
+    }
+
+    return values[count / 2];
+}
+
+// prints ns per pair with sampling every rate bytes and the overhead
+static void compare(Worker* workers, unsigned thread_count, size_t pairs, size_t rate,
+                    const char* name) {
+    double times[ROUNDS];
+    double ratios[ROUNDS];
+
+    for (int i = 0; i < ROUNDS; ++i) {
+        mem_profile_stop();
+        double before = run(workers, thread_count, pairs / ROUNDS);
+        mem_profile_start(rate);
+        times[i] = run(workers, thread_count, pairs / ROUNDS);
+        mem_profile_stop();
+        double after = run(workers, thread_count, pairs / ROUNDS);
+        ratios[i] = 2 * times[i] / (before + after);
+    }
+
+    printf("%-24s %10.1f %8.1f%%\n", name, median(times, ROUNDS),
+            (median(ratios, ROUNDS) - 1) * 100);
+}
+
+static int dump(const char* path, const char* extension, MemProfileFormat format) {
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.%s", path, extension);
+    double start = now();
+
+    if (!mem_profile_dump(name, format)) {
+        fprintf(stderr, "%s: can not be written\n", name);
+        return 0;
+    }
+
+    printf("%s written in %.1f ms\n", name, (now() - start) * 1e3);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    unsigned thread_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    size_t pairs = argc > 2 ? strtoul(argv[2], NULL, 10) : 5000000;
+    size_t sample_bytes = argc > 3 ? strtoul(argv[3], NULL, 10) : 64 << 10;
+    const char* path = argc > 4 ? argv[4] : "bench_profile";
+    Worker* workers = calloc(thread_count, sizeof(Worker));
+
+    if (thread_count == 0 || workers == NULL || !mem_init_growable(16 << 20)) {
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned i = 0; i < thread_count; ++i) {
+        workers[i].random = 0x9e3779b97f4a7c15 * (i + 1);
+    }
+
+    printf("%u threads, %lu alloc/free pairs each, sizes 16 to %d bytes\n", thread_count,
+            (unsigned long)pairs, 16 + MAX_SIZE - 1);
+    printf("%-24s %10s %9s\n", "sampling", "ns/pair", "overhead");
+    // warms up the heap and the thread caches
+    run(workers, thread_count, pairs / 4);
+    double off = run(workers, thread_count, pairs / ROUNDS);
+    printf("%-24s %10.1f %9s\n", "off", off, "");
+
+    if (!mem_profile_start(0)) {
+        fprintf(stderr, "profiling is not available\n");
+        return EXIT_FAILURE;
+    }
+
+    compare(workers, thread_count, pairs, 0, "every 512 KiB (default)");
+    char name[32];
+    snprintf(name, sizeof(name), "every %lu bytes", (unsigned long)sample_bytes);
+    compare(workers, thread_count, pairs, sample_bytes, name);
+    // the live set, sampled at the rate of its own
+    mem_profile_start(sample_bytes);
+    run(workers, thread_count, pairs / ROUNDS);
+
+    int ok = dump(path, "heap", MEM_PROFILE_PPROF)
+            && dump(path, "folded", MEM_PROFILE_FOLDED_LIVE);
+    mem_profile_stop();
+
+    for (unsigned i = 0; i < thread_count; ++i) {
+        for (size_t k = 0; k < LIVE_SLOTS; ++k) {
+            mem_free(workers[i].live[k]);
+        }
+    }
+
+    free(workers);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,443 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "mem_cache.h"
+#include "allocator.h"
+#include "page_heap.h"
+#include "thread_cache.h"
+
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// slabs grow until they hold this many objects and waste at most an eighth
+// of their size, or reach MAX_SLAB_SIZE
+#define MIN_SLAB_OBJECTS 8
+#define MAX_SLAB_SIZE ((size_t)256 << 10)
+// distance between the start offsets of successive slabs, a cache line
+#define COLOR_UNIT 64
+// slabs without objects in use a cache keeps, so a cache which empties and
+// fills a slab in turn does not run the constructors every time
+#define KEPT_EMPTY_SLABS 1
+#define NAME_SIZE 32
+
+// in allocator.c: sets the default heap up unless mem_init_growable did,
+// called with the heap lock held
+void central_init_default();
+
+// at the start of every slab, found by masking an object address with the
+// slab size
+typedef struct Slab {
+    MemCache* cache;
+    // free objects, linked through the word at the cache's link_offset
+    void* free_objects;
+    // the slab's color decides where its objects start
+    void* first_object;
+    size_t objects_in_use;
+    // neighbours in the partial, full or empty slab list of the cache
+    struct Slab* prev_slab;
+    struct Slab* next_slab;
+} Slab;
+
+struct MemCache {
+    char name[NAME_SIZE];
+    size_t object_size;
+    size_t slot_size;
+    // where the link to the next free object is kept in a free object:
+    // after the object if the cache keeps objects constructed, else over it
+    size_t link_offset;
+    size_t slab_size;
+    size_t objects_per_slab;
+    // offset of the first object in a slab of color 0, after the header
+    size_t first_object_offset;
+    size_t color_unit;
+    size_t colors;
+    size_t next_color;
+    MemCacheCtor ctor;
+    MemCacheCtor dtor;
+    // slabs with free objects and objects in use, without free objects and
+    // without objects in use
+    Slab* partial_slabs;
+    Slab* full_slabs;
+    Slab* empty_slabs;
+    size_t empty_slab_count;
+    // for statistics
+    size_t slabs;
+    size_t objects_in_use;
+    uint64_t allocs;
+    uint64_t frees;
+    // neighbours in the list of every cache
+    struct MemCache* prev_cache;
+    struct MemCache* next_cache;
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+};
+
+static size_t round_up(size_t size, size_t alignment);
+static void** link_of(const MemCache* cache, void* obj);
+static Slab* slab_of(const MemCache* cache, void* obj);
+static Slab* create_slab(MemCache* cache);
+static size_t release_slab(MemCache* cache, Slab* slab);
+static size_t release_slabs(MemCache* cache, Slab** list);
+static void push_slab(Slab** list, Slab* slab);
+static void unlink_slab(Slab** list, Slab* slab);
+static void lock_cache(MemCache* cache);
+static void unlock_cache(MemCache* cache);
+
+// every cache, for mem_cache_dump
+static MemCache* caches;
+
+#ifdef MEM_THREAD_SAFE
+// protects the list of caches, taken before the lock of a cache, which is
+// taken before the heap lock
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+MemCache* mem_cache_create(const char* name, size_t obj_size, size_t align,
+                           MemCacheCtor ctor, MemCacheCtor dtor) {
+    if (align == 0) {
+        align = sizeof(void*);
+    }
+
+    if ((align & (align - 1)) != 0 || align > SLAB_PAGE_SIZE || obj_size > MAX_SLAB_SIZE) {
+        return NULL;
+    }
+
+    // objects are aligned to a word at least, for the link of free objects
+    align = align > sizeof(void*) ? align : sizeof(void*);
+    // objects which have to stay constructed keep the link out of their way
+    size_t link_offset = ctor != NULL || dtor != NULL ? round_up(obj_size, sizeof(void*)) : 0;
+    size_t slot_size = round_up(obj_size > link_offset + sizeof(void*)
+            ? obj_size : link_offset + sizeof(void*), align);
+    size_t first_object_offset = round_up(sizeof(Slab), align);
+    size_t max_slab_size = MAX_SLAB_SIZE > SLAB_PAGE_SIZE ? MAX_SLAB_SIZE : SLAB_PAGE_SIZE;
+    size_t slab_size = SLAB_PAGE_SIZE;
+    size_t objects_per_slab;
+    size_t waste;
+
+    // smallest power of two of pages which holds enough objects and wastes
+    // little, slabs of several pages are aligned to their size
+    while (true) {
+        objects_per_slab = slab_size > first_object_offset
+                ? (slab_size - first_object_offset) / slot_size : 0;
+        waste = slab_size - first_object_offset - objects_per_slab * slot_size;
+
+        if ((objects_per_slab >= MIN_SLAB_OBJECTS && waste * 8 <= slab_size)
+                || slab_size * 2 > max_slab_size) {
+            break;
+        }
+
+        slab_size *= 2;
+    }
+
+    if (objects_per_slab == 0) {
+        return NULL;
+    }
+
+    MemCache* cache = mem_alloc(sizeof(MemCache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(MemCache));
+    strncpy(cache->name, name != NULL ? name : "", NAME_SIZE - 1);
+    cache->object_size = obj_size;
+    cache->slot_size = slot_size;
+    cache->link_offset = link_offset;
+    cache->slab_size = slab_size;
+    cache->objects_per_slab = objects_per_slab;
+    cache->first_object_offset = first_object_offset;
+    cache->color_unit = align > COLOR_UNIT ? align : COLOR_UNIT;
+    // the room left after the last object is what the objects can be shifted by
+    cache->colors = waste / cache->color_unit + 1;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_lock(&caches_lock);
+#endif
+    cache->next_cache = caches;
+
+    if (caches != NULL) {
+        caches->prev_cache = cache;
+    }
+
+    caches = cache;
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&caches_lock);
+#endif
+    return cache;
+}
+
+void mem_cache_destroy(MemCache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&caches_lock);
+#endif
+    if (cache->prev_cache != NULL) {
+        cache->prev_cache->next_cache = cache->next_cache;
+    } else {
+        caches = cache->next_cache;
+    }
+
+    if (cache->next_cache != NULL) {
+        cache->next_cache->prev_cache = cache->prev_cache;
+    }
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&caches_lock);
+#endif
+
+    release_slabs(cache, &cache->empty_slabs);
+    release_slabs(cache, &cache->partial_slabs);
+    release_slabs(cache, &cache->full_slabs);
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    mem_free(cache);
+}
+
+void* mem_cache_alloc(MemCache* cache) {
+    lock_cache(cache);
+    Slab* slab = cache->partial_slabs;
+
+    if (slab == NULL && (slab = cache->empty_slabs) != NULL) {
+        unlink_slab(&cache->empty_slabs, slab);
+        --cache->empty_slab_count;
+        push_slab(&cache->partial_slabs, slab);
+    }
+
+    if (slab == NULL && (slab = create_slab(cache)) != NULL) {
+        push_slab(&cache->partial_slabs, slab);
+    }
+
+    if (slab == NULL) {
+        unlock_cache(cache);
+        return NULL;
+    }
+
+    void* obj = slab->free_objects;
+    slab->free_objects = *link_of(cache, obj);
+    ++slab->objects_in_use;
+    ++cache->objects_in_use;
+    ++cache->allocs;
+
+    if (slab->free_objects == NULL) {
+        unlink_slab(&cache->partial_slabs, slab);
+        push_slab(&cache->full_slabs, slab);
+    }
+
+    unlock_cache(cache);
+    return obj;
+}
+
+void mem_cache_free(MemCache* cache, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    Slab* slab = slab_of(cache, obj);
+
+    // objects of other caches are left alone
+    if (slab->cache != cache) {
+        return;
+    }
+
+    lock_cache(cache);
+
+    if (slab->free_objects == NULL) {
+        // the slab has a free object again
+        unlink_slab(&cache->full_slabs, slab);
+        push_slab(&cache->partial_slabs, slab);
+    }
+
+    *link_of(cache, obj) = slab->free_objects;
+    slab->free_objects = obj;
+    --slab->objects_in_use;
+    --cache->objects_in_use;
+    ++cache->frees;
+
+    if (slab->objects_in_use == 0) {
+        unlink_slab(&cache->partial_slabs, slab);
+
+        if (cache->empty_slab_count < KEPT_EMPTY_SLABS) {
+            push_slab(&cache->empty_slabs, slab);
+            ++cache->empty_slab_count;
+        } else {
+            release_slab(cache, slab);
+        }
+    }
+
+    unlock_cache(cache);
+}
+
+size_t mem_cache_shrink(MemCache* cache) {
+    lock_cache(cache);
+    size_t released = release_slabs(cache, &cache->empty_slabs);
+    cache->empty_slab_count = 0;
+    unlock_cache(cache);
+    return released;
+}
+
+void mem_cache_stats(MemCache* cache, MemCacheStats* stats) {
+    lock_cache(cache);
+    stats->name = cache->name;
+    stats->object_size = cache->object_size;
+    stats->slot_size = cache->slot_size;
+    stats->slab_size = cache->slab_size;
+    stats->objects_per_slab = cache->objects_per_slab;
+    stats->colors = cache->colors;
+    stats->slabs = cache->slabs;
+    stats->objects_in_use = cache->objects_in_use;
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+    unlock_cache(cache);
+}
+
+void mem_cache_dump() {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&caches_lock);
+#endif
+    printf("%-24s %10s %10s %8s %8s %8s %8s %8s %6s\n", "# name", "in_use", "objects",
+            "objsize", "slotsize", "per_slab", "slabsize", "slabs", "colors");
+
+    for (MemCache* cache = caches; cache != NULL; cache = cache->next_cache) {
+        MemCacheStats stats;
+        mem_cache_stats(cache, &stats);
+        printf("%-24s %10lu %10lu %8lu %8lu %8lu %8lu %8lu %6lu\n", stats.name,
+                (unsigned long)stats.objects_in_use,
+                (unsigned long)(stats.slabs * stats.objects_per_slab),
+                (unsigned long)stats.object_size, (unsigned long)stats.slot_size,
+                (unsigned long)stats.objects_per_slab, (unsigned long)stats.slab_size,
+                (unsigned long)stats.slabs, (unsigned long)stats.colors);
+    }
+
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&caches_lock);
+#endif
+}
+
+size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+void** link_of(const MemCache* cache, void* obj) {
+    return (void**)((size_t)obj + cache->link_offset);
+}
+
+Slab* slab_of(const MemCache* cache, void* obj) {
+    return (Slab*)((size_t)obj & ~(cache->slab_size - 1));
+}
+
+// new slab with every object constructed and free, called with the cache
+// locked
+Slab* create_slab(MemCache* cache) {
+    size_t pages = cache->slab_size / SLAB_PAGE_SIZE;
+    central_lock();
+    central_init_default();
+    Slab* slab = pages == 1 ? alloc_page_run(1)
+            : alloc_page_run_aligned(pages, cache->slab_size, 0);
+    central_unlock();
+
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->first_object = (void*)((size_t)slab + cache->first_object_offset
+            + cache->next_color * cache->color_unit);
+    slab->objects_in_use = 0;
+    slab->free_objects = NULL;
+    cache->next_color = (cache->next_color + 1) % cache->colors;
+
+    // linked from the last, so they are handed out in address order
+    for (size_t i = cache->objects_per_slab; i-- > 0;) {
+        void* obj = (void*)((size_t)slab->first_object + i * cache->slot_size);
+
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+
+        *link_of(cache, obj) = slab->free_objects;
+        slab->free_objects = obj;
+    }
+
+    ++cache->slabs;
+    return slab;
+}
+
+// destructs the objects of slab, which is in no list, and gives its pages
+// back; returns its size
+size_t release_slab(MemCache* cache, Slab* slab) {
+    if (cache->dtor != NULL) {
+        for (size_t i = 0; i < cache->objects_per_slab; ++i) {
+            cache->dtor((void*)((size_t)slab->first_object + i * cache->slot_size));
+        }
+    }
+
+    --cache->slabs;
+    central_lock();
+    free_pages(slab);
+    central_unlock();
+    return cache->slab_size;
+}
+
+size_t release_slabs(MemCache* cache, Slab** list) {
+    size_t released = 0;
+
+    while (*list != NULL) {
+        Slab* slab = *list;
+        unlink_slab(list, slab);
+        released += release_slab(cache, slab);
+    }
+
+    return released;
+}
+
+void push_slab(Slab** list, Slab* slab) {
+    slab->prev_slab = NULL;
+    slab->next_slab = *list;
+
+    if (slab->next_slab != NULL) {
+        slab->next_slab->prev_slab = slab;
+    }
+
+    *list = slab;
+}
+
+void unlink_slab(Slab** list, Slab* slab) {
+    if (slab->prev_slab != NULL) {
+        slab->prev_slab->next_slab = slab->next_slab;
+    } else {
+        *list = slab->next_slab;
+    }
+
+    if (slab->next_slab != NULL) {
+        slab->next_slab->prev_slab = slab->prev_slab;
+    }
+
+    slab->prev_slab = slab->next_slab = NULL;
+}
+
+void lock_cache(MemCache* cache) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&cache->lock);
+#else
+    (void)cache;
+#endif
+}
+
+void unlock_cache(MemCache* cache) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&cache->lock);
+#else
+    (void)cache;
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef MEM_CACHE_H
+#define MEM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Object caches: slabs of objects of one exact size, kept constructed.
+//
+// A cache cuts slabs of one or more pages from the page heap into slots of
+// the object size rounded up to the alignment only, so a 33-byte object
+// takes 40 bytes instead of a 64-byte block. The constructor runs once per
+// object, when its slab is made; freed objects go back to the free list of
+// their slab in that constructed state, and the destructor runs when the
+// slab is given back. The room a slab has left after its last object is
+// used to start the objects of successive slabs at different offsets, a
+// cache line (or the alignment) apart, so the same field of objects of
+// different slabs falls in different cache sets.
+//
+// Objects of a cache are freed with mem_cache_free only. In the
+// thread-safe build every cache has its own lock.
+
+typedef struct MemCache MemCache;
+
+// runs on an object: ctor when its slab is made, dtor when it is given back
+typedef void (*MemCacheCtor)(void* obj);
+
+typedef struct MemCacheStats {
+    const char* name;
+    size_t object_size;
+    // bytes every object takes in a slab
+    size_t slot_size;
+    size_t slab_size;
+    size_t objects_per_slab;
+    // start offsets the slabs go through in turn
+    size_t colors;
+    size_t slabs;
+    // objects handed out and not freed yet
+    size_t objects_in_use;
+    uint64_t allocs;
+    uint64_t frees;
+} MemCacheStats;
+
+// cache of objects of obj_size bytes aligned to align, a power of two up to
+// the page size (0 for pointer alignment); ctor and dtor may be NULL. The
+// name is copied for statistics. NULL if out of memory or the arguments do
+// not fit a slab
+MemCache* mem_cache_create(const char* name, size_t obj_size, size_t align,
+                           MemCacheCtor ctor, MemCacheCtor dtor);
+
+// gives every slab of cache back, all its objects must have been freed
+void mem_cache_destroy(MemCache* cache);
+
+// constructed object of cache, NULL if out of memory
+void* mem_cache_alloc(MemCache* cache);
+
+// obj got from mem_cache_alloc on cache, or NULL; it has to be left in its
+// constructed state
+void mem_cache_free(MemCache* cache, void* obj);
+
+// gives the slabs of cache without objects in use back, returns their bytes
+size_t mem_cache_shrink(MemCache* cache);
+
+void mem_cache_stats(MemCache* cache, MemCacheStats* stats);
+
+// one line of statistics per cache, like /proc/slabinfo
+void mem_cache_dump();
+
+#endif
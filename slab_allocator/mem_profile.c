@@ -0,0 +1,847 @@
+#define _GNU_SOURCE
+
+#include "mem_profile.h"
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#ifdef MEM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// the profile calls are exported from the malloc interposition library too
+#define PROFILE_EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_SAMPLE_BYTES ((size_t)512 << 10)
+// bytes a thread allocates between two looks at the rate while profiling
+// is off
+#define IDLE_CHECK_BYTES ((uint64_t)1 << 20)
+#define MAX_FRAMES 32
+// frame pointer walks know where x86-64 and AArch64 frames keep the
+// caller's frame pointer and the return address
+#if !defined(PROFILE_BACKTRACE) && (defined(__x86_64__) || defined(__aarch64__))
+#define PROFILE_FRAME_POINTERS
+#endif
+// the allocator function which called profile_record, and profile_record
+// itself for backtrace; the mem_* call stays as the leaf frame
+#define WALK_SKIPPED_FRAMES 1
+#define BACKTRACE_SKIPPED_FRAMES 2
+// hash tables of powers of two slots, filled to three quarters at most.
+// Stacks which do not fit are counted in one more stack after the table,
+// samples which do not fit are only counted as allocated
+#define STACK_SLOTS 16384
+// the samples are split in stripes of their own lock, picked by the top
+// bits of the address hash
+#define STRIPE_SHIFT 58
+#define SAMPLE_STRIPES ((size_t)1 << (64 - STRIPE_SHIFT))
+#define STRIPE_SLOTS ((size_t)1 << 10)
+#define SAMPLE_SLOTS (SAMPLE_STRIPES * STRIPE_SLOTS)
+#define FILTER_SLOTS ((size_t)1 << (64 - PROFILE_FILTER_SHIFT))
+#define FILTER_MAX UINT8_MAX
+#define OUTPUT_BUFFER_SIZE 4096
+#define PATH_SIZE 4096
+
+// samples taken with one call stack
+typedef struct ProfileStack {
+    // 0 for a free slot
+    uint64_t hash;
+    size_t depth;
+    // samples of memory not freed yet and all samples, with their bytes
+    uint64_t live_count;
+    uint64_t live_bytes;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    // alloc_count and alloc_bytes when the last MEM_PROFILE_FOLDED_RATE
+    // profile was written
+    uint64_t rate_count;
+    uint64_t rate_bytes;
+    void* frames[MAX_FRAMES];
+} ProfileStack;
+
+// a sample of live memory, addr is NULL in free slots; sizes fit in 48
+// bits and stack indices in 16, so four samples share a cache line
+typedef struct ProfileSample {
+    void* addr;
+    uint64_t size : 48;
+    uint64_t stack : 16;
+} ProfileSample;
+
+// a lock of its own line for the samples of a stripe
+typedef struct SampleStripe {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+    size_t count;
+} __attribute__((aligned(64))) SampleStripe;
+
+// buffered writes to a file, without stdio, which may call malloc
+typedef struct Output {
+    int fd;
+    size_t length;
+    bool failed;
+    char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+static uint64_t next_interval(size_t mean);
+static double natural_log(double x);
+static double natural_exp(double x);
+static inline size_t take_stack(void** frames) __attribute__((always_inline));
+#ifdef PROFILE_FRAME_POINTERS
+static uintptr_t find_stack_top();
+#endif
+static ProfileStack* find_stack(void** frames, size_t depth);
+static size_t sample_slot(uint64_t hash);
+static size_t next_slot(size_t slot);
+static long find_sample(const void* addr, uint64_t hash);
+static void add_sample(void* addr, size_t size, uint32_t stack);
+static void remove_sample(size_t slot);
+static void count_live(uint32_t stack, size_t size, int sign);
+static bool write_profile(int fd, MemProfileFormat format);
+static void write_pprof(Output* out);
+static void write_folded(Output* out, MemProfileFormat format);
+static void output_frame(Output* out, void* address);
+static double scale(uint64_t count, uint64_t bytes);
+static void output(Output* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void flush_output(Output* out);
+static void request_dump(int signal);
+static void write_requested_dump();
+static void lock_profile();
+static void unlock_profile();
+static void lock_stripe(SampleStripe* stripe);
+static void unlock_stripe(SampleStripe* stripe);
+#ifdef MEM_THREAD_SAFE
+static void lock_all();
+static void unlock_all();
+#endif
+static uint64_t now_ns();
+
+PROFILE_THREAD_LOCAL uint64_t profile_countdown = 0;
+size_t profile_live_samples = 0;
+uint8_t* profile_filter = NULL;
+
+// false until the thread counts down an interval of the current rate
+static PROFILE_THREAD_LOCAL bool is_counting = false;
+// set while the thread runs the profiler: the allocations the C library
+// makes for it are not sampled (backtrace loads libgcc on first use)
+static PROFILE_THREAD_LOCAL bool in_profiler = false;
+static PROFILE_THREAD_LOCAL uint64_t random_state = 0;
+#ifdef PROFILE_FRAME_POINTERS
+// end of the calling thread's stack, 0 if it is not known; the walks do not
+// read at or above it
+static PROFILE_THREAD_LOCAL uintptr_t stack_top = 0;
+static PROFILE_THREAD_LOCAL bool has_stack_top = false;
+#endif
+
+// mean bytes between samples, 0 when profiling is off; profile_rate is the
+// last rate profiling ran with
+static size_t sample_bytes = 0;
+static size_t profile_rate = 0;
+// mapped by the first mem_profile_start, never given back
+static ProfileStack* stacks = NULL;
+static ProfileSample* samples = NULL;
+static SampleStripe stripes[SAMPLE_STRIPES];
+static size_t stack_count = 0;
+// when the last MEM_PROFILE_FOLDED_RATE profile was written
+static uint64_t rate_start_ns = 0;
+// see mem_profile_dump_on_signal
+static volatile sig_atomic_t is_dump_requested = 0;
+// room is left in a path for the pid, the count and the extension
+static char dump_prefix[PATH_SIZE - 64];
+static MemProfileFormat dump_format = MEM_PROFILE_PPROF;
+static unsigned dump_count = 0;
+
+#ifdef MEM_THREAD_SAFE
+// protects the stack table and the dump settings; the samples are under
+// the locks of their stripes, which are never taken inside it
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+PROFILE_EXPORT bool mem_profile_start(size_t bytes) {
+    lock_profile();
+
+    if (stacks == NULL) {
+        // the first backtrace loads libgcc, which allocates
+        void* frame;
+        in_profiler = true;
+        bool has_stacks = backtrace(&frame, 1) == 1;
+        in_profiler = false;
+
+        // one more stack for those which do not fit
+        stacks = mmap(NULL, (STACK_SLOTS + 1) * sizeof(ProfileStack), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        // the samples and the filter are spread over by hashes: mapped in at
+        // once, so samples do not fault them in one page at a time
+        samples = mmap(NULL, SAMPLE_SLOTS * sizeof(ProfileSample), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        uint8_t* filter = mmap(NULL, FILTER_SLOTS, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+        if (!has_stacks || stacks == MAP_FAILED || samples == MAP_FAILED
+                || filter == MAP_FAILED) {
+            if (stacks != MAP_FAILED) {
+                munmap(stacks, (STACK_SLOTS + 1) * sizeof(ProfileStack));
+            }
+
+            if (samples != MAP_FAILED) {
+                munmap(samples, SAMPLE_SLOTS * sizeof(ProfileSample));
+            }
+
+            if (filter != MAP_FAILED) {
+                munmap(filter, FILTER_SLOTS);
+            }
+
+            stacks = NULL;
+            samples = NULL;
+            unlock_profile();
+            return false;
+        }
+
+        stacks[STACK_SLOTS].hash = 1;
+        rate_start_ns = now_ns();
+        __atomic_store_n(&profile_filter, filter, __ATOMIC_RELEASE);
+#ifdef MEM_THREAD_SAFE
+        for (size_t i = 0; i < SAMPLE_STRIPES; ++i) {
+            pthread_mutex_init(&stripes[i].lock, NULL);
+        }
+
+        // a child process gets the tables in a consistent state
+        pthread_atfork(lock_all, unlock_all, unlock_all);
+#endif
+    }
+
+    profile_rate = bytes != 0 ? bytes : DEFAULT_SAMPLE_BYTES;
+    // after the tables, which threads use once they see the rate
+    __atomic_store_n(&sample_bytes, profile_rate, __ATOMIC_RELEASE);
+    unlock_profile();
+    return true;
+}
+
+PROFILE_EXPORT void mem_profile_stop() {
+    __atomic_store_n(&sample_bytes, 0, __ATOMIC_RELAXED);
+}
+
+PROFILE_EXPORT bool mem_profile_write(int fd, MemProfileFormat format) {
+    bool was_in_profiler = in_profiler;
+    in_profiler = true;
+    lock_profile();
+    bool result = stacks != NULL && write_profile(fd, format);
+    unlock_profile();
+    in_profiler = was_in_profiler;
+    return result;
+}
+
+PROFILE_EXPORT bool mem_profile_dump(const char* path, MemProfileFormat format) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    bool result = mem_profile_write(fd, format);
+    return close(fd) == 0 && result;
+}
+
+PROFILE_EXPORT bool mem_profile_dump_on_signal(int signal, const char* path_prefix,
+                                              MemProfileFormat format) {
+    size_t length = strlen(path_prefix);
+
+    if (length >= sizeof(dump_prefix)) {
+        return false;
+    }
+
+    lock_profile();
+    memcpy(dump_prefix, path_prefix, length + 1);
+    dump_format = format;
+    unlock_profile();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_dump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signal, &action, NULL) == 0;
+}
+
+bool profile_next(size_t size) {
+    if (is_dump_requested && !in_profiler) {
+        write_requested_dump();
+    }
+
+    size_t rate = __atomic_load_n(&sample_bytes, __ATOMIC_ACQUIRE);
+
+    if (rate == 0 || in_profiler) {
+        is_counting = false;
+        profile_countdown = IDLE_CHECK_BYTES;
+        return false;
+    }
+
+    if (!is_counting) {
+        // a new thread, or profiling started: the allocation counts towards
+        // a fresh interval, so the first allocations are not all sampled
+        is_counting = true;
+        profile_countdown = next_interval(rate);
+
+        if (size < profile_countdown) {
+            profile_countdown -= size;
+            return false;
+        }
+    }
+
+    profile_countdown = next_interval(rate);
+    return true;
+}
+
+void profile_record(void* addr, size_t size) {
+    void* frames[MAX_FRAMES];
+    in_profiler = true;
+    size_t depth = take_stack(frames);
+
+    lock_profile();
+    ProfileStack* stack = find_stack(frames, depth);
+    ++stack->alloc_count;
+    stack->alloc_bytes += size;
+    uint32_t index = stack - stacks;
+    unlock_profile();
+
+    add_sample(addr, size, index);
+    in_profiler = false;
+}
+
+uint32_t profile_take(void* addr, size_t* size) {
+    // the thread may be freeing memory the profiler allocated, the sample
+    // stays until the address is sampled again
+    if (in_profiler) {
+        return 0;
+    }
+
+    uint64_t hash = profile_hash(addr);
+    SampleStripe* stripe = &stripes[hash >> STRIPE_SHIFT];
+    lock_stripe(stripe);
+    long slot = find_sample(addr, hash);
+    uint32_t stack = 0;
+
+    if (slot != -1) {
+        stack = samples[slot].stack + 1;
+        *size = samples[slot].size;
+        remove_sample(slot);
+    }
+
+    unlock_stripe(stripe);
+    return stack;
+}
+
+void profile_put(void* addr, size_t size, uint32_t stack) {
+    if (stack == 0) {
+        return;
+    }
+
+    add_sample(addr, size, stack - 1);
+}
+
+// return addresses of the calls which led to profile_record, inlined into it
+// so its own frame starts the walk. Frame pointers cost a few nanoseconds
+// where backtrace costs microseconds, but code built without them ends the
+// walk early or at a wrong frame; the walk stays on the stack all the same
+size_t take_stack(void** frames) {
+#ifdef PROFILE_FRAME_POINTERS
+    if (!has_stack_top) {
+        has_stack_top = true;
+        stack_top = find_stack_top();
+    }
+
+    void** frame = __builtin_frame_address(0);
+
+    if (stack_top != 0 && (uintptr_t)frame < stack_top) {
+        size_t depth = 0;
+
+        for (size_t skipped = 0; depth < MAX_FRAMES; ) {
+            // a frame holds the frame pointer of its caller, then the
+            // return address; callers' frames lie above, within the stack
+            if ((uintptr_t)frame % sizeof(void*) != 0
+                    || (uintptr_t)(frame + 2) > stack_top || frame[1] == NULL) {
+                break;
+            }
+
+            if (skipped < WALK_SKIPPED_FRAMES) {
+                ++skipped;
+            } else {
+                frames[depth++] = frame[1];
+            }
+
+            if ((uintptr_t)frame[0] <= (uintptr_t)frame) {
+                break;
+            }
+            frame = frame[0];
+        }
+
+        return depth;
+    }
+#endif
+    // a thread whose stack is not known
+    void* all_frames[MAX_FRAMES + BACKTRACE_SKIPPED_FRAMES];
+    int depth = backtrace(all_frames, MAX_FRAMES + BACKTRACE_SKIPPED_FRAMES);
+
+    if (depth <= BACKTRACE_SKIPPED_FRAMES) {
+        return 0;
+    }
+
+    depth -= BACKTRACE_SKIPPED_FRAMES;
+    memcpy(frames, &all_frames[BACKTRACE_SKIPPED_FRAMES], depth * sizeof(void*));
+    return depth;
+}
+
+#ifdef PROFILE_FRAME_POINTERS
+// once per thread, which may allocate: glibc reads the main thread's stack
+// from /proc/self/maps
+uintptr_t find_stack_top() {
+#ifdef MEM_THREAD_SAFE
+    pthread_attr_t attributes;
+    void* start;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+        return 0;
+    }
+
+    int result = pthread_attr_getstack(&attributes, &start, &size);
+    pthread_attr_destroy(&attributes);
+    return result == 0 ? (uintptr_t)start + size : 0;
+#else
+    // the only thread using a heap which is not thread-safe is taken for the
+    // main one, whose frames are all below where its stack started
+    extern void* __libc_stack_end;
+    return (uintptr_t)__libc_stack_end;
+#endif
+}
+#endif
+
+// -ln(u) * mean for a uniform u in (0, 1], at least 1
+uint64_t next_interval(size_t mean) {
+    if (random_state == 0) {
+        random_state = ((uint64_t)(size_t)&random_state ^ now_ns()) | 1;
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    double u = ((random_state >> 11) + 1) * (1.0 / ((uint64_t)1 << 53));
+    return (uint64_t)(-natural_log(u) * mean) + 1;
+}
+
+// without libm: x = m * 2^e with m in [1, 2), ln m = 2 atanh((m - 1) / (m + 1))
+// by its series, which converges fast for m that small
+double natural_log(double x) {
+    int exponent = 0;
+
+    while (x >= 2) {
+        x /= 2;
+        ++exponent;
+    }
+
+    while (x < 1) {
+        x *= 2;
+        --exponent;
+    }
+
+    double z = (x - 1) / (x + 1);
+    double term = z;
+    double sum = 0;
+
+    for (int k = 1; k < 20; k += 2) {
+        sum += term / k;
+        term *= z * z;
+    }
+    return 2 * sum + exponent * 0.69314718055994531;
+}
+
+// e^x for x <= 0: the series for x / 2^k, squared k times
+double natural_exp(double x) {
+    if (x < -700) {
+        return 0;
+    }
+
+    int halvings = 0;
+
+    while (x < -0.5) {
+        x /= 2;
+        ++halvings;
+    }
+
+    double term = 1;
+    double sum = 1;
+
+    for (int k = 1; k < 16; ++k) {
+        term *= x / k;
+        sum += term;
+    }
+
+    while (halvings-- > 0) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+// the stack with these frames, added if it is new
+ProfileStack* find_stack(void** frames, size_t depth) {
+    uint64_t hash = depth;
+
+    for (size_t i = 0; i < depth; ++i) {
+        hash = (hash ^ (uint64_t)(size_t)frames[i]) * 0x100000001b3;
+    }
+
+    hash |= 1;
+
+    for (size_t slot = hash >> 32 & (STACK_SLOTS - 1); ; slot = (slot + 1) & (STACK_SLOTS - 1)) {
+        ProfileStack* stack = &stacks[slot];
+
+        if (stack->hash == hash && stack->depth == depth
+                && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return stack;
+        }
+
+        if (stack->hash == 0) {
+            if (stack_count >= STACK_SLOTS / 4 * 3) {
+                return &stacks[STACK_SLOTS];
+            }
+
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void*));
+            ++stack_count;
+            return stack;
+        }
+    }
+}
+
+// first slot of hash, in the part of the table of its stripe
+size_t sample_slot(uint64_t hash) {
+    return (hash >> STRIPE_SHIFT) * STRIPE_SLOTS + (hash >> 20 & (STRIPE_SLOTS - 1));
+}
+
+// probes wrap around within the stripe
+size_t next_slot(size_t slot) {
+    return (slot & ~(STRIPE_SLOTS - 1)) | ((slot + 1) & (STRIPE_SLOTS - 1));
+}
+
+// the stripe of hash is locked
+long find_sample(const void* addr, uint64_t hash) {
+    for (size_t slot = sample_slot(hash); samples[slot].addr != NULL; slot = next_slot(slot)) {
+        if (samples[slot].addr == addr) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// a sample left at addr by memory freed inside the profiler is replaced
+void add_sample(void* addr, size_t size, uint32_t stack) {
+    uint64_t hash = profile_hash(addr);
+    SampleStripe* stripe = &stripes[hash >> STRIPE_SHIFT];
+    lock_stripe(stripe);
+    long old = find_sample(addr, hash);
+
+    if (old != -1) {
+        remove_sample(old);
+    }
+
+    if (stripe->count < STRIPE_SLOTS / 4 * 3) {
+        size_t slot = sample_slot(hash);
+
+        while (samples[slot].addr != NULL) {
+            slot = next_slot(slot);
+        }
+
+        samples[slot] = (ProfileSample) { .addr = addr, .size = size, .stack = stack };
+        ++stripe->count;
+        uint8_t* filter = &profile_filter[hash >> PROFILE_FILTER_SHIFT];
+
+        if (*filter != FILTER_MAX) {
+            __atomic_store_n(filter, *filter + 1, __ATOMIC_RELAXED);
+        }
+        count_live(stack, size, 1);
+    }
+
+    unlock_stripe(stripe);
+}
+
+// linear probing without tombstones: the samples after the hole which
+// could be in it move back. The stripe of the sample is locked
+void remove_sample(size_t slot) {
+    ProfileSample removed = samples[slot];
+    uint64_t hash = profile_hash(removed.addr);
+    size_t hole = slot;
+
+    for (size_t next = next_slot(hole); samples[next].addr != NULL; next = next_slot(next)) {
+        size_t home = sample_slot(profile_hash(samples[next].addr));
+
+        if (((next - home) & (STRIPE_SLOTS - 1)) >= ((next - hole) & (STRIPE_SLOTS - 1))) {
+            samples[hole] = samples[next];
+            hole = next;
+        }
+    }
+
+    samples[hole].addr = NULL;
+    --stripes[hash >> STRIPE_SHIFT].count;
+    uint8_t* filter = &profile_filter[hash >> PROFILE_FILTER_SHIFT];
+
+    if (*filter != FILTER_MAX) {
+        __atomic_store_n(filter, *filter - 1, __ATOMIC_RELAXED);
+    }
+    count_live(removed.stack, removed.size, -1);
+}
+
+// stacks of samples in different stripes change at once
+void count_live(uint32_t stack, size_t size, int sign) {
+    __atomic_fetch_add(&stacks[stack].live_count, (uint64_t)(int64_t)sign, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stacks[stack].live_bytes, (uint64_t)(int64_t)sign * size,
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&profile_live_samples, (size_t)(ptrdiff_t)sign, __ATOMIC_RELAXED);
+}
+
+bool write_profile(int fd, MemProfileFormat format) {
+    Output out = { .fd = fd, .length = 0, .failed = false };
+
+    if (format == MEM_PROFILE_PPROF) {
+        write_pprof(&out);
+    } else {
+        write_folded(&out, format);
+    }
+
+    flush_output(&out);
+    return !out.failed;
+}
+
+// heap_v2 lines: "live count: live bytes [allocated count: allocated
+// bytes] @ return addresses", then the mappings pprof symbolizes them with
+void write_pprof(Output* out) {
+    uint64_t totals[4] = { 0, 0, 0, 0 };
+
+    for (size_t i = 0; i <= STACK_SLOTS; ++i) {
+        totals[0] += __atomic_load_n(&stacks[i].live_count, __ATOMIC_RELAXED);
+        totals[1] += __atomic_load_n(&stacks[i].live_bytes, __ATOMIC_RELAXED);
+        totals[2] += stacks[i].alloc_count;
+        totals[3] += stacks[i].alloc_bytes;
+    }
+
+    output(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+            (unsigned long long)totals[0], (unsigned long long)totals[1],
+            (unsigned long long)totals[2], (unsigned long long)totals[3], profile_rate);
+
+    for (size_t i = 0; i <= STACK_SLOTS; ++i) {
+        ProfileStack* stack = &stacks[i];
+
+        if (stack->alloc_count == 0) {
+            continue;
+        }
+
+        output(out, "%llu: %llu [%llu: %llu] @",
+                (unsigned long long)__atomic_load_n(&stack->live_count, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stack->live_bytes, __ATOMIC_RELAXED),
+                (unsigned long long)stack->alloc_count,
+                (unsigned long long)stack->alloc_bytes);
+
+        for (size_t frame = 0; frame < stack->depth; ++frame) {
+            output(out, " %p", stack->frames[frame]);
+        }
+        output(out, "\n");
+    }
+
+    output(out, "\nMAPPED_LIBRARIES:\n");
+    flush_output(out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    ssize_t length;
+
+    while (maps != -1 && (length = read(maps, out->buffer, sizeof(out->buffer))) > 0) {
+        out->length = length;
+        flush_output(out);
+    }
+
+    if (maps != -1) {
+        close(maps);
+    }
+}
+
+// "root;...;leaf bytes", the samples scaled like pprof does
+void write_folded(Output* out, MemProfileFormat format) {
+    uint64_t now = now_ns();
+    double seconds = (now - rate_start_ns) * 1e-9;
+
+    for (size_t i = 0; i <= STACK_SLOTS; ++i) {
+        ProfileStack* stack = &stacks[i];
+        double bytes;
+
+        if (format == MEM_PROFILE_FOLDED_LIVE) {
+            uint64_t count = __atomic_load_n(&stack->live_count, __ATOMIC_RELAXED);
+            uint64_t live = __atomic_load_n(&stack->live_bytes, __ATOMIC_RELAXED);
+            bytes = live * scale(count, live);
+        } else {
+            uint64_t count = stack->alloc_count - stack->rate_count;
+            uint64_t allocated = stack->alloc_bytes - stack->rate_bytes;
+            bytes = seconds > 0 ? allocated * scale(count, allocated) / seconds : 0;
+            stack->rate_count = stack->alloc_count;
+            stack->rate_bytes = stack->alloc_bytes;
+        }
+
+        if (bytes < 1) {
+            continue;
+        }
+
+        if (i == STACK_SLOTS) {
+            output(out, "[stacks beyond the profile table]");
+        } else if (stack->depth == 0) {
+            output(out, "[unknown]");
+        }
+
+        for (size_t frame = stack->depth; frame > 0; --frame) {
+            if (frame != stack->depth) {
+                output(out, ";");
+            }
+            output_frame(out, stack->frames[frame - 1]);
+        }
+        output(out, " %.0f\n", bytes);
+    }
+
+    if (format == MEM_PROFILE_FOLDED_RATE) {
+        rate_start_ns = now;
+    }
+}
+
+// function name, else module+offset, else the address. Frames are return
+// addresses, the byte before is in the call
+void output_frame(Output* out, void* address) {
+    Dl_info info;
+
+    if (dladdr((char*)address - 1, &info) == 0 || info.dli_fname == NULL) {
+        output(out, "%p", address);
+    } else if (info.dli_sname != NULL) {
+        output(out, "%s", info.dli_sname);
+    } else {
+        const char* name = strrchr(info.dli_fname, '/');
+        output(out, "%s+0x%zx", name != NULL ? name + 1 : info.dli_fname,
+                (size_t)address - (size_t)info.dli_fbase);
+    }
+}
+
+// an allocation of s bytes is sampled with a chance of 1 - e^(-s / rate),
+// taking the mean size of the stack's samples for s
+double scale(uint64_t count, uint64_t bytes) {
+    if (count == 0 || bytes == 0) {
+        return 1;
+    }
+
+    double chance = 1 - natural_exp(-(double)bytes / count / profile_rate);
+    return chance > 0 ? 1 / chance : 1;
+}
+
+void output(Output* out, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(&out->buffer[out->length], sizeof(out->buffer) - out->length,
+            format, arguments);
+    va_end(arguments);
+
+    if (length < 0) {
+        return;
+    }
+
+    if ((size_t)length >= sizeof(out->buffer) - out->length) {
+        // did not fit: flush and write it again, cut to the buffer
+        flush_output(out);
+        va_start(arguments, format);
+        length = vsnprintf(out->buffer, sizeof(out->buffer), format, arguments);
+        va_end(arguments);
+        length = length < (int)sizeof(out->buffer) ? length : (int)sizeof(out->buffer) - 1;
+    }
+
+    out->length += length;
+}
+
+void flush_output(Output* out) {
+    for (size_t written = 0; written < out->length && !out->failed; ) {
+        ssize_t result = write(out->fd, &out->buffer[written], out->length - written);
+
+        if (result > 0) {
+            written += result;
+        } else {
+            out->failed = true;
+        }
+    }
+    out->length = 0;
+}
+
+// only a flag, profile_next writes the profile
+void request_dump(int signal) {
+    (void)signal;
+    is_dump_requested = 1;
+}
+
+void write_requested_dump() {
+    char path[PATH_SIZE];
+    is_dump_requested = 0;
+    lock_profile();
+    MemProfileFormat format = dump_format;
+    snprintf(path, sizeof(path), "%s.%ld.%u.%s", dump_prefix, (long)getpid(), dump_count++,
+            format == MEM_PROFILE_PPROF ? "heap" : "folded");
+    unlock_profile();
+    mem_profile_dump(path, format);
+}
+
+void lock_profile() {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+void unlock_profile() {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+void lock_stripe(SampleStripe* stripe) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_lock(&stripe->lock);
+#else
+    (void)stripe;
+#endif
+}
+
+void unlock_stripe(SampleStripe* stripe) {
+#ifdef MEM_THREAD_SAFE
+    pthread_mutex_unlock(&stripe->lock);
+#else
+    (void)stripe;
+#endif
+}
+
+#ifdef MEM_THREAD_SAFE
+// around a fork, so the child finds no table halfway through a change
+void lock_all() {
+    lock_profile();
+
+    for (size_t i = 0; i < SAMPLE_STRIPES; ++i) {
+        lock_stripe(&stripes[i]);
+    }
+}
+
+void unlock_all() {
+    for (size_t i = 0; i < SAMPLE_STRIPES; ++i) {
+        unlock_stripe(&stripes[i]);
+    }
+
+    unlock_profile();
+}
+#endif
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
@@ -35,8 +35,15 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 
 # Object Files
 OBJECTFILES= \
+	${OBJECTDIR}/_ext/361493028/mem_copy.o \
+	${OBJECTDIR}/_ext/361493028/mem_hardening.o \
+	${OBJECTDIR}/_ext/361493028/mem_stats.o \
+	${OBJECTDIR}/_ext/361493028/thread_cache.o \
 	${OBJECTDIR}/allocator.o \
-	${OBJECTDIR}/main.o
+	${OBJECTDIR}/main.o \
+	${OBJECTDIR}/mem_cache.o \
+	${OBJECTDIR}/mem_profile.o \
+	${OBJECTDIR}/page_heap.o
 
 
 # C Compiler Flags
@@ -61,17 +68,52 @@ LDLIBSOPTIONS=
 
 ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/slab_allocator: ${OBJECTFILES}
 	${MKDIR} -p ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}
-	${LINK.c} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/slab_allocator ${OBJECTFILES} ${LDLIBSOPTIONS} -lm
+	${LINK.c} -o ${CND_DISTDIR}/${CND_CONF}/${CND_PLATFORM}/slab_allocator ${OBJECTFILES} ${LDLIBSOPTIONS}
+
+${OBJECTDIR}/_ext/361493028/mem_copy.o: ../alloc_common/mem_copy.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_copy.o ../alloc_common/mem_copy.c
+
+${OBJECTDIR}/_ext/361493028/mem_hardening.o: ../alloc_common/mem_hardening.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_hardening.o ../alloc_common/mem_hardening.c
+
+${OBJECTDIR}/_ext/361493028/mem_stats.o: ../alloc_common/mem_stats.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/mem_stats.o ../alloc_common/mem_stats.c
+
+${OBJECTDIR}/_ext/361493028/thread_cache.o: ../alloc_common/thread_cache.c 
+	${MKDIR} -p ${OBJECTDIR}/_ext/361493028
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/_ext/361493028/thread_cache.o ../alloc_common/thread_cache.c
 
 ${OBJECTDIR}/allocator.o: allocator.c 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} $@.d
-	$(COMPILE.c) -g -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/allocator.o allocator.c
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/allocator.o allocator.c
 
 ${OBJECTDIR}/main.o: main.c 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} $@.d
-	$(COMPILE.c) -g -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/main.o main.c
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/main.o main.c
+
+${OBJECTDIR}/mem_cache.o: mem_cache.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/mem_cache.o mem_cache.c
+
+${OBJECTDIR}/mem_profile.o: mem_profile.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/mem_profile.o mem_profile.c
+
+${OBJECTDIR}/page_heap.o: page_heap.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I../alloc_common -std=c99 -MMD -MP -MF $@.d -o ${OBJECTDIR}/page_heap.o page_heap.c
 
 # Subprojects
 .build-subprojects:
@@ -0,0 +1,1321 @@
+#define _DEFAULT_SOURCE
+
+#include "page_heap.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// pages are bound to nodes with the mbind system call, so there is no
+// libnuma to link; elsewhere there is a single node
+#if defined(SYS_mbind) && defined(SYS_getcpu)
+#include <linux/mempolicy.h>
+#define NUMA_BINDING
+#endif
+
+// overcommit: userfaultfd reports the faults on pages which are out and the
+// first write to pages it protects, which needs Linux 5.7 or later
+#if defined(SLAB_PAGING) && defined(SYS_userfaultfd)
+#include <errno.h>
+#include <linux/falloc.h>
+#include <linux/userfaultfd.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#define PAGING
+#endif
+
+#define MAX_CHUNKS 4096
+// pages this big are backed by transparent huge pages
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+// take_pages_on: chunks of every node
+#define ANY_NODE SLAB_MAX_NODES
+// threads seldom move to another node, page_heap_node asks the kernel again
+// after this many calls
+#define NODE_CHECK_PERIOD 64
+// page_heap_set_decay
+#define DEFAULT_DECAY_MS 1000
+// page_heap_set_paging: fewer resident pages than this could leave an
+// instruction without all the pages it touches
+#define MIN_RESIDENT_PAGES 16
+// dirty pages a turn of the clock writes back at most
+#define WRITE_BACK_BATCH 16
+
+// mapped from the OS as a whole: metadata first, then page_count pages
+typedef struct Chunk {
+    void* pages_start;
+    size_t page_count;
+    size_t free_page_count;
+    // words below this index have no free pages
+    size_t first_free_word;
+    // bytes mapped for the chunk, metadata included
+    size_t mapped_size;
+    // pool the chunk belongs to
+    size_t node;
+    // number of pages of the run starting at the page, 0 for block pages
+    uint32_t* run_pages;
+    // bit i of word i / 64 is set when page i is free and may still be
+    // resident, freed_at has the time it was freed in milliseconds
+    uint64_t* dirty_map;
+    uint32_t* freed_at;
+#ifdef SLAB_OUTLINE_HEADERS
+    // SLAB_PAGE_META_SIZE bytes for every page, cache line aligned
+    void* page_meta;
+#endif
+#ifdef PAGING
+    // page i is page swap_base + i of the swap file
+    size_t swap_base;
+    // bit i of word i / 64 is set when page i is in RAM, was used since the
+    // clock last passed it, differs from its copy in the swap file, is write
+    // protected, has a copy in the swap file
+    uint64_t* resident_map;
+    uint64_t* referenced_map;
+    uint64_t* modified_map;
+    uint64_t* protected_map;
+    uint64_t* swapped_map;
+    // time the clock last found page i used, in milliseconds
+    uint32_t* used_at;
+#endif
+    // bit i of word i / 64 is set when page i is free
+    uint64_t free_page_map[];
+} Chunk;
+
+static Chunk* create_chunk(size_t page_count, size_t node);
+static void bind_pages(void* start, size_t size, size_t node);
+static uint64_t read_online_nodes();
+static void destroy_chunk(size_t index);
+static long find_chunk_index(void* addr);
+static void* take_pages(size_t pages_number, uint32_t run_length);
+static void* take_pages_on(size_t node, size_t pages_number, uint32_t run_length);
+static void* take_chunk_pages(Chunk* chunk, size_t pages_number, uint32_t run_length);
+static long find_page_sequence(Chunk* chunk, size_t pages_needed);
+static void mark_pages(Chunk* chunk, size_t first_page, size_t count, bool is_free);
+static bool is_page_free(Chunk* chunk, size_t page_index);
+static bool are_pages_free(Chunk* chunk, size_t first_page, size_t count);
+static void set_bits(uint64_t* map, size_t first, size_t count, bool value);
+static void pages_freed(Chunk* chunk, size_t first_page, size_t count);
+static size_t release_pages(Chunk* chunk, size_t first_page, size_t count);
+static size_t scavenge(bool all);
+static uint64_t now_ms();
+#ifdef PAGING
+static bool watch_chunk(Chunk* chunk);
+static void find_resident_pages(Chunk* chunk);
+static void* serve_faults(void* arg);
+static void page_in(Chunk* chunk, size_t page);
+static void evict_pages(Chunk* keep_chunk, size_t keep_page);
+static bool evict_one(Chunk* keep_chunk, size_t keep_page);
+static bool next_resident_page(Chunk** chunk, size_t* page);
+static bool evict_page(Chunk* chunk, size_t page);
+static bool write_back(Chunk* chunk, size_t page);
+static void protect_page(Chunk* chunk, size_t page, bool protect);
+static void wake_page(void* address);
+static bool test_bit(const uint64_t* map, size_t bit);
+static size_t count_bits(const uint64_t* map, size_t first, size_t count);
+#endif
+
+static const size_t page_size = SLAB_PAGE_SIZE;
+
+// sorted by address
+static Chunk* chunks[MAX_CHUNKS];
+static size_t chunk_count = 0;
+static bool is_initialized = false;
+static bool is_growable = false;
+// minimal number of pages in a chunk
+static size_t chunk_pages = 0;
+// bit i is set when node i is online; pools go up to the highest one
+static uint64_t online_nodes = 1;
+static size_t node_count = 1;
+static bool is_interleaved = false;
+// see page_heap_set_decay
+static long decay_ms = DEFAULT_DECAY_MS;
+static uint64_t last_scavenge = 0;
+
+#ifdef NUMA_BINDING
+static __thread size_t thread_node = 0;
+static __thread unsigned int node_calls = 0;
+#endif
+
+#ifdef PAGING
+// paging_lock guards everything below and chunks[] once paging is on; the
+// heap lock is taken first. is_paging changes under both
+static pthread_mutex_t paging_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool is_paging = false;
+static int fault_fd = -1;
+static int swap_fd = -1;
+// page_size bytes the fault handler reads pages into
+static void* bounce_page = NULL;
+static size_t resident_limit = 0;
+static size_t resident_count = 0;
+static long working_set_ms = 0;
+// swap file pages of the chunks are never reused, holes are punched instead
+static size_t next_swap_page = 0;
+static uint64_t fault_count = 0;
+static uint64_t eviction_count = 0;
+static uint64_t write_back_count = 0;
+// the clock hand: next page it looks at
+static size_t clock_chunk = 0;
+static size_t clock_page = 0;
+#endif
+
+bool page_heap_init(size_t page_count, bool growable, bool interleave) {
+    if (is_initialized) {
+        return false;
+    }
+
+    is_initialized = true;
+    is_growable = growable;
+    is_interleaved = interleave;
+    online_nodes = read_online_nodes();
+    node_count = 64 - __builtin_clzll(online_nodes);
+    chunk_pages = page_count;
+
+    if (growable || interleave || node_count == 1) {
+        // growable heaps map the chunks of other nodes when they need them
+        return create_chunk(page_count, page_heap_node()) != NULL;
+    }
+
+    // the fixed heap is shared out between the online nodes, a page at least
+    size_t nodes_left = __builtin_popcountll(online_nodes);
+
+    for (size_t node = 0; node < node_count; ++node) {
+        if ((online_nodes >> node & 1) == 0) {
+            continue;
+        }
+
+        size_t pages = page_count / nodes_left > 0 ? page_count / nodes_left : 1;
+
+        if (create_chunk(pages, node) == NULL) {
+            return false;
+        }
+
+        page_count -= pages < page_count ? pages : page_count;
+        --nodes_left;
+    }
+    return true;
+}
+
+bool page_heap_is_initialized() {
+    return is_initialized;
+}
+
+size_t page_heap_node_count() {
+    return is_interleaved ? 1 : node_count;
+}
+
+size_t page_heap_node() {
+#ifdef NUMA_BINDING
+    if (node_count == 1 || is_interleaved) {
+        return 0;
+    }
+
+    if (node_calls++ % NODE_CHECK_PERIOD == 0) {
+        unsigned int cpu;
+        unsigned int node;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < node_count) {
+            thread_node = node;
+        }
+    }
+    return thread_node;
+#else
+    return 0;
+#endif
+}
+
+void page_heap_set_decay(long decay) {
+    decay_ms = decay;
+}
+
+size_t page_heap_trim() {
+    return scavenge(true);
+}
+
+void* alloc_page_run(size_t pages_number) {
+    return take_pages(pages_number, pages_number);
+}
+
+void* alloc_page_run_aligned(size_t pages_number, size_t alignment, size_t skew) {
+    size_t extra = alignment / page_size - 1;
+
+    if (pages_number > UINT32_MAX - extra) {
+        return NULL;
+    }
+
+    // a run with room for the alignment, then the pages around the aligned
+    // part go back
+    void* run = take_pages(pages_number + extra, pages_number + extra);
+
+    if (run == NULL) {
+        return NULL;
+    }
+
+    Chunk* chunk = chunks[find_chunk_index(run)];
+    size_t first_page = ((size_t)run - (size_t)chunk->pages_start) / page_size;
+    size_t start = (((size_t)run + skew + alignment - 1) & ~(alignment - 1)) - skew;
+    size_t head = (start - (size_t)run) / page_size;
+
+    chunk->run_pages[first_page] = 0;
+    chunk->run_pages[first_page + head] = pages_number;
+    mark_pages(chunk, first_page, head, true);
+    mark_pages(chunk, first_page + head + pages_number, extra - head, true);
+    chunk->free_page_count += extra;
+    return (void*)start;
+}
+
+void* alloc_block_page() {
+    return take_pages(1, 0);
+}
+
+bool resize_page_run(void* page, size_t pages_number) {
+    long index = find_chunk_index(page);
+
+    if (index == -1 || pages_number == 0) {
+        return false;
+    }
+
+    Chunk* chunk = chunks[index];
+    size_t page_index = ((size_t)page - (size_t)chunk->pages_start) / page_size;
+    size_t run_length = chunk->run_pages[page_index];
+
+    if (run_length == 0) {
+        return false;   // block page
+    }
+
+    if (pages_number <= run_length) {
+        // give the tail of the run back
+        mark_pages(chunk, page_index + pages_number, run_length - pages_number, true);
+        chunk->free_page_count += run_length - pages_number;
+        pages_freed(chunk, page_index + pages_number, run_length - pages_number);
+    } else {
+        // take the pages right after the run
+        size_t extra = pages_number - run_length;
+
+        if (pages_number > chunk->page_count - page_index
+                || !are_pages_free(chunk, page_index + run_length, extra)) {
+            return false;
+        }
+
+        mark_pages(chunk, page_index + run_length, extra, false);
+        chunk->free_page_count -= extra;
+    }
+
+    chunk->run_pages[page_index] = pages_number;
+    return true;
+}
+
+void free_pages(void* page) {
+    long index = find_chunk_index(page);
+
+    if (index == -1) {
+        return;
+    }
+
+    Chunk* chunk = chunks[index];
+    size_t page_index = ((size_t)page - (size_t)chunk->pages_start) / page_size;
+
+    if (is_page_free(chunk, page_index)) {
+        return;
+    }
+
+    size_t count = chunk->run_pages[page_index] ? chunk->run_pages[page_index] : 1;
+    chunk->run_pages[page_index] = 0;
+    mark_pages(chunk, page_index, count, true);
+    chunk->free_page_count += count;
+
+    // give completely free chunks back, but keep at least one
+    if (is_growable && chunk->free_page_count == chunk->page_count && chunk_count > 1) {
+        destroy_chunk(index);
+    } else {
+        pages_freed(chunk, page_index, count);
+    }
+}
+
+size_t page_run_length(void* addr) {
+    long index = find_chunk_index(addr);
+
+    if (index == -1) {
+        return 0;
+    }
+
+    Chunk* chunk = chunks[index];
+    return chunk->run_pages[((size_t)addr - (size_t)chunk->pages_start) / page_size];
+}
+
+bool page_in_heap(void* addr) {
+    return find_chunk_index(addr) != -1;
+}
+
+#ifdef SLAB_OUTLINE_HEADERS
+void* page_metadata(void* addr) {
+    long index = find_chunk_index(addr);
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    Chunk* chunk = chunks[index];
+    size_t page_index = ((size_t)addr - (size_t)chunk->pages_start) / page_size;
+    return (void*)((size_t)chunk->page_meta + page_index * SLAB_PAGE_META_SIZE);
+}
+#endif
+
+void page_heap_usage(size_t* mapped_size, size_t* page_count, size_t* free_page_count) {
+    *mapped_size = *page_count = *free_page_count = 0;
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        *mapped_size += chunks[i]->mapped_size;
+        *page_count += chunks[i]->page_count;
+        *free_page_count += chunks[i]->free_page_count;
+    }
+}
+
+bool page_heap_start_paging(const char* swap_path) {
+#ifdef PAGING
+    pthread_mutex_lock(&paging_lock);
+
+    if (fault_fd != -1) {
+        pthread_mutex_unlock(&paging_lock);
+        return true;
+    }
+
+    // kernels which let unprivileged processes handle user faults only
+    // still fault in system calls touching pages which are out: they fail
+    // with EFAULT
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+
+    if (fd == -1) {
+        fd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+    }
+
+    struct uffdio_api api = { .api = UFFD_API };
+
+    if (fd != -1 && (ioctl(fd, UFFDIO_API, &api) != 0
+            || !(api.ioctls & ((uint64_t)1 << _UFFDIO_REGISTER)))) {
+        close(fd);
+        fd = -1;
+    }
+
+    // the pages only ever go back through the fault handler, the file is
+    // of no use to anyone else
+    swap_fd = fd != -1 ? open(swap_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+
+    if (swap_fd != -1) {
+        unlink(swap_path);
+        bounce_page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    pthread_t thread;
+
+    if (swap_fd == -1 || bounce_page == MAP_FAILED) {
+        bounce_page = NULL;
+    } else {
+        fault_fd = fd;
+
+        if (pthread_create(&thread, NULL, serve_faults, NULL) == 0) {
+            pthread_detach(thread);
+        } else {
+            fault_fd = -1;
+        }
+    }
+
+    if (fault_fd == -1) {
+        if (swap_fd != -1) {
+            close(swap_fd);
+            swap_fd = -1;
+        }
+
+        if (bounce_page != NULL) {
+            munmap(bounce_page, page_size);
+            bounce_page = NULL;
+        }
+
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    pthread_mutex_unlock(&paging_lock);
+    return fault_fd != -1;
+#else
+    (void)swap_path;
+    return false;
+#endif
+}
+
+bool page_heap_set_paging(size_t resident_pages, long window_ms) {
+#ifdef PAGING
+    if (fault_fd == -1) {
+        return false;
+    }
+
+    // faults of the chunks wait for the resident pages to be found
+    pthread_mutex_lock(&paging_lock);
+
+    if (!is_paging) {
+        for (size_t i = 0; i < chunk_count; ++i) {
+            if (!watch_chunk(chunks[i])) {
+                pthread_mutex_unlock(&paging_lock);
+                return false;
+            }
+        }
+
+        // pages touched before are in RAM, with no copy
+        for (size_t i = 0; i < chunk_count; ++i) {
+            find_resident_pages(chunks[i]);
+        }
+    }
+
+    is_paging = true;
+    resident_limit = resident_pages == 0 || resident_pages > MIN_RESIDENT_PAGES
+            ? resident_pages : MIN_RESIDENT_PAGES;
+    working_set_ms = window_ms;
+    evict_pages(NULL, 0);
+    pthread_mutex_unlock(&paging_lock);
+    return true;
+#else
+    (void)resident_pages;
+    (void)window_ms;
+    return false;
+#endif
+}
+
+void page_heap_paging_usage(uint64_t* faults, uint64_t* evictions, uint64_t* write_backs,
+                            size_t* resident_pages, size_t* swapped_pages) {
+    *faults = *evictions = *write_backs = 0;
+    *resident_pages = *swapped_pages = 0;
+#ifdef PAGING
+    if (!is_paging) {
+        return;
+    }
+
+    pthread_mutex_lock(&paging_lock);
+    *faults = fault_count;
+    *evictions = eviction_count;
+    *write_backs = write_back_count;
+    *resident_pages = resident_count;
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        Chunk* chunk = chunks[i];
+
+        for (size_t word = 0; word < (chunk->page_count + 63) / 64; ++word) {
+            *swapped_pages += __builtin_popcountll(chunk->swapped_map[word]
+                    & ~chunk->resident_map[word]);
+        }
+    }
+    pthread_mutex_unlock(&paging_lock);
+#endif
+}
+
+void visit_pages(PageVisitor visitor) {
+    size_t page_number = 0;
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        Chunk* chunk = chunks[i];
+
+        for (size_t page = 0; page < chunk->page_count; ++page) {
+            void* address = (void*)((size_t)chunk->pages_start + page * page_size);
+            size_t run_length = chunk->run_pages[page];
+            visitor(page_number, address, run_length, is_page_free(chunk, page));
+
+            if (run_length > 1) {
+                page += run_length - 1;
+                page_number += run_length - 1;
+            }
+            ++page_number;
+        }
+    }
+}
+
+Chunk* create_chunk(size_t page_count, size_t node) {
+    if (chunk_count == MAX_CHUNKS || page_count == 0 || page_count > UINT32_MAX) {
+        return NULL;
+    }
+
+    size_t map_words = (page_count + 63) / 64;
+    // free and dirty page maps, run lengths and free times
+    size_t metadata_size = sizeof(Chunk) + 2 * map_words * sizeof(uint64_t)
+            + 2 * page_count * sizeof(uint32_t);
+#ifdef PAGING
+    metadata_size += 5 * map_words * sizeof(uint64_t) + page_count * sizeof(uint32_t);
+#endif
+#ifdef SLAB_OUTLINE_HEADERS
+    size_t page_meta_offset = (metadata_size + SLAB_PAGE_META_SIZE - 1)
+            / SLAB_PAGE_META_SIZE * SLAB_PAGE_META_SIZE;
+    metadata_size = page_meta_offset + page_count * SLAB_PAGE_META_SIZE;
+#endif
+    size_t os_page_size = sysconf(_SC_PAGESIZE);
+    metadata_size = (metadata_size + os_page_size - 1) / os_page_size * os_page_size;
+    size_t mapped_size = metadata_size + page_count * page_size;
+
+    // mmap returns OS page aligned memory, pages bigger than that need a
+    // page_size aligned start: map more and give back what is left around
+    // the chunk. Fresh mappings are zero filled
+    size_t slack = page_size > os_page_size ? page_size - os_page_size : 0;
+    void* base = mmap(NULL, mapped_size + slack, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    size_t pages_start = ((size_t)base + metadata_size + page_size - 1) & ~(page_size - 1);
+    size_t start = pages_start - metadata_size;
+    size_t end = start + mapped_size;
+
+    if (start != (size_t)base) {
+        munmap(base, start - (size_t)base);
+    }
+
+    if (end != (size_t)base + mapped_size + slack) {
+        munmap((void*)end, (size_t)base + mapped_size + slack - end);
+    }
+
+    // before anything is written, so the metadata goes to the node too
+    bind_pages((void*)start, mapped_size, node);
+
+#ifdef MADV_HUGEPAGE
+    if (page_size >= HUGE_PAGE_SIZE) {
+        madvise((void*)pages_start, page_count * page_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    Chunk* chunk = (Chunk*)start;
+    chunk->pages_start = (void*)pages_start;
+    chunk->page_count = page_count;
+    chunk->free_page_count = 0;
+    chunk->first_free_word = 0;
+    chunk->mapped_size = mapped_size;
+    chunk->node = node;
+    chunk->dirty_map = &chunk->free_page_map[map_words];
+    chunk->run_pages = (uint32_t*)&chunk->free_page_map[2 * map_words];
+    chunk->freed_at = &chunk->run_pages[page_count];
+#ifdef SLAB_OUTLINE_HEADERS
+    chunk->page_meta = (void*)(start + page_meta_offset);
+#endif
+    mark_pages(chunk, 0, page_count, true);
+    chunk->free_page_count = page_count;
+#ifdef PAGING
+    chunk->resident_map = (uint64_t*)&chunk->freed_at[page_count];
+    chunk->referenced_map = &chunk->resident_map[map_words];
+    chunk->modified_map = &chunk->resident_map[2 * map_words];
+    chunk->protected_map = &chunk->resident_map[3 * map_words];
+    chunk->swapped_map = &chunk->resident_map[4 * map_words];
+    chunk->used_at = (uint32_t*)&chunk->resident_map[5 * map_words];
+
+    if (is_paging && !watch_chunk(chunk)) {
+        munmap(chunk, mapped_size);
+        return NULL;
+    }
+
+    if (is_paging) {
+        pthread_mutex_lock(&paging_lock);
+    }
+#endif
+
+    size_t index = chunk_count;
+
+    while (index > 0 && chunks[index - 1]->pages_start > chunk->pages_start) {
+        chunks[index] = chunks[index - 1];
+        --index;
+    }
+
+    chunks[index] = chunk;
+    ++chunk_count;
+#ifdef PAGING
+    if (is_paging) {
+        clock_chunk = clock_page = 0;
+        pthread_mutex_unlock(&paging_lock);
+    }
+#endif
+    return chunk;
+}
+
+// best effort: without mbind, or when the process may not use it, pages go
+// to the node of the thread which touches them first
+void bind_pages(void* start, size_t size, size_t node) {
+#ifdef NUMA_BINDING
+    if (node_count == 1) {
+        return;
+    }
+
+    // preferred rather than bound, so a full node spills over to the others
+    unsigned long mask = is_interleaved ? online_nodes : (unsigned long)1 << node;
+    syscall(SYS_mbind, start, size, is_interleaved ? MPOL_INTERLEAVE : MPOL_PREFERRED,
+            &mask, 8 * sizeof(mask) + 1, 0);
+#else
+    (void)start;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// nodes listed in sysfs as "0", "0-3" or "0,2-3"; node 0 alone when there is
+// no list. Read without stdio, which may call malloc
+uint64_t read_online_nodes() {
+#ifdef NUMA_BINDING
+    char list[256];
+    int file = open("/sys/devices/system/node/online", O_RDONLY);
+
+    if (file == -1) {
+        return 1;
+    }
+
+    ssize_t length = read(file, list, sizeof(list) - 1);
+    close(file);
+
+    if (length <= 0) {
+        return 1;
+    }
+
+    list[length] = '\0';
+    uint64_t nodes = 0;
+    size_t first = 0;
+    size_t number = 0;
+    bool in_range = false;
+
+    for (char* c = list; ; ++c) {
+        if (*c >= '0' && *c <= '9') {
+            number = number * 10 + (*c - '0');
+        } else if (*c == '-') {
+            first = number;
+            number = 0;
+            in_range = true;
+        } else {
+            for (size_t node = in_range ? first : number;
+                    node <= number && node < SLAB_MAX_NODES; ++node) {
+                nodes |= (uint64_t)1 << node;
+            }
+
+            if (*c != ',') {
+                break;
+            }
+
+            number = 0;
+            in_range = false;
+        }
+    }
+    return nodes != 0 ? nodes : 1;
+#else
+    return 1;
+#endif
+}
+
+void destroy_chunk(size_t index) {
+    Chunk* chunk = chunks[index];
+
+#ifdef PAGING
+    if (is_paging) {
+        pthread_mutex_lock(&paging_lock);
+        resident_count -= count_bits(chunk->resident_map, 0, chunk->page_count);
+        clock_chunk = clock_page = 0;
+        syscall(SYS_fallocate, swap_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)(chunk->swap_base * page_size), (off_t)(chunk->page_count * page_size));
+    }
+#endif
+
+    for (size_t i = index; i + 1 < chunk_count; ++i) {
+        chunks[i] = chunks[i + 1];
+    }
+
+    --chunk_count;
+    munmap(chunk, chunk->mapped_size);
+#ifdef PAGING
+    if (is_paging) {
+        pthread_mutex_unlock(&paging_lock);
+    }
+#endif
+}
+
+long find_chunk_index(void* addr) {
+    size_t low = 0;
+    size_t high = chunk_count;
+
+    // last chunk which starts at or below addr
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+
+        if (chunks[middle]->pages_start <= addr) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == 0) {
+        return -1;
+    }
+
+    Chunk* chunk = chunks[low - 1];
+
+    if ((size_t)addr >= (size_t)chunk->pages_start + chunk->page_count * page_size) {
+        return -1;
+    }
+    return low - 1;
+}
+
+void* take_pages(size_t pages_number, uint32_t run_length) {
+    size_t node = page_heap_node();
+    void* pages = take_pages_on(node, pages_number, run_length);
+
+    if (pages == NULL && is_growable) {
+        // no chunk of the node has enough free pages, map one more
+        Chunk* chunk = create_chunk(pages_number > chunk_pages ? pages_number : chunk_pages,
+                node);
+
+        if (chunk != NULL) {
+            pages = take_chunk_pages(chunk, pages_number, run_length);
+        }
+    }
+
+    if (pages == NULL && page_heap_node_count() > 1) {
+        // pages of another node rather than none
+        pages = take_pages_on(ANY_NODE, pages_number, run_length);
+    }
+    return pages;
+}
+
+void* take_pages_on(size_t node, size_t pages_number, uint32_t run_length) {
+    for (size_t i = 0; i < chunk_count; ++i) {
+        if (node == ANY_NODE || chunks[i]->node == node) {
+            void* pages = take_chunk_pages(chunks[i], pages_number, run_length);
+
+            if (pages != NULL) {
+                return pages;
+            }
+        }
+    }
+    return NULL;
+}
+
+void* take_chunk_pages(Chunk* chunk, size_t pages_number, uint32_t run_length) {
+    if (chunk->free_page_count < pages_number) {
+        return NULL;
+    }
+
+    long first_free_page = find_page_sequence(chunk, pages_number);
+
+    if (first_free_page == -1) {
+        return NULL;
+    }
+
+    mark_pages(chunk, first_free_page, pages_number, false);
+    chunk->free_page_count -= pages_number;
+    chunk->run_pages[first_free_page] = run_length;
+    return (void*)((size_t)chunk->pages_start + first_free_page * page_size);
+}
+
+long find_page_sequence(Chunk* chunk, size_t pages_needed) {
+    size_t map_words = (chunk->page_count + 63) / 64;
+    // free pages at the top of the words scanned so far
+    size_t run = 0;
+
+    for (size_t i = chunk->first_free_word; i < map_words; ++i) {
+        uint64_t word = chunk->free_page_map[i];
+
+        if (word == 0 && i == chunk->first_free_word) {
+            ++chunk->first_free_word;  // nothing free below, skip it next time
+        }
+
+        if (word == ~(uint64_t)0) {
+            run += 64;
+
+            if (run >= pages_needed) {
+                return (i + 1) * 64 - run;
+            }
+
+            continue;
+        }
+
+        // run from the previous words continues at the bottom of this word
+        if (run + __builtin_ctzll(~word) >= pages_needed) {
+            return i * 64 - run;
+        }
+
+        if (pages_needed <= 64) {
+            // bit j stays set only if pages j .. j + pages_needed - 1 are free
+            uint64_t starts = word;
+
+            for (size_t length = 1; length < pages_needed && starts != 0; ) {
+                size_t step = length < pages_needed - length ? length : pages_needed - length;
+                starts &= starts >> step;
+                length += step;
+            }
+
+            if (starts != 0) {
+                return i * 64 + __builtin_ctzll(starts);
+            }
+        }
+
+        run = __builtin_clzll(~word);
+    }
+    return -1;
+}
+
+void mark_pages(Chunk* chunk, size_t first_page, size_t count, bool is_free) {
+    set_bits(chunk->free_page_map, first_page, count, is_free);
+
+    if (is_free && first_page / 64 < chunk->first_free_word) {
+        chunk->first_free_word = first_page / 64;
+    }
+}
+
+bool is_page_free(Chunk* chunk, size_t page_index) {
+    return (chunk->free_page_map[page_index / 64] >> (page_index % 64)) & 1;
+}
+
+bool are_pages_free(Chunk* chunk, size_t first_page, size_t count) {
+    size_t page = first_page;
+    size_t end = first_page + count;
+
+    while (page < end) {
+        size_t bit = page % 64;
+        size_t bits = end - page < 64 - bit ? end - page : 64 - bit;
+        uint64_t mask = (bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << bit;
+
+        if ((chunk->free_page_map[page / 64] & mask) != mask) {
+            return false;
+        }
+        page += bits;
+    }
+    return true;
+}
+
+void set_bits(uint64_t* map, size_t first, size_t count, bool value) {
+    size_t page = first;
+    size_t end = first + count;
+
+    while (page < end) {
+        size_t word = page / 64;
+        size_t bit = page % 64;
+        size_t bits = end - page < 64 - bit ? end - page : 64 - bit;
+        uint64_t mask = (bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << bit;
+
+        if (value) {
+            map[word] |= mask;
+        } else {
+            map[word] &= ~mask;
+        }
+        page += bits;
+    }
+}
+
+// free_pages runs the scavenger once per decay_ms
+void pages_freed(Chunk* chunk, size_t first_page, size_t count) {
+#ifdef PAGING
+    if (is_paging) {
+        // what freed pages hold is of no use: they go without being written
+        // back, unless a write which does not fault may still come
+        pthread_mutex_lock(&paging_lock);
+        set_bits(chunk->swapped_map, first_page, count, false);
+
+        for (size_t page = first_page; page < first_page + count; ++page) {
+            if (test_bit(chunk->protected_map, page)) {
+                set_bits(chunk->modified_map, page, 1, false);
+            }
+        }
+        pthread_mutex_unlock(&paging_lock);
+    }
+#endif
+
+    if (decay_ms == 0) {
+        release_pages(chunk, first_page, count);
+        return;
+    }
+
+    uint64_t now = now_ms();
+    set_bits(chunk->dirty_map, first_page, count, true);
+
+    for (size_t page = first_page; page < first_page + count; ++page) {
+        chunk->freed_at[page] = (uint32_t)now;
+    }
+
+    if (decay_ms > 0 && now - last_scavenge >= (uint64_t)decay_ms) {
+        scavenge(false);
+    }
+}
+
+size_t release_pages(Chunk* chunk, size_t first_page, size_t count) {
+#ifdef PAGING
+    // under the lock, the clock must not write back a page being dropped:
+    // reading it would fault in the thread which serves faults
+    if (is_paging) {
+        pthread_mutex_lock(&paging_lock);
+    }
+#endif
+
+    madvise((void*)((size_t)chunk->pages_start + first_page * page_size),
+            count * page_size, MADV_DONTNEED);
+
+#ifdef PAGING
+    if (is_paging) {
+        resident_count -= count_bits(chunk->resident_map, first_page, count);
+        set_bits(chunk->resident_map, first_page, count, false);
+        set_bits(chunk->referenced_map, first_page, count, false);
+        set_bits(chunk->modified_map, first_page, count, false);
+        set_bits(chunk->protected_map, first_page, count, false);
+        pthread_mutex_unlock(&paging_lock);
+    }
+#endif
+    return count * page_size;
+}
+
+// dirty pages free for decay_ms (or all of them) go back to the OS, one
+// madvise per sequence
+size_t scavenge(bool all) {
+    uint64_t now = now_ms();
+    size_t released = 0;
+    last_scavenge = now;
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        Chunk* chunk = chunks[i];
+        size_t map_words = (chunk->page_count + 63) / 64;
+        // first page of the sequence being given back, -1 if none
+        long start = -1;
+
+        for (size_t word = 0; word < map_words; ++word) {
+            // pages which were taken again are no longer dirty
+            uint64_t dirty = chunk->dirty_map[word] & chunk->free_page_map[word];
+            uint64_t release = 0;
+
+            for (uint64_t bits = dirty; bits != 0; bits &= bits - 1) {
+                size_t page = word * 64 + __builtin_ctzll(bits);
+
+                if (all || (uint32_t)now - chunk->freed_at[page] >= (uint64_t)decay_ms) {
+                    release |= bits & -bits;
+                }
+            }
+
+            chunk->dirty_map[word] = dirty & ~release;
+
+            if (release == (start == -1 ? 0 : ~(uint64_t)0)) {
+                continue;   // no sequence starts or ends in the word
+            }
+
+            for (size_t bit = 0; bit < 64; ++bit) {
+                size_t page = word * 64 + bit;
+
+                if ((release >> bit & 1) && start == -1) {
+                    start = page;
+                } else if (!(release >> bit & 1) && start != -1) {
+                    released += release_pages(chunk, start, page - start);
+                    start = -1;
+                }
+            }
+        }
+
+        if (start != -1) {
+            released += release_pages(chunk, start, chunk->page_count - start);
+        }
+    }
+    return released;
+}
+
+uint64_t now_ms() {
+    struct timespec ts;
+    // the coarse clock is read without a system call
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#ifdef PAGING
+// page faults of the chunk's pages go to the handler thread; a page which is
+// written protected first reports that write
+bool watch_chunk(Chunk* chunk) {
+    struct uffdio_register range = {
+        .range = { .start = (uint64_t)(size_t)chunk->pages_start,
+                   .len = chunk->page_count * page_size },
+        .mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP
+    };
+
+    if (ioctl(fault_fd, UFFDIO_REGISTER, &range) != 0) {
+        return false;
+    }
+
+    chunk->swap_base = next_swap_page;
+    next_swap_page += chunk->page_count;
+    return true;
+}
+
+// a page with any of its OS pages in RAM is resident. The bounce page holds
+// the mincore vector, there is no malloc under the heap lock
+void find_resident_pages(Chunk* chunk) {
+    size_t os_page_size = sysconf(_SC_PAGESIZE);
+    size_t os_pages = chunk->page_count * (page_size / os_page_size);
+    unsigned char* vector = bounce_page;
+    uint32_t now = now_ms();
+
+    for (size_t first = 0; first < os_pages; first += page_size) {
+        size_t count = os_pages - first < page_size ? os_pages - first : page_size;
+
+        if (mincore((char*)chunk->pages_start + first * os_page_size,
+                count * os_page_size, vector) != 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t page = (first + i) / (page_size / os_page_size);
+
+            if ((vector[i] & 1) && !test_bit(chunk->resident_map, page)) {
+                set_bits(chunk->resident_map, page, 1, true);
+                set_bits(chunk->referenced_map, page, 1, true);
+                set_bits(chunk->modified_map, page, 1, true);
+                chunk->used_at[page] = now;
+                ++resident_count;
+            }
+        }
+    }
+}
+
+// the handler thread: never allocates, it would fault on the heap itself
+void* serve_faults(void* arg) {
+    (void)arg;
+    struct uffd_msg message;
+
+    for (;;) {
+        if (read(fault_fd, &message, sizeof(message)) != sizeof(message)) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return NULL;
+        }
+
+        if (message.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        void* address = (void*)((size_t)message.arg.pagefault.address & ~(page_size - 1));
+        pthread_mutex_lock(&paging_lock);
+        long index = find_chunk_index(address);
+
+        if (index == -1) {
+            // the chunk is gone, the thread finds it unmapped now
+            wake_page(address);
+        } else {
+            Chunk* chunk = chunks[index];
+            size_t page = ((size_t)address - (size_t)chunk->pages_start) / page_size;
+
+            if (!(message.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+                page_in(chunk, page);
+            } else if (test_bit(chunk->resident_map, page)) {
+                set_bits(chunk->referenced_map, page, 1, true);
+                set_bits(chunk->modified_map, page, 1, true);
+                protect_page(chunk, page, false);
+            } else {
+                // evicted after the write faulted, it faults again
+                wake_page(address);
+            }
+        }
+        pthread_mutex_unlock(&paging_lock);
+    }
+}
+
+// from the swap file, or zero filled when the page has no copy, which is
+// what it gets again if it is evicted unchanged. It comes in write
+// protected, so its first write is seen
+void page_in(Chunk* chunk, size_t page) {
+    void* address = (void*)((size_t)chunk->pages_start + page * page_size);
+
+    if (test_bit(chunk->resident_map, page)) {
+        wake_page(address);  // another thread faulted on it first
+        return;
+    }
+
+    if (!test_bit(chunk->swapped_map, page) || pread(swap_fd, bounce_page, page_size,
+            (off_t)((chunk->swap_base + page) * page_size)) != (ssize_t)page_size) {
+        memset(bounce_page, 0, page_size);
+    }
+
+    struct uffdio_copy copy = {
+        .dst = (uint64_t)(size_t)address,
+        .src = (uint64_t)(size_t)bounce_page,
+        .len = page_size,
+        .mode = UFFDIO_COPY_MODE_WP
+    };
+
+    if (ioctl(fault_fd, UFFDIO_COPY, &copy) != 0) {
+        wake_page(address);
+        return;
+    }
+
+    set_bits(chunk->resident_map, page, 1, true);
+    set_bits(chunk->referenced_map, page, 1, true);
+    set_bits(chunk->protected_map, page, 1, true);
+    set_bits(chunk->modified_map, page, 1, false);
+    chunk->used_at[page] = now_ms();
+    ++resident_count;
+    ++fault_count;
+    evict_pages(chunk, page);
+}
+
+// down to the limit, except keep_page, which the faulting thread still has
+// to get to
+void evict_pages(Chunk* keep_chunk, size_t keep_page) {
+    while (resident_limit != 0 && resident_count > resident_limit
+            && evict_one(keep_chunk, keep_page)) {
+    }
+}
+
+// WSClock: the hand passes pages used since last time, marking them used
+// now. The first page out of the working set window which is clean goes,
+// dirty ones are written back on the way to be clean next time. Without
+// one in two turns, the oldest page seen goes, clean ones first
+bool evict_one(Chunk* keep_chunk, size_t keep_page) {
+    uint32_t now = now_ms();
+    Chunk* oldest_chunk = NULL;
+    size_t oldest_page = 0;
+    uint32_t oldest_age = 0;
+    bool oldest_clean = false;
+    size_t written = 0;
+
+    for (size_t seen = 0; seen < 2 * resident_count; ++seen) {
+        Chunk* chunk;
+        size_t page;
+
+        if (!next_resident_page(&chunk, &page)) {
+            break;
+        }
+
+        if (chunk == keep_chunk && page == keep_page) {
+            continue;
+        }
+
+        if (test_bit(chunk->referenced_map, page)) {
+            set_bits(chunk->referenced_map, page, 1, false);
+            chunk->used_at[page] = now;
+
+            if (!test_bit(chunk->protected_map, page)) {
+                protect_page(chunk, page, true);
+            }
+            continue;
+        }
+
+        uint32_t age = now - chunk->used_at[page];
+        bool is_old = age >= (uint64_t)working_set_ms;
+        bool clean = !test_bit(chunk->modified_map, page);
+
+        if (is_old && clean) {
+            return evict_page(chunk, page);
+        }
+
+        if (is_old && written < WRITE_BACK_BATCH) {
+            ++written;
+            clean = write_back(chunk, page);
+        }
+
+        if (oldest_chunk == NULL || (clean && !oldest_clean)
+                || (clean == oldest_clean && age > oldest_age)) {
+            oldest_chunk = chunk;
+            oldest_page = page;
+            oldest_age = age;
+            oldest_clean = clean;
+        }
+    }
+
+    return oldest_chunk != NULL && evict_page(oldest_chunk, oldest_page);
+}
+
+// moves the hand past the next resident page, false if there is none
+bool next_resident_page(Chunk** chunk_found, size_t* page_found) {
+    for (size_t turn = 0; turn <= chunk_count; ++turn) {
+        if (clock_chunk >= chunk_count) {
+            clock_chunk = clock_page = 0;
+        }
+
+        Chunk* chunk = chunks[clock_chunk];
+        size_t map_words = (chunk->page_count + 63) / 64;
+
+        for (size_t word = clock_page / 64; word < map_words; ++word) {
+            uint64_t bits = chunk->resident_map[word];
+
+            if (word == clock_page / 64) {
+                bits &= ~(uint64_t)0 << (clock_page % 64);
+            }
+
+            if (bits != 0) {
+                *chunk_found = chunk;
+                *page_found = word * 64 + __builtin_ctzll(bits);
+                clock_page = *page_found + 1;
+                return true;
+            }
+        }
+
+        ++clock_chunk;
+        clock_page = 0;
+    }
+    return false;
+}
+
+// protected first, so no write gets in between the copy and the drop. A
+// page which can not be protected or written back stays
+bool evict_page(Chunk* chunk, size_t page) {
+    if (!test_bit(chunk->protected_map, page)) {
+        protect_page(chunk, page, true);
+    }
+
+    if (!test_bit(chunk->protected_map, page)
+            || (test_bit(chunk->modified_map, page) && !write_back(chunk, page))) {
+        return false;
+    }
+
+    madvise((void*)((size_t)chunk->pages_start + page * page_size), page_size, MADV_DONTNEED);
+    set_bits(chunk->resident_map, page, 1, false);
+    set_bits(chunk->referenced_map, page, 1, false);
+    set_bits(chunk->protected_map, page, 1, false);
+    --resident_count;
+    ++eviction_count;
+    return true;
+}
+
+// the page must be protected, a write after it marks it modified again
+bool write_back(Chunk* chunk, size_t page) {
+    if (pwrite(swap_fd, (void*)((size_t)chunk->pages_start + page * page_size), page_size,
+            (off_t)((chunk->swap_base + page) * page_size)) != (ssize_t)page_size) {
+        return false;
+    }
+
+    set_bits(chunk->modified_map, page, 1, false);
+    set_bits(chunk->swapped_map, page, 1, true);
+    ++write_back_count;
+    return true;
+}
+
+// lifting the protection wakes the thread whose write faulted
+void protect_page(Chunk* chunk, size_t page, bool protect) {
+    struct uffdio_writeprotect range = {
+        .range = { .start = (uint64_t)(size_t)chunk->pages_start + page * page_size,
+                   .len = page_size },
+        .mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0
+    };
+
+    if (ioctl(fault_fd, UFFDIO_WRITEPROTECT, &range) == 0) {
+        set_bits(chunk->protected_map, page, 1, protect);
+    } else if (!protect) {
+        wake_page((void*)(size_t)range.range.start);
+    }
+}
+
+// the faulting thread tries again
+void wake_page(void* address) {
+    struct uffdio_range range = { .start = (uint64_t)(size_t)address, .len = page_size };
+    ioctl(fault_fd, UFFDIO_WAKE, &range);
+}
+
+bool test_bit(const uint64_t* map, size_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+size_t count_bits(const uint64_t* map, size_t first, size_t count) {
+    size_t bits = 0;
+
+    for (size_t bit = first; bit < first + count; ++bit) {
+        bits += test_bit(map, bit);
+    }
+    return bits;
+}
+#endif
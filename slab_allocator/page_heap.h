@@ -0,0 +1,110 @@
+#ifndef PAGE_HEAP_H
+#define PAGE_HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Page level part of the slab allocator: chunks of pages got from the OS,
+// their free page bitmaps and multi-page runs. Pages are page_size aligned.
+
+// -DSLAB_PAGE_SHIFT=21 gives 2 MiB pages, which are backed by transparent
+// huge pages where the kernel has them
+#ifndef SLAB_PAGE_SHIFT
+#define SLAB_PAGE_SHIFT 12
+#endif
+#define SLAB_PAGE_SIZE ((size_t)1 << SLAB_PAGE_SHIFT) // 4096 bytes by default
+
+#ifdef SLAB_OUTLINE_HEADERS
+// bytes kept for every page next to the page heap's own metadata, away from
+// the page, a cache line each
+#define SLAB_PAGE_META_SIZE 64
+#endif
+
+// most NUMA nodes the heap keeps page pools for, the bits of a word
+#define SLAB_MAX_NODES 64
+
+// called with one of the heap's pages by visit_pages
+typedef void (*PageVisitor)(size_t page_number, void* page, size_t run_length,
+                            bool is_free);
+
+// fixed heap of page_count pages, or a heap which maps chunks of at least
+// page_count pages when it runs out of pages. On a NUMA machine every node
+// has its own chunks (a fixed heap is split evenly between the nodes) bound
+// to it, and pages come from the chunks of the calling thread's node first;
+// with interleave there is a single pool whose chunks are spread over all
+// nodes. Binding is best effort: where mbind is missing or not allowed,
+// pages are placed by the kernel when first touched
+bool page_heap_init(size_t page_count, bool growable, bool interleave);
+
+bool page_heap_is_initialized();
+
+// number of page pools: one per node up to the highest online one, 1 without
+// NUMA or when interleaving
+size_t page_heap_node_count();
+
+// pool of the node the calling thread runs on, below page_heap_node_count
+size_t page_heap_node();
+
+// free pages go back to the OS (MADV_DONTNEED) once they were free for
+// decay_ms; freeing pages checks for them once per decay_ms. 0 gives them
+// back at once, a negative value only on page_heap_trim
+void page_heap_set_decay(long decay_ms);
+
+// give every free page which may still be resident back to the OS, returns
+// the bytes given back
+size_t page_heap_trim();
+
+// run of pages_number pages, given to user as one virtual page
+void* alloc_page_run(size_t pages_number);
+
+// run of pages_number pages whose address plus skew is a multiple of
+// alignment, a power of two above the page size; skew is a multiple of the
+// page size below alignment
+void* alloc_page_run_aligned(size_t pages_number, size_t alignment, size_t skew);
+
+// single page which is divided into blocks
+void* alloc_block_page();
+
+// grow or shrink the run starting at page to pages_number pages without moving
+// it, false if the following pages are not free
+bool resize_page_run(void* page, size_t pages_number);
+
+// free a run or a block page
+void free_pages(void* page);
+
+// number of pages of the run starting at addr, 0 for block pages
+size_t page_run_length(void* addr);
+
+bool page_in_heap(void* addr);
+
+#ifdef SLAB_OUTLINE_HEADERS
+// SLAB_PAGE_META_SIZE bytes kept for the page holding addr, NULL if addr is
+// not in the heap
+void* page_metadata(void* addr);
+#endif
+
+// bytes mapped from the OS (metadata included), pages of the heap and how
+// many of them are free
+void page_heap_usage(size_t* mapped_size, size_t* page_count, size_t* free_page_count);
+
+// overcommit, in builds with -DSLAB_PAGING: opens the swap file and starts
+// the thread which serves page faults. Called without the heap lock, the
+// thread may allocate while it is made; false if userfaultfd or the file is
+// not available. Later calls do nothing
+bool page_heap_start_paging(const char* swap_path);
+
+// at most resident_pages pages (none with 0) stay in RAM once paging was
+// started, pages used within window_ms are evicted last. The first call
+// puts the heap's chunks under paging, false if it could not
+bool page_heap_set_paging(size_t resident_pages, long window_ms);
+
+// counters of the pages brought in, dropped from RAM and written to the swap
+// file, and the pages in RAM and only in the swap file now
+void page_heap_paging_usage(uint64_t* faults, uint64_t* evictions, uint64_t* write_backs,
+                            size_t* resident_pages, size_t* swapped_pages);
+
+// visit every page in address order, runs are visited once by their first page
+void visit_pages(PageVisitor visitor);
+
+#endif